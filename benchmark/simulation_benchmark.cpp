@@ -0,0 +1,572 @@
+// Headless driver of the popcorn and SPH simulations.
+// Sets up the scenes without any window or rendering, steps them for a fixed number of frames
+// and reports the throughput for a sweep of particle counts.
+//
+// Usage: magical_popcorn_benchmark [--frames F] [--popcorn N1,N2,...] [--sph N1,N2,...] [--brute-force] [--no-sleeping] [--seed S]
+//                                  [--sph-isa automatic|reference|scalar|sse|avx2] [--symmetric] [--threads T1,T2,...] [--check] [--fixed-substeps] [--cups C] [--meshes]
+//                                  [--no-reorder] [--no-ccd] [--sequential-contacts] [--profile] [--trace file]
+//                                  [--domains D] [--inactive-domains I] [--serial-domains] [--sph-solver explicit|position-based] [--sph-dt DT]
+//                                  [--surface]
+// Every run is repeated for each thread count (0 = one thread per core) to measure the scaling.
+// --fixed-substeps disables the adaptive substepping (10 popcorn substeps and one SPH step per frame).
+// --cups sets the number of cup triggers of the popcorn scene, --meshes adds the table and pan meshes (run from the repository root).
+// --no-reorder keeps the particles in their initial order instead of reordering them along a Morton curve.
+// --no-ccd disables the continuous popcorn collisions (and goes back to the substep count needed without them).
+// --sequential-contacts resolves the popcorn contacts one after the other instead of color by color on the threads.
+// --domains splits the N fluid particles of a run into D domains stepped together (sph_domain_set), --inactive-domains adds
+// I domains that are never hit, --serial-domains steps the domains one after the other instead.
+// --sph-solver selects the SPH solver, stepped by --sph-dt seconds of simulated time per step (default 0.005). The fluid runs
+// also report the cost of one simulated second and the compression of the fluid relative to the rest density of the
+// position based solver.
+// --surface also reconstructs the surface of the fluid after every step (fluid_surface, not included in ns/step) and reports
+// its cost, the blocks it touched compared to a dense grid over the fluid, the share of the blocks rebuilt per step and
+// the blocks entirely inside the fluid.
+// --profile prints the time per step spent in each profiled scope (build with -DPROFILER=ON),
+// --trace also writes the scopes of the first run as a Chrome trace_event file.
+// --check also compares the popcorn scene stepped with each thread count, which must give the same result.
+
+#include "simulation.hpp"
+#include "thread_pool.hpp"
+#include "profiler.hpp"
+#include "fluid_surface.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+using namespace vcl;
+
+struct benchmark_parameters
+{
+    int frames = 100;
+    std::vector<size_t> popcorn_sizes = {250, 500, 1000, 2000, 4000};
+    std::vector<size_t> sph_sizes = {155, 620, 1550, 3100};
+    bool brute_force = false;
+    bool sleeping = true;
+    unsigned int seed = 42;
+    sph_kernel_isa sph_isa = sph_kernel_isa::automatic;
+    bool symmetric = false;
+    std::vector<size_t> thread_counts = {0};
+    bool check = false; // Compare every SPH kernel implementation against the reference one
+    bool adaptive = true; // Adaptive substeps
+    int cups = 2;         // Cup triggers in the popcorn scene
+    bool meshes = false;  // Collide the popcorns with the table and pan meshes (loaded from assets/)
+    bool reorder = true;  // Morton reordering of the particles (with the default triggers)
+    bool ccd = true;      // Continuous popcorn collisions
+    bool parallel_contacts = true;
+    bool profile = false; // Time of each profiled scope
+    size_t domains = 0;   // 0: a single fluid, otherwise the number of active fluid domains
+    size_t inactive_domains = 0;
+    bool serial_domains = false;
+    sph_solver solver = sph_solver::explicit_pressure;
+    float sph_dt = 0.005f;
+    bool surface = false; // Reconstruct the fluid surface after every step
+    std::string trace_file;
+};
+
+struct benchmark_result
+{
+    size_t N;        // Number of particles at the end of the run
+    size_t reorders; // Number of Morton reorderings during the run
+    size_t escaped;  // Popcorns that tunnelled out of the box of walls
+    double ns_step;  // Average time of one simulation step
+    double substeps; // Average number of substeps per step
+    triangle_bvh_stats mesh_stats;
+    double dt = 0;                 // Fluids: simulated time of a step
+    float compression_mean = 0;    // Fluids: relative excess of density over the rest density at the end of the run
+    float compression_max = 0;
+    double surface_ns = 0;         // Fluids: average time of a surface reconstruction (--surface)
+    double surface_blocks = 0;     // Average blocks of the surface, of a dense grid over the fluid, and rebuilt per step
+    double surface_bounding_blocks = 0;
+    double surface_rebuilt = 0;
+    double surface_interior = 0;
+    double surface_triangles = 0;
+};
+
+// Compression of the particles relative to the rest density of the position based solver
+void measure_compression(sph_particle_range particles, sph_parameters_structure const& sph_parameters, benchmark_result& result)
+{
+    float const rho_rest = sph_rest_density(sph_parameters);
+    double sum = 0;
+    for(sph_particle_element const& particle : particles) {
+        float const compression = std::max(particle.rho/rho_rest - 1.0f, 0.0f);
+        sum += compression;
+        result.compression_max = std::max(result.compression_max, compression);
+    }
+    result.compression_mean = particles.size()>0 ? float(sum/particles.size()) : 0.0f;
+}
+
+// Drop the measures taken before the run, and trace the first profiled run when asked
+void start_profile(benchmark_parameters const& parameters)
+{
+    static bool traced = false;
+    profiler::global().new_frame();
+    if(!parameters.trace_file.empty() && !traced) {
+        profiler::global().start_trace(parameters.trace_file, 1);
+        traced = true;
+    }
+}
+
+// Time per step of each scope measured since start_profile (the whole run is one profiler frame)
+void print_profile(int frames)
+{
+    profiler& p = profiler::global();
+    p.new_frame();
+    size_t const last = (p.history_offset()+profiler::history_size-1) % profiler::history_size;
+    for(profiler::scope_stats const& scope : p.stats()) {
+        if(scope.calls > 0)
+            std::printf("  %-20s %10.3f ms/step %8.1f calls/step\n", scope.name.c_str(), scope.history_ms[last]/frames, double(scope.calls)/frames);
+    }
+}
+
+std::vector<size_t> parse_sizes(std::string const& arg)
+{
+    std::vector<size_t> sizes;
+    size_t start = 0;
+    while(start < arg.size()) {
+        size_t end = arg.find(',', start);
+        if(end == std::string::npos)
+            end = arg.size();
+        sizes.push_back(std::stoul(arg.substr(start, end-start)));
+        start = end+1;
+    }
+    return sizes;
+}
+
+// Popcorn scene: N popcorns thrown from random positions inside the unit box
+std::vector<particle_structure> initialize_popcorn(size_t N)
+{
+    std::vector<particle_structure> particles(N);
+    for(size_t k=0; k<N; ++k) {
+        particle_structure& particle = particles[k];
+        particle.p = {rand_interval(-0.95f,0.95f), rand_interval(-0.95f,0.95f), rand_interval(-0.95f,0.95f)};
+        particle.v = {rand_interval(-2,2), rand_interval(-2,2), rand_interval(0,7)};
+        particle.c = {1,1,1};
+        particle.r = 0.045f;
+        particle.m = 0.5f;
+        particle.id = (unsigned int)k;
+    }
+    return particles;
+}
+
+// Table and pan meshes, with the same transforms as initialize_data in main.cpp
+void add_scene_meshes(collider_set& colliders)
+{
+    mat3 const rot = {
+            1.0,0,0,
+            0,float(cos(1.5708)),-1*float(sin(1.5708)),
+            0,float(sin(1.5708)),float(cos(1.5708))
+    };
+    affine_rts table_transform, pan_transform;
+    table_transform.rotate = pan_transform.rotate = rotation(rot);
+    table_transform.scale = 4.0f;
+    table_transform.translate = {-0.5f,-0.5f,-2.93f};
+    pan_transform.scale = 1/20.0f;
+    pan_transform.translate = {-1.0f,-1.0f,-1.08f};
+
+    std::vector<triangle> table_triangles, pan_triangles;
+    triangles_append(table_triangles, mesh_load_file_obj("assets/Wood_Table.obj"), table_transform);
+    triangles_append(pan_triangles, mesh_load_file_obj("assets/pan.obj"), pan_transform);
+    colliders.add_mesh(table_triangles);
+    colliders.add_mesh(pan_triangles);
+}
+
+// Walls of the popcorn scene and N_cup cup triggers on a regular grid on the floor
+//  With the meshes, the floor is lowered to the feet of the table as in main.cpp
+collider_set initialize_colliders(int N_cup, bool meshes)
+{
+    collider_set colliders;
+    collider_add_box_walls(colliders, {-1,-1,meshes ? -2.91f : -1.0f}, {1,1,1});
+    if(meshes)
+        add_scene_meshes(colliders);
+    int const N_side = int(std::ceil(std::sqrt(float(N_cup))));
+    for(int k=0; k<N_cup; ++k) {
+        float const x = -0.9f + 1.8f*(k%N_side + 0.5f)/N_side;
+        float const y = -0.9f + 1.8f*(k/N_side + 0.5f)/N_side;
+        collider cup = collider_cylinder({x,y,-1.0f}, {0,0,1}, 0.9f/N_side, 0.55f);
+        cup.trigger = true;
+        colliders.add(cup);
+    }
+    return colliders;
+}
+
+// SPH scene: same layered fill as initialize_sph in main.cpp, stopped after N particles
+buffer<sph_particle_element> initialize_sph(size_t N, sph_parameters_structure const& sph_parameters)
+{
+    float const s = sph_parameters.pbf_spacing;
+    int const N_x = 8, N_y = 16;
+    buffer<sph_particle_element> particles;
+    for(int k_layer=0; particles.size()<N; ++k_layer) {
+        float const z = 0.06f + k_layer*s;
+        for(int i=0; i<N_x && particles.size()<N; ++i) {
+            for(int j=0; j<N_y && particles.size()<N; ++j) {
+                float const x = 0.085f + i*s, y = (j-0.5f*N_y)*s;
+                sph_particle_element particle;
+                particle.p = {x+s/8*rand_interval(), y+s/8*rand_interval(), z+s/8*rand_interval()};
+                particle.id = (unsigned int)particles.size();
+                particles.push_back(particle);
+            }
+        }
+    }
+    return particles;
+}
+
+benchmark_result benchmark_popcorn(size_t N, benchmark_parameters const& parameters)
+{
+    std::vector<particle_structure> particles = initialize_popcorn(N);
+    collider_set colliders = initialize_colliders(parameters.cups, parameters.meshes);
+    popcorn_parameters_structure popcorn_parameters;
+    popcorn_parameters.use_grid_broad_phase = !parameters.brute_force;
+    popcorn_parameters.use_sleeping = parameters.sleeping;
+    popcorn_parameters.adaptive_substeps = parameters.adaptive;
+    popcorn_parameters.use_ccd = parameters.ccd;
+    popcorn_parameters.parallel_contacts = parameters.parallel_contacts;
+    if(!parameters.reorder) {
+        popcorn_parameters.reorder_period = 0;
+        popcorn_parameters.reorder_disorder = 0;
+    }
+
+    float const dt = 0.01f;
+    size_t N_substep = 0;
+    particle_reordering reordering;
+    popcorn_workspace workspace;
+    if(parameters.profile)
+        start_profile(parameters);
+    auto const t0 = std::chrono::steady_clock::now();
+    for(int k=0; k<parameters.frames; ++k) {
+        reorder_particles(particles, popcorn_parameters, reordering);
+        N_substep += simulate(particles, colliders, dt, popcorn_parameters, workspace);
+        colliders.dispatch_triggers([](collider const&) {});
+    }
+    auto const t1 = std::chrono::steady_clock::now();
+
+    float const floor = parameters.meshes ? -2.91f : -1.0f;
+    size_t N_escaped = 0;
+    for(particle_structure const& particle : particles)
+        N_escaped += (std::abs(particle.p.x)>1 || std::abs(particle.p.y)>1 || particle.p.z<floor || particle.p.z>1) ? 1 : 0;
+
+    return {particles.size(), reordering.reorders, N_escaped, std::chrono::duration<double, std::nano>(t1-t0).count()/parameters.frames, double(N_substep)/parameters.frames, colliders.mesh_stats};
+}
+
+sph_parameters_structure benchmark_sph_parameters(benchmark_parameters const& parameters)
+{
+    sph_parameters_structure sph_parameters;
+    sph_parameters.isa = parameters.sph_isa;
+    sph_parameters.symmetric_forces = parameters.symmetric;
+    sph_parameters.adaptive_time_step = parameters.adaptive;
+    sph_parameters.solver = parameters.solver;
+    if(!parameters.reorder) {
+        sph_parameters.reorder_period = 0;
+        sph_parameters.reorder_disorder = 0;
+    }
+    return sph_parameters;
+}
+
+benchmark_result benchmark_sph(size_t N, benchmark_parameters const& parameters)
+{
+    sph_parameters_structure const sph_parameters = benchmark_sph_parameters(parameters);
+    buffer<sph_particle_element> particles = initialize_sph(N, sph_parameters);
+
+    float const dt = parameters.sph_dt;
+    size_t N_substep = 0;
+    particle_reordering reordering;
+    sph_workspace workspace;
+    fluid_surface surface;
+    std::vector<vec3> positions;
+    fluid_surface_stats surface_sum;
+    double surface_ns = 0;
+    if(parameters.profile)
+        start_profile(parameters);
+    auto const t0 = std::chrono::steady_clock::now();
+    for(int k=0; k<parameters.frames; ++k) {
+        reorder_particles(particles, sph_parameters, reordering);
+        N_substep += simulate(dt, particles, sph_parameters, workspace);
+
+        if(parameters.surface) {
+            auto const t_surface = std::chrono::steady_clock::now();
+            positions.resize(particles.size());
+            for(size_t i=0; i<particles.size(); ++i)
+                positions[i] = particles[i].p;
+            surface.update(positions);
+            surface_ns += std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now()-t_surface).count();
+            surface_sum.blocks += surface.stats().blocks;
+            surface_sum.bounding_blocks += surface.stats().bounding_blocks;
+            surface_sum.rebuilt += surface.stats().rebuilt;
+            surface_sum.interior += surface.stats().interior;
+            surface_sum.triangles += surface.stats().triangles;
+        }
+    }
+    auto const t1 = std::chrono::steady_clock::now();
+
+    benchmark_result result = {particles.size(), reordering.reorders, 0, (std::chrono::duration<double, std::nano>(t1-t0).count()-surface_ns)/parameters.frames,
+                               double(N_substep)/parameters.frames, triangle_bvh_stats()};
+    result.dt = dt;
+    result.surface_ns = surface_ns/parameters.frames;
+    result.surface_blocks = double(surface_sum.blocks)/parameters.frames;
+    result.surface_bounding_blocks = double(surface_sum.bounding_blocks)/parameters.frames;
+    result.surface_rebuilt = double(surface_sum.rebuilt)/parameters.frames;
+    result.surface_interior = double(surface_sum.interior)/parameters.frames;
+    result.surface_triangles = double(surface_sum.triangles)/parameters.frames;
+    measure_compression(particles, sph_parameters, result);
+    return result;
+}
+
+// N fluid particles split into parameters.domains domains of the same size (substeps: average per domain)
+benchmark_result benchmark_sph_domains(size_t N, benchmark_parameters const& parameters)
+{
+    sph_parameters_structure const sph_parameters = benchmark_sph_parameters(parameters);
+    buffer<sph_particle_element> const domain_particles = initialize_sph(std::max<size_t>(N/parameters.domains, 1), sph_parameters);
+    sph_domain_set fluids;
+    for(size_t d=0; d<parameters.domains+parameters.inactive_domains; ++d)
+        fluids.add(domain_particles, {0,0,0}, sph_parameters, d<parameters.domains);
+
+    float const dt = parameters.sph_dt;
+    size_t N_substep = 0;
+    if(parameters.profile)
+        start_profile(parameters);
+    auto const t0 = std::chrono::steady_clock::now();
+    for(int k=0; k<parameters.frames; ++k) {
+        reorder_particles(fluids);
+        if(parameters.serial_domains) {
+            for(size_t d=0; d<parameters.domains; ++d)
+                N_substep += simulate(dt, fluids.range(d), fluids.domains[d].parameters, fluids.domains[d].workspace);
+        }
+        else {
+            simulate(dt, fluids);
+            for(sph_domain const& domain : fluids.domains)
+                N_substep += domain.substeps;
+        }
+    }
+    auto const t1 = std::chrono::steady_clock::now();
+
+    size_t N_reorder = 0;
+    for(sph_domain const& domain : fluids.domains)
+        N_reorder += domain.reordering.reorders;
+    benchmark_result result = {parameters.domains*domain_particles.size(), N_reorder, 0, std::chrono::duration<double, std::nano>(t1-t0).count()/parameters.frames,
+                               double(N_substep)/(parameters.frames*parameters.domains), triangle_bvh_stats()};
+    result.dt = dt;
+    measure_compression(fluids.range(0), sph_parameters, result);
+    return result;
+}
+
+// Step the same SPH state with each kernel implementation and report the largest deviation from the reference loops
+void check_sph(size_t N, benchmark_parameters const& parameters)
+{
+    sph_parameters_structure sph_parameters;
+    sph_parameters.adaptive_time_step = false; // Same steps for every implementation
+    buffer<sph_particle_element> const initial = initialize_sph(N, sph_parameters);
+    unsigned int const seed = std::rand(); // Same random perturbations in the collisions for every run
+
+    buffer<sph_particle_element> reference;
+    for(int variant=0; variant<5; ++variant) {
+        // The last variant is the symmetric force computation
+        sph_kernel_isa const isa = variant<4 ? sph_kernel_isa(int(sph_kernel_isa::reference)+variant) : sph_kernel_isa::scalar;
+        char const* name = variant<4 ? sph_kernel_isa_name(isa) : "symmetric";
+        if(sph_kernel_isa_resolve(isa) != isa) {
+            std::printf("check    %8zu %-9s not supported by this CPU\n", N, name);
+            continue;
+        }
+
+        buffer<sph_particle_element> particles = initial;
+        sph_workspace workspace;
+        sph_parameters.isa = isa;
+        sph_parameters.symmetric_forces = (variant==4);
+        std::srand(seed);
+        for(int k=0; k<parameters.frames; ++k)
+            simulate(0.005f, particles, sph_parameters, workspace);
+        if(isa == sph_kernel_isa::reference) {
+            reference = particles;
+            continue;
+        }
+
+        float error_rho = 0, error_p = 0;
+        for(size_t k=0; k<particles.size(); ++k) {
+            error_rho = std::max(error_rho, std::abs(particles[k].rho-reference[k].rho)/reference[k].rho);
+            error_p = std::max(error_p, norm(particles[k].p-reference[k].p));
+        }
+        std::printf("check    %8zu %-9s max relative density error %.2e, max position error %.2e\n", N, name, error_rho, error_p);
+    }
+
+    // A set of one domain against the loops of a single fluid, with the same kernels: the results must be identical
+    sph_parameters.isa = sph_kernel_isa::automatic;
+    sph_parameters.symmetric_forces = false;
+    buffer<sph_particle_element> single = initial;
+    sph_workspace workspace;
+    std::srand(seed);
+    for(int k=0; k<parameters.frames; ++k)
+        simulate(0.005f, single, sph_parameters, workspace);
+    sph_domain_set fluids;
+    fluids.add(initial, {0,0,0}, sph_parameters, true);
+    std::srand(seed);
+    for(int k=0; k<parameters.frames; ++k)
+        simulate(0.005f, fluids);
+    float error_rho = 0, error_p = 0;
+    for(size_t k=0; k<single.size(); ++k) {
+        error_rho = std::max(error_rho, std::abs(fluids.particles[k].rho-single[k].rho)/single[k].rho);
+        error_p = std::max(error_p, norm(fluids.particles[k].p-single[k].p));
+    }
+    std::printf("check    %8zu %-9s max relative density error %.2e, max position error %.2e against a single fluid\n", N, "domains", error_rho, error_p);
+}
+
+// Step the same popcorn scene with each thread count and report the largest deviation from the first one
+void check_popcorn(size_t N, benchmark_parameters const& parameters)
+{
+    std::vector<particle_structure> const initial = initialize_popcorn(N);
+    popcorn_parameters_structure popcorn_parameters;
+    popcorn_parameters.use_grid_broad_phase = !parameters.brute_force;
+    popcorn_parameters.use_sleeping = parameters.sleeping;
+    popcorn_parameters.use_ccd = parameters.ccd;
+    popcorn_parameters.parallel_contacts = parameters.parallel_contacts;
+
+    std::vector<particle_structure> reference;
+    size_t reference_threads = 0;
+    for(size_t N_thread : parameters.thread_counts) {
+        thread_pool::global().set_thread_count(N_thread);
+        std::vector<particle_structure> particles = initial;
+        collider_set colliders = initialize_colliders(parameters.cups, parameters.meshes);
+        popcorn_workspace workspace;
+        for(int k=0; k<parameters.frames; ++k) {
+            simulate(particles, colliders, 0.01f, popcorn_parameters, workspace);
+            colliders.dispatch_triggers([](collider const&) {});
+        }
+        if(reference.empty()) {
+            reference = particles;
+            reference_threads = thread_pool::global().thread_count();
+            continue;
+        }
+
+        float error_p = 0;
+        for(size_t k=0; k<particles.size(); ++k)
+            error_p = std::max(error_p, norm(particles[k].p-reference[k].p));
+        std::printf("check    %8zu popcorn   %zu threads: max position error %.2e against %zu threads\n", N, thread_pool::global().thread_count(),
+                    error_p, reference_threads);
+    }
+}
+
+void print_result(char const* scene, benchmark_result const& result)
+{
+    std::printf("%-8s %8zu %8zu %14.0f %12.1f %9.2f %8zu\n", scene, thread_pool::global().thread_count(), result.N, result.ns_step, 1e9/result.ns_step, result.substeps, result.reorders);
+
+    if(result.escaped > 0)
+        std::printf("  %zu popcorns tunnelled out of the box\n", result.escaped);
+    if(result.dt > 0)
+        std::printf("  %.1f ms per simulated second, compression: mean %.3f, max %.3f\n", 1e-6*result.ns_step/result.dt, result.compression_mean, result.compression_max);
+    if(result.surface_ns > 0)
+        std::printf("  surface %.3f ms: %.0f triangles, %.1f blocks (dense grid %.1f, %.1f interior), %.1f rebuilt per step\n", 1e-6*result.surface_ns,
+                    result.surface_triangles, result.surface_blocks, result.surface_bounding_blocks, result.surface_interior, result.surface_rebuilt);
+
+    triangle_bvh_stats const& stats = result.mesh_stats;
+    if(stats.queries > 0)
+        std::printf("  mesh queries %zu: %.1f nodes, %.2f triangles and %.3f contacts per query\n", stats.queries,
+                    double(stats.nodes_visited)/stats.queries, double(stats.triangles_tested)/stats.queries, double(stats.contacts)/stats.queries);
+}
+
+int main(int argc, char* argv[])
+{
+    benchmark_parameters parameters;
+    for(int k=1; k<argc; ++k) {
+        std::string const arg = argv[k];
+        bool const has_value = k+1<argc;
+        if(arg=="--frames" && has_value)
+            parameters.frames = std::stoi(argv[++k]);
+        else if(arg=="--popcorn" && has_value)
+            parameters.popcorn_sizes = parse_sizes(argv[++k]);
+        else if(arg=="--sph" && has_value)
+            parameters.sph_sizes = parse_sizes(argv[++k]);
+        else if(arg=="--brute-force")
+            parameters.brute_force = true;
+        else if(arg=="--no-sleeping")
+            parameters.sleeping = false;
+        else if(arg=="--seed" && has_value)
+            parameters.seed = std::stoul(argv[++k]);
+        else if(arg=="--sph-isa" && has_value) {
+            std::string const name = argv[++k];
+            for(sph_kernel_isa isa : {sph_kernel_isa::automatic, sph_kernel_isa::reference, sph_kernel_isa::scalar, sph_kernel_isa::sse, sph_kernel_isa::avx2})
+                if(name == sph_kernel_isa_name(isa))
+                    parameters.sph_isa = isa;
+        }
+        else if(arg=="--symmetric")
+            parameters.symmetric = true;
+        else if(arg=="--threads" && has_value)
+            parameters.thread_counts = parse_sizes(argv[++k]);
+        else if(arg=="--check")
+            parameters.check = true;
+        else if(arg=="--fixed-substeps")
+            parameters.adaptive = false;
+        else if(arg=="--cups" && has_value)
+            parameters.cups = std::stoi(argv[++k]);
+        else if(arg=="--meshes")
+            parameters.meshes = true;
+        else if(arg=="--no-reorder")
+            parameters.reorder = false;
+        else if(arg=="--no-ccd")
+            parameters.ccd = false;
+        else if(arg=="--sequential-contacts")
+            parameters.parallel_contacts = false;
+        else if(arg=="--domains" && has_value)
+            parameters.domains = std::stoul(argv[++k]);
+        else if(arg=="--inactive-domains" && has_value)
+            parameters.inactive_domains = std::stoul(argv[++k]);
+        else if(arg=="--serial-domains")
+            parameters.serial_domains = true;
+        else if(arg=="--sph-solver" && has_value) {
+            std::string const name = argv[++k];
+            parameters.solver = name=="position-based" ? sph_solver::position_based : sph_solver::explicit_pressure;
+        }
+        else if(arg=="--sph-dt" && has_value)
+            parameters.sph_dt = std::stof(argv[++k]);
+        else if(arg=="--surface")
+            parameters.surface = true;
+        else if(arg=="--profile")
+            parameters.profile = true;
+        else if(arg=="--trace" && has_value) {
+            parameters.profile = true;
+            parameters.trace_file = argv[++k];
+        }
+        else {
+            std::fprintf(stderr, "Usage: %s [--frames F] [--popcorn N1,N2,...] [--sph N1,N2,...] [--brute-force] [--no-sleeping] [--seed S] [--sph-isa automatic|reference|scalar|sse|avx2] [--symmetric] [--threads T1,T2,...] [--check] [--fixed-substeps] [--cups C] [--meshes] [--no-reorder] [--no-ccd] [--sequential-contacts] [--profile] [--trace file] [--domains D] [--inactive-domains I] [--serial-domains] [--sph-solver explicit|position-based] [--sph-dt DT] [--surface]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    std::printf("frames per run: %d, seed: %u, popcorn broad phase: %s%s%s, %s contacts, sph kernels: %s%s, %s sph solver, sph dt %g s\n", parameters.frames, parameters.seed,
+                parameters.brute_force ? "brute force" : "grid", parameters.sleeping ? " with sleeping" : "", parameters.ccd ? ", continuous collisions" : "",
+                parameters.parallel_contacts ? "parallel" : "sequential", sph_kernel_isa_name(sph_kernel_isa_resolve(parameters.sph_isa)),
+                parameters.symmetric ? " (symmetric forces)" : "", parameters.solver==sph_solver::position_based ? "position based" : "explicit", parameters.sph_dt);
+    std::printf("%-8s %8s %8s %14s %12s %9s %8s\n", "scene", "threads", "N", "ns/step", "steps/s", "substeps", "reorders");
+
+    for(size_t N_thread : parameters.thread_counts) {
+        thread_pool::global().set_thread_count(N_thread);
+        for(size_t N : parameters.popcorn_sizes) {
+            std::srand(parameters.seed);
+            print_result("popcorn", benchmark_popcorn(N, parameters));
+            if(parameters.profile)
+                print_profile(parameters.frames);
+        }
+        for(size_t N : parameters.sph_sizes) {
+            std::srand(parameters.seed);
+            if(parameters.domains > 0)
+                print_result("domains", benchmark_sph_domains(N, parameters));
+            else
+                print_result("sph", benchmark_sph(N, parameters));
+            if(parameters.profile)
+                print_profile(parameters.frames);
+        }
+    }
+    if(parameters.check) {
+        for(size_t N : parameters.popcorn_sizes) {
+            std::srand(parameters.seed);
+            check_popcorn(N, parameters);
+        }
+        for(size_t N : parameters.sph_sizes) {
+            std::srand(parameters.seed);
+            check_sph(N, parameters);
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,366 @@
+#include "asset_cache.hpp"
+#include "mesh_simplification.hpp"
+
+#include <cstdio>
+#include <cstring>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <direct.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace vcl;
+
+#ifdef _WIN32
+mapped_file::mapped_file(std::string const& filename)
+{
+    file_handle = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if(file_handle == INVALID_HANDLE_VALUE) {
+        file_handle = nullptr;
+        return;
+    }
+    LARGE_INTEGER file_size;
+    if(!GetFileSizeEx(file_handle, &file_size) || file_size.QuadPart == 0)
+        return;
+    mapping_handle = CreateFileMappingA(file_handle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if(mapping_handle == nullptr)
+        return;
+    bytes = static_cast<unsigned char const*>(MapViewOfFile(mapping_handle, FILE_MAP_READ, 0, 0, 0));
+    if(bytes != nullptr)
+        length = size_t(file_size.QuadPart);
+}
+
+mapped_file::~mapped_file()
+{
+    if(bytes != nullptr)
+        UnmapViewOfFile(bytes);
+    if(mapping_handle != nullptr)
+        CloseHandle(mapping_handle);
+    if(file_handle != nullptr)
+        CloseHandle(file_handle);
+}
+#else
+mapped_file::mapped_file(std::string const& filename)
+{
+    int const fd = open(filename.c_str(), O_RDONLY);
+    if(fd < 0)
+        return;
+    struct stat file_stat;
+    if(fstat(fd, &file_stat) == 0 && file_stat.st_size > 0) {
+        void* const p = mmap(nullptr, size_t(file_stat.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+        if(p != MAP_FAILED) {
+            bytes = static_cast<unsigned char const*>(p);
+            length = size_t(file_stat.st_size);
+        }
+    }
+    close(fd); // The mapping remains valid
+}
+
+mapped_file::~mapped_file()
+{
+    if(bytes != nullptr)
+        munmap(const_cast<unsigned char*>(bytes), length);
+}
+#endif
+
+
+uint64_t asset_hash(void const* data, size_t size, uint64_t hash)
+{
+    unsigned char const* p = static_cast<unsigned char const*>(data);
+    for(size_t k=0; k<size; ++k) {
+        hash ^= p[k];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+namespace
+{
+    // Increment when the layout of an entry or the preprocessing changes: every entry is then rebuilt
+    uint32_t const asset_cache_version = 1;
+
+    enum : uint32_t { asset_kind_mesh = 1, asset_kind_texture = 2 };
+
+    // Header of an entry, followed by payload_size bytes
+    //  mesh: count = {N_vertex, N_triangle}, payload = position, normal, color (vec3), uv (vec2), connectivity (uint3)
+    //  texture: count = {width, height}, payload = width*height RGBA texels
+    //  The size of the header is a multiple of 8 so that the arrays of the payload are aligned in the mapping.
+    struct asset_header
+    {
+        char magic[4];
+        uint32_t version;
+        uint32_t kind;
+        uint32_t count[2];
+        uint32_t padding;
+        uint64_t source_hash; // Hash of the source file, the preprocessing parameters and the version
+        uint64_t payload_size;
+    };
+    char const asset_magic[4] = {'M','P','A','C'};
+
+    size_t mesh_payload_size(uint32_t const count[2])
+    {
+        return size_t(count[0])*(3*sizeof(vec3)+sizeof(vec2)) + size_t(count[1])*sizeof(uint3);
+    }
+    size_t texture_payload_size(uint32_t const count[2])
+    {
+        return size_t(count[0])*count[1]*4;
+    }
+
+    bool read_file(std::string const& filename, std::vector<unsigned char>& content)
+    {
+        FILE* f = std::fopen(filename.c_str(), "rb");
+        if(f == nullptr)
+            return false;
+        std::fseek(f, 0, SEEK_END);
+        long const size = std::ftell(f);
+        std::fseek(f, 0, SEEK_SET);
+        content.resize(size > 0 ? size_t(size) : 0);
+        bool const ok = size >= 0 && std::fread(content.data(), 1, content.size(), f) == content.size();
+        std::fclose(f);
+        return ok;
+    }
+
+    // assets/pan.obj -> <directory>/assets_pan.obj.bin (variant: assets/pan.obj.lod1 -> assets_pan.obj.lod1.bin)
+    std::string cache_filename(std::string const& directory, std::string const& source_file, std::string const& variant)
+    {
+        std::string name = source_file + variant;
+        for(char& c : name) {
+            if(c=='/' || c=='\\' || c==':')
+                c = '_';
+        }
+        return directory + "/" + name + ".bin";
+    }
+
+    void make_directory(std::string const& directory)
+    {
+#ifdef _WIN32
+        _mkdir(directory.c_str());
+#else
+        mkdir(directory.c_str(), 0755);
+#endif
+    }
+
+    template <typename T>
+    void payload_append(std::vector<unsigned char>& payload, buffer<T> const& data)
+    {
+        size_t const offset = payload.size();
+        payload.resize(offset + data.size()*sizeof(T));
+        if(data.size() > 0)
+            std::memcpy(payload.data()+offset, &data[0], data.size()*sizeof(T));
+    }
+}
+
+asset_cache::asset_cache(std::string const& directory_arg)
+    :directory(directory_arg)
+{}
+
+unsigned char const* asset_cache::entry(std::string const& source_file, std::string const& variant, uint32_t kind, uint64_t parameters_hash,
+                                        size_t (*payload_size)(uint32_t const count[2]), build_function const& build, uint32_t count[2], bool& cached)
+{
+    // The hash covers the source even when the entry is valid: an edited asset is detected without relying on file dates
+    std::vector<unsigned char> source;
+    read_file(source_file, source);
+    uint64_t source_hash = asset_hash(&asset_cache_version, sizeof(asset_cache_version), parameters_hash);
+    source_hash = asset_hash(source.data(), source.size(), source_hash);
+
+    std::string const cache_file = cache_filename(directory, source_file, variant);
+    {
+        std::unique_ptr<mapped_file> file(new mapped_file(cache_file));
+        asset_header header;
+        if(file->size() >= sizeof(asset_header)) {
+            std::memcpy(&header, file->data(), sizeof(asset_header));
+            bool const valid = std::memcmp(header.magic, asset_magic, 4)==0 && header.version==asset_cache_version
+                    && header.kind==kind && header.source_hash==source_hash
+                    && header.payload_size==payload_size(header.count) && file->size()==sizeof(asset_header)+header.payload_size;
+            if(valid) {
+                hits++;
+                cached = true;
+                count[0] = header.count[0];
+                count[1] = header.count[1];
+                unsigned char const* payload = file->data() + sizeof(asset_header);
+                std::lock_guard<std::mutex> lock(mutex);
+                files.push_back(std::move(file));
+                return payload;
+            }
+        }
+    } // The stale mapping is released before the file is replaced
+
+    // Rebuild the entry from the source, then write it (to a temporary file renamed at the end, so that an interrupted
+    // write never leaves a truncated entry) and map it
+    rebuilds++;
+    cached = false;
+    std::vector<unsigned char> payload;
+    asset_header header;
+    std::memcpy(header.magic, asset_magic, 4);
+    header.version = asset_cache_version;
+    header.kind = kind;
+    build(payload, header.count);
+    header.padding = 0;
+    header.source_hash = source_hash;
+    header.payload_size = payload.size();
+    count[0] = header.count[0];
+    count[1] = header.count[1];
+
+    make_directory(directory);
+    std::string const temporary_file = cache_file + ".tmp";
+    bool written = false;
+    if(FILE* f = std::fopen(temporary_file.c_str(), "wb")) {
+        written = std::fwrite(&header, sizeof(asset_header), 1, f)==1 && std::fwrite(payload.data(), 1, payload.size(), f)==payload.size();
+        written = (std::fclose(f)==0) && written;
+#ifdef _WIN32
+        std::remove(cache_file.c_str());
+#endif
+        written = written && std::rename(temporary_file.c_str(), cache_file.c_str())==0;
+    }
+    if(written) {
+        std::unique_ptr<mapped_file> file(new mapped_file(cache_file));
+        if(file->size() == sizeof(asset_header)+payload.size()) {
+            unsigned char const* mapped_payload = file->data() + sizeof(asset_header);
+            std::lock_guard<std::mutex> lock(mutex);
+            files.push_back(std::move(file));
+            return mapped_payload;
+        }
+    }
+
+    // The cache directory is not writable: keep the entry in memory for this run
+    std::remove(temporary_file.c_str());
+    std::lock_guard<std::mutex> lock(mutex);
+    unmapped.push_back(std::move(payload));
+    return unmapped.back().data();
+}
+
+mesh_asset asset_cache::mesh(std::string const& obj_file, mat3 const& rotate, float scale, unsigned int lod)
+{
+    uint64_t parameters_hash = asset_hash(&rotate, sizeof(mat3));
+    parameters_hash = asset_hash(&scale, sizeof(float), parameters_hash);
+    if(lod > 0) // The full resolution entries keep their hash
+        parameters_hash = asset_hash(&lod, sizeof(lod), parameters_hash);
+
+    mesh_asset asset;
+    uint32_t count[2];
+    unsigned char const* payload = entry(obj_file, lod>0 ? ".lod"+std::to_string(lod) : "", asset_kind_mesh, parameters_hash, mesh_payload_size,
+        [&](std::vector<unsigned char>& data, uint32_t N[2]) {
+            vcl::mesh m = mesh_load_file_obj(obj_file);
+            for(size_t k=0; k<m.position.size(); ++k)
+                m.position[k] = scale*(rotate*m.position[k]);
+            if(lod > 0)
+                m = mesh_simplify(m, mesh_lod_triangles(m.connectivity.size(), lod));
+            m.fill_empty_field();
+
+            N[0] = uint32_t(m.position.size());
+            N[1] = uint32_t(m.connectivity.size());
+            payload_append(data, m.position);
+            payload_append(data, m.normal);
+            payload_append(data, m.color);
+            payload_append(data, m.uv);
+            payload_append(data, m.connectivity);
+        }, count, asset.cached);
+
+    asset.N_vertex = count[0];
+    asset.N_triangle = count[1];
+    asset.position = reinterpret_cast<vec3 const*>(payload);
+    asset.normal = asset.position + asset.N_vertex;
+    asset.color = asset.normal + asset.N_vertex;
+    asset.uv = reinterpret_cast<vec2 const*>(asset.color + asset.N_vertex);
+    asset.connectivity = reinterpret_cast<uint3 const*>(asset.uv + asset.N_vertex);
+    return asset;
+}
+
+texture_asset asset_cache::texture(std::string const& png_file)
+{
+    texture_asset asset;
+    uint32_t count[2];
+    unsigned char const* payload = entry(png_file, "", asset_kind_texture, asset_hash(nullptr, 0), texture_payload_size,
+        [&](std::vector<unsigned char>& data, uint32_t N[2]) {
+            image_raw const im = image_load_png(png_file);
+            N[0] = im.width;
+            N[1] = im.height;
+            size_t const N_texel = size_t(im.width)*im.height;
+            if(im.color_type == image_color_type::rgba) {
+                payload_append(data, im.data);
+            }
+            else {
+                data.resize(4*N_texel);
+                for(size_t k=0; k<N_texel; ++k) {
+                    data[4*k+0] = im.data[3*k+0];
+                    data[4*k+1] = im.data[3*k+1];
+                    data[4*k+2] = im.data[3*k+2];
+                    data[4*k+3] = 255;
+                }
+            }
+        }, count, asset.cached);
+
+    asset.width = count[0];
+    asset.height = count[1];
+    asset.rgba = payload;
+    return asset;
+}
+
+
+namespace
+{
+    GLuint opengl_buffer_from_memory(GLenum target, void const* data, size_t size)
+    {
+        GLuint id = 0;
+        glGenBuffers(1, &id);
+        glBindBuffer(target, id);
+        glBufferData(target, GLsizeiptr(size), data, GL_STATIC_DRAW);
+        glBindBuffer(target, 0);
+        return id;
+    }
+
+    void opengl_vertex_attribute(GLuint location, GLuint vbo, GLint dimension)
+    {
+        glBindBuffer(GL_ARRAY_BUFFER, vbo);
+        glEnableVertexAttribArray(location);
+        glVertexAttribPointer(location, dimension, GL_FLOAT, GL_FALSE, 0, nullptr);
+    }
+}
+
+mesh_drawable mesh_drawable_from_asset(mesh_asset const& asset, GLuint shader, GLuint texture)
+{
+    mesh_drawable drawable;
+    drawable.shader = shader;
+    drawable.texture = texture;
+
+    // The buffers are filled directly from the mapped pages
+    drawable.vbo["position"] = opengl_buffer_from_memory(GL_ARRAY_BUFFER, asset.position, asset.N_vertex*sizeof(vec3));
+    drawable.vbo["normal"] = opengl_buffer_from_memory(GL_ARRAY_BUFFER, asset.normal, asset.N_vertex*sizeof(vec3));
+    drawable.vbo["color"] = opengl_buffer_from_memory(GL_ARRAY_BUFFER, asset.color, asset.N_vertex*sizeof(vec3));
+    drawable.vbo["uv"] = opengl_buffer_from_memory(GL_ARRAY_BUFFER, asset.uv, asset.N_vertex*sizeof(vec2));
+    drawable.vbo["index"] = opengl_buffer_from_memory(GL_ELEMENT_ARRAY_BUFFER, asset.connectivity, asset.N_triangle*sizeof(uint3));
+    drawable.number_triangles = GLuint(asset.N_triangle);
+
+    glGenVertexArrays(1, &drawable.vao);
+    glBindVertexArray(drawable.vao);
+    opengl_vertex_attribute(0, drawable.vbo["position"], 3);
+    opengl_vertex_attribute(1, drawable.vbo["normal"], 3);
+    opengl_vertex_attribute(2, drawable.vbo["color"], 3);
+    opengl_vertex_attribute(3, drawable.vbo["uv"], 2);
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    return drawable;
+}
+
+GLuint opengl_texture_from_asset(texture_asset const& asset, GLint wrap_s, GLint wrap_t)
+{
+    GLuint id = 0;
+    glGenTextures(1, &id);
+    glBindTexture(GL_TEXTURE_2D, id);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, GLsizei(asset.width), GLsizei(asset.height), 0, GL_RGBA, GL_UNSIGNED_BYTE, asset.rgba);
+    glGenerateMipmap(GL_TEXTURE_2D);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, wrap_s);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, wrap_t);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    return id;
+}
@@ -0,0 +1,99 @@
+#pragma once
+
+#include "vcl/vcl.hpp"
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Read-only memory mapping of a whole file (empty when the file cannot be opened)
+class mapped_file
+{
+public:
+    explicit mapped_file(std::string const& filename);
+    ~mapped_file();
+    mapped_file(mapped_file const&) = delete;
+    mapped_file& operator=(mapped_file const&) = delete;
+
+    unsigned char const* data() const { return bytes; }
+    size_t size() const { return length; }
+
+private:
+    unsigned char const* bytes = nullptr;
+    size_t length = 0;
+#ifdef _WIN32
+    void* file_handle = nullptr;
+    void* mapping_handle = nullptr;
+#endif
+};
+
+
+// Mesh stored in the cache, after the transformation of its positions and with every field filled
+//  The pointers reference the mapped cache file and remain valid as long as the asset_cache.
+struct mesh_asset
+{
+    size_t N_vertex = 0;
+    size_t N_triangle = 0;
+    vcl::vec3 const* position = nullptr;
+    vcl::vec3 const* normal = nullptr;
+    vcl::vec3 const* color = nullptr;
+    vcl::vec2 const* uv = nullptr;
+    vcl::uint3 const* connectivity = nullptr;
+    bool cached = false; // Loaded from the cache (false: rebuilt from the source)
+};
+
+// RGBA texture stored in the cache, rows in the order of image_load_png
+struct texture_asset
+{
+    unsigned int width = 0;
+    unsigned int height = 0;
+    unsigned char const* rgba = nullptr;
+    bool cached = false;
+};
+
+// Binary cache of the preprocessed assets
+//  Each asset is a file of the cache directory: a versioned header followed by the raw arrays, mapped in memory when loaded.
+//  The header stores a hash of the content of the source file and of the preprocessing parameters: when the source or
+//  the parameters change (or the format version), the entry is rebuilt from the source and written again.
+//  Different files can be loaded concurrently from several threads.
+class asset_cache
+{
+public:
+    explicit asset_cache(std::string const& directory = "cache");
+
+    // Mesh of an OBJ file with the positions transformed to scale*rotate*p
+    //  lod > 0 simplifies the mesh to mesh_lod_triangles(N_triangle, lod) triangles (see mesh_simplify), stored in its own entry.
+    mesh_asset mesh(std::string const& obj_file, vcl::mat3 const& rotate = vcl::rotation().matrix(), float scale = 1.0f, unsigned int lod = 0);
+    // Texels of a PNG file, converted to RGBA
+    texture_asset texture(std::string const& png_file);
+
+    // Entries loaded from the cache, and rebuilt from their source
+    std::atomic<size_t> hits{0};
+    std::atomic<size_t> rebuilds{0};
+
+private:
+    // Fills the payload of an entry and its two counts from the source
+    typedef std::function<void(std::vector<unsigned char>& payload, uint32_t count[2])> build_function;
+
+    // Payload of the entry of source_file (variant: suffix of the entry name for other versions of the same file),
+    //  mapped from the cache or rebuilt
+    unsigned char const* entry(std::string const& source_file, std::string const& variant, uint32_t kind, uint64_t parameters_hash,
+                               size_t (*payload_size)(uint32_t const count[2]), build_function const& build, uint32_t count[2], bool& cached);
+
+    std::string directory;
+    std::mutex mutex;                                // Protects files and unmapped
+    std::vector<std::unique_ptr<mapped_file>> files; // Keeps the loaded entries mapped
+    std::deque<std::vector<unsigned char>> unmapped; // Entries that could not be written to the cache directory
+};
+
+// 64-bit FNV-1a hash of a sequence of bytes, continuing from hash
+uint64_t asset_hash(void const* data, size_t size, uint64_t hash = 14695981039346656037ull);
+
+// Upload a cached asset (same buffers and attribute locations as the mesh_drawable constructor,
+// same texture parameters as opengl_texture_to_gpu)
+vcl::mesh_drawable mesh_drawable_from_asset(mesh_asset const& asset, GLuint shader = vcl::mesh_drawable::default_shader, GLuint texture = vcl::mesh_drawable::default_texture);
+GLuint opengl_texture_from_asset(texture_asset const& asset, GLint wrap_s = GL_CLAMP_TO_EDGE, GLint wrap_t = GL_CLAMP_TO_EDGE);
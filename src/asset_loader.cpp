@@ -0,0 +1,141 @@
+#include "asset_loader.hpp"
+#include "thread_pool.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <stdexcept>
+
+using namespace vcl;
+
+asset_loader::asset_loader(asset_cache& cache_arg)
+    :cache(cache_arg)
+{}
+
+asset_loader::~asset_loader()
+{
+    if(thread.joinable())
+        thread.join();
+}
+
+size_t asset_loader::add(request const& r, std::string const& key)
+{
+    assert_vcl(!thread.joinable(), "Assets must be requested before asset_loader::start");
+    auto const it = handles.find(key);
+    if(it != handles.end())
+        return it->second;
+    requests.push_back(r);
+    handles[key] = requests.size()-1;
+    return requests.size()-1;
+}
+
+size_t asset_loader::request_mesh(std::string const& obj_file, mat3 const& rotate, float scale, unsigned int lod)
+{
+    request r;
+    r.is_mesh = true;
+    r.file = obj_file;
+    r.rotate = rotate;
+    r.scale = scale;
+    r.lod = lod;
+
+    // The same file with other parameters is another asset
+    uint64_t const parameters_hash = asset_hash(&scale, sizeof(float), asset_hash(&rotate, sizeof(mat3)));
+    return add(r, "mesh " + obj_file + " " + std::to_string(parameters_hash) + " " + std::to_string(lod));
+}
+
+size_t asset_loader::request_texture(std::string const& png_file)
+{
+    request r;
+    r.is_mesh = false;
+    r.file = png_file;
+    return add(r, "texture " + png_file);
+}
+
+void asset_loader::start()
+{
+    thread = std::thread(&asset_loader::run, this);
+}
+
+void asset_loader::run()
+{
+    // This thread takes part in the loop as thread 0: the caller of start() is never blocked
+    thread_pool::global().parallel_for(requests.size(), 1, [this](size_t begin, size_t end, size_t) {
+        for(size_t k=begin; k<end; ++k) {
+            request& r = requests[k];
+            auto const t0 = std::chrono::steady_clock::now();
+            try {
+                if(r.is_mesh)
+                    r.mesh_data = cache.mesh(r.file, r.rotate, r.scale, r.lod);
+                else
+                    r.texture_data = cache.texture(r.file);
+            }
+            catch(std::exception const& e) {
+                r.error = e.what();
+            }
+            r.load_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now()-t0).count();
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                r.loaded = true;
+            }
+            loaded.notify_all();
+        }
+    });
+}
+
+asset_loader::request& asset_loader::wait(size_t handle)
+{
+    assert_vcl(handle < requests.size(), "Invalid asset handle");
+    request& r = requests[handle];
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        loaded.wait(lock, [&r]() { return r.loaded; });
+    }
+    if(!r.error.empty())
+        throw std::runtime_error("Cannot load " + r.file + ": " + r.error);
+    return r;
+}
+
+mesh_asset const& asset_loader::mesh(size_t handle)
+{
+    request& r = wait(handle);
+    assert_vcl(r.is_mesh, "Asset " + r.file + " is not a mesh");
+    return r.mesh_data;
+}
+
+mesh_drawable const& asset_loader::drawable(size_t handle)
+{
+    request& r = requests[handle];
+    mesh_asset const& data = mesh(handle);
+    if(!r.uploaded) {
+        auto const t0 = std::chrono::steady_clock::now();
+        r.drawable = mesh_drawable_from_asset(data);
+        r.upload_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now()-t0).count();
+        r.uploaded = true;
+    }
+    return r.drawable;
+}
+
+GLuint asset_loader::texture(size_t handle)
+{
+    request& r = wait(handle);
+    assert_vcl(!r.is_mesh, "Asset " + r.file + " is not a texture");
+    if(!r.uploaded) {
+        auto const t0 = std::chrono::steady_clock::now();
+        r.texture_id = opengl_texture_from_asset(r.texture_data);
+        r.upload_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now()-t0).count();
+        r.uploaded = true;
+    }
+    return r.texture_id;
+}
+
+void asset_loader::report(std::ostream& out) const
+{
+    char line[256];
+    for(request const& r : requests) {
+        bool const cached = r.is_mesh ? r.mesh_data.cached : r.texture_data.cached;
+        std::string const name = r.lod>0 ? r.file + " lod " + std::to_string(r.lod) : r.file;
+        std::snprintf(line, sizeof(line), "    %-24s load %8.2f ms (%s), upload %7.2f ms", name.c_str(), r.load_ms,
+                      cached ? "cache" : "rebuilt", r.upload_ms);
+        out << line << std::endl;
+    }
+}
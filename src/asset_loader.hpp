@@ -0,0 +1,70 @@
+#pragma once
+
+#include "asset_cache.hpp"
+
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+
+// Startup loading of the assets in parallel with the rest of the initialization
+//  Every asset is requested first (identical requests return the same handle), then start() loads them from the cache
+//  on the worker threads of the thread pool while the calling thread goes on. The GL thread receives the assets with
+//  drawable()/texture(): they wait until the asset is loaded and upload it on the first call only.
+class asset_loader
+{
+public:
+    explicit asset_loader(asset_cache& cache);
+    ~asset_loader(); // Waits for the loads
+
+    size_t request_mesh(std::string const& obj_file, vcl::mat3 const& rotate = vcl::rotation().matrix(), float scale = 1.0f, unsigned int lod = 0);
+    size_t request_texture(std::string const& png_file);
+    void start();
+
+    // CPU data of a mesh (valid as long as the cache)
+    mesh_asset const& mesh(size_t handle);
+    // GL thread only
+    vcl::mesh_drawable const& drawable(size_t handle);
+    GLuint texture(size_t handle);
+
+    // Load (worker) and upload (GL thread) time of every asset
+    void report(std::ostream& out) const;
+
+private:
+    struct request
+    {
+        bool is_mesh = true;
+        std::string file;
+        vcl::mat3 rotate;
+        float scale = 1.0f;
+        unsigned int lod = 0;
+
+        // Written by the worker, read once loaded is set
+        mesh_asset mesh_data;
+        texture_asset texture_data;
+        std::string error;
+        double load_ms = 0;
+        bool loaded = false;
+
+        // GL thread
+        bool uploaded = false;
+        vcl::mesh_drawable drawable;
+        GLuint texture_id = 0;
+        double upload_ms = 0;
+    };
+
+    size_t add(request const& r, std::string const& key);
+    request& wait(size_t handle);
+    void run();
+
+    asset_cache& cache;
+    std::deque<request> requests;         // References remain valid while requests are added
+    std::map<std::string, size_t> handles; // Request key -> handle
+
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable loaded;
+};
@@ -0,0 +1,458 @@
+#include "colliders.hpp"
+
+#include <limits>
+
+using namespace vcl;
+
+// Defined in simulation.cpp: the response of the walls is used for every solid collider
+void collision_sphere_plane(vcl::vec3& p, vcl::vec3& v, float r, vcl::vec3 const& n, vcl::vec3 const& p0);
+void collision_sphere_bounce(vcl::vec3& v, vcl::vec3 const& n);
+
+
+collider collider_plane(vec3 const& p0, vec3 const& n)
+{
+    collider c;
+    c.type = collider_type::plane;
+    c.p0 = p0;
+    c.n = normalize(n);
+    return c;
+}
+
+collider collider_box(vec3 const& center, vec3 const& half_size, rotation const& rotate)
+{
+    collider c;
+    c.type = collider_type::box;
+    c.p0 = center;
+    c.half_size = half_size;
+    c.rotate = rotate;
+    return c;
+}
+
+collider collider_cylinder(vec3 const& base, vec3 const& axis, float radius, float height)
+{
+    collider c;
+    c.type = collider_type::cylinder;
+    c.p0 = base;
+    c.n = normalize(axis);
+    c.radius = radius;
+    c.height = height;
+    return c;
+}
+
+collider collider_capsule(vec3 const& p0, vec3 const& p1, float radius)
+{
+    collider c;
+    c.type = collider_type::capsule;
+    c.p0 = p0;
+    c.p1 = p1;
+    c.radius = radius;
+    return c;
+}
+
+void collider_add_box_walls(collider_set& set, vec3 const& p_min, vec3 const& p_max)
+{
+    set.add(collider_plane(p_min, {0, 1,0}));
+    set.add(collider_plane(p_min, { 1,0,0}));
+    set.add(collider_plane(p_min, {0,0, 1}));
+    set.add(collider_plane(p_max, {0,-1,0}));
+    set.add(collider_plane(p_max, {-1,0,0}));
+    set.add(collider_plane(p_max, {0,0,-1}));
+}
+
+// Any unit vector orthogonal to u
+static vec3 orthogonal(vec3 const& u)
+{
+    vec3 const a = std::abs(u.x) < 0.9f ? vec3{1,0,0} : vec3{0,1,0};
+    return normalize(cross(u, a));
+}
+
+float collider_distance(collider const& c, vec3 const& p, vec3& normal)
+{
+    switch(c.type)
+    {
+    case collider_type::plane:
+        normal = c.n;
+        return dot(p-c.p0, c.n);
+
+    case collider_type::box:
+    {
+        mat3 const R = c.rotate.matrix();
+        vec3 const d = p-c.p0;
+        vec3 const axis[3] = {{R(0,0),R(1,0),R(2,0)}, {R(0,1),R(1,1),R(2,1)}, {R(0,2),R(1,2),R(2,2)}};
+        float const q[3] = {dot(d,axis[0]), dot(d,axis[1]), dot(d,axis[2])};
+        float const e[3] = {c.half_size.x, c.half_size.y, c.half_size.z};
+
+        // Outside: vector from the closest point of the box
+        vec3 outside = {0,0,0};
+        bool is_outside = false;
+        for(int k=0; k<3; ++k) {
+            float const excess = std::abs(q[k])-e[k];
+            if(excess > 0) {
+                outside += (q[k]>0 ? excess : -excess) * axis[k];
+                is_outside = true;
+            }
+        }
+        if(is_outside) {
+            float const distance = norm(outside);
+            normal = outside/distance;
+            return distance;
+        }
+
+        // Inside: closest face
+        int k_face = 0;
+        for(int k=1; k<3; ++k)
+            if(e[k]-std::abs(q[k]) < e[k_face]-std::abs(q[k_face]))
+                k_face = k;
+        normal = (q[k_face]>0 ? 1.0f : -1.0f) * axis[k_face];
+        return std::abs(q[k_face])-e[k_face];
+    }
+
+    case collider_type::cylinder:
+    {
+        vec3 const d = p-c.p0;
+        float const h = dot(d, c.n);
+        vec3 const radial = d - h*c.n;
+        float const r = norm(radial);
+        vec3 const radial_direction = r>1e-6f ? radial/r : orthogonal(c.n);
+        vec3 const axial_direction = h < c.height/2 ? -c.n : c.n;
+
+        float const dr = r - c.radius;                                       // > 0 outside of the side
+        float const dh = h < c.height/2 ? -h : h - c.height;                 // > 0 below the bottom or above the top
+        if(dr > 0 && dh > 0) { // Closest point on a rim
+            float const distance = std::sqrt(dr*dr + dh*dh);
+            normal = (dr*radial_direction + dh*axial_direction)/distance;
+            return distance;
+        }
+        if(dr > dh) {
+            normal = radial_direction;
+            return dr;
+        }
+        normal = axial_direction;
+        return dh;
+    }
+
+    case collider_type::capsule:
+    {
+        vec3 const u = c.p1-c.p0;
+        float const L2 = dot(u,u);
+        float const t = L2>0 ? std::min(std::max(dot(p-c.p0,u)/L2, 0.0f), 1.0f) : 0.0f;
+        vec3 const d = p - (c.p0 + t*u);
+        float const distance = norm(d);
+        normal = distance>1e-6f ? d/distance : orthogonal(L2>0 ? u/std::sqrt(L2) : vec3{0,0,1});
+        return distance - c.radius;
+    }
+
+    case collider_type::mesh:
+        break;
+    }
+    return 0.0f;
+}
+
+// Bounding box of a bounded collider
+static void collider_bounding_box(collider const& c, vec3& box_min, vec3& box_max)
+{
+    switch(c.type)
+    {
+    case collider_type::box:
+    {
+        mat3 const R = c.rotate.matrix();
+        vec3 extent;
+        for(int i=0; i<3; ++i)
+            extent[i] = std::abs(R(i,0))*c.half_size.x + std::abs(R(i,1))*c.half_size.y + std::abs(R(i,2))*c.half_size.z;
+        box_min = c.p0 - extent;
+        box_max = c.p0 + extent;
+        return;
+    }
+    case collider_type::cylinder:
+    case collider_type::capsule:
+    {
+        vec3 const p1 = c.type==collider_type::cylinder ? c.p0 + c.height*c.n : c.p1;
+        vec3 const extent = {c.radius, c.radius, c.radius};
+        for(int i=0; i<3; ++i) {
+            box_min[i] = std::min(c.p0[i], p1[i]);
+            box_max[i] = std::max(c.p0[i], p1[i]);
+        }
+        box_min -= extent;
+        box_max += extent;
+        return;
+    }
+    case collider_type::plane:
+    case collider_type::mesh:
+        break;
+    }
+}
+
+
+size_t collider_set::add(collider const& c)
+{
+    colliders.push_back(c);
+    built = false;
+    return colliders.size()-1;
+}
+
+size_t collider_set::add_mesh(std::vector<triangle> const& triangles)
+{
+    meshes.push_back(triangle_bvh());
+    meshes.back().build(triangles);
+
+    collider c;
+    c.type = collider_type::mesh;
+    c.mesh = int(meshes.size()-1);
+    return add(c);
+}
+
+// Top-down build: the colliders of the node are split at the median of their centers along the largest axis of the node
+static void build_bvh_node(std::vector<collider_bvh_node>& bvh, std::vector<unsigned int>& index,
+                           std::vector<vec3> const& box_min, std::vector<vec3> const& box_max, unsigned int first, unsigned int count)
+{
+    size_t const k_node = bvh.size();
+    bvh.push_back(collider_bvh_node());
+
+    vec3 node_min = box_min[index[first]], node_max = box_max[index[first]];
+    for(unsigned int k=first+1; k<first+count; ++k) {
+        for(int i=0; i<3; ++i) {
+            node_min[i] = std::min(node_min[i], box_min[index[k]][i]);
+            node_max[i] = std::max(node_max[i], box_max[index[k]][i]);
+        }
+    }
+    bvh[k_node].box_min = node_min;
+    bvh[k_node].box_max = node_max;
+
+    unsigned int const leaf_size = 2;
+    if(count <= leaf_size) {
+        bvh[k_node].first = first;
+        bvh[k_node].count = count;
+        return;
+    }
+
+    vec3 const size = node_max-node_min;
+    int const axis = (size.x>size.y && size.x>size.z) ? 0 : (size.y>size.z ? 1 : 2);
+    unsigned int const half = count/2;
+    std::nth_element(index.begin()+first, index.begin()+first+half, index.begin()+first+count, [&](unsigned int a, unsigned int b) {
+        return box_min[a][axis]+box_max[a][axis] < box_min[b][axis]+box_max[b][axis];
+    });
+
+    build_bvh_node(bvh, index, box_min, box_max, first, half);
+    bvh[k_node].first = (unsigned int)bvh.size();
+    build_bvh_node(bvh, index, box_min, box_max, first+half, count-half);
+}
+
+void collider_set::build()
+{
+    planes.clear();
+    bvh_index.clear();
+    bvh.clear();
+
+    size_t const N = colliders.size();
+    std::vector<vec3> box_min(N), box_max(N);
+    for(size_t k=0; k<N; ++k) {
+        if(colliders[k].type == collider_type::plane) {
+            planes.push_back(k);
+            continue;
+        }
+        if(colliders[k].type == collider_type::mesh) {
+            triangle_bvh const& m = meshes[colliders[k].mesh];
+            if(m.nodes.empty())
+                continue;
+            box_min[k] = m.nodes[0].box_min;
+            box_max[k] = m.nodes[0].box_max;
+        }
+        else
+            collider_bounding_box(colliders[k], box_min[k], box_max[k]);
+        bvh_index.push_back((unsigned int)k);
+    }
+    if(!bvh_index.empty())
+        build_bvh_node(bvh, bvh_index, box_min, box_max, 0, (unsigned int)bvh_index.size());
+
+    trigger_occupied.resize(N, 0);
+    trigger_previous.resize(N, 0);
+    built = true;
+}
+
+void collider_set::collide(vec3& p, vec3& v, float r)
+{
+    if(!built)
+        build();
+
+    vec3 normal;
+    auto const apply = [&](size_t k) {
+        collider const& c = colliders[k];
+        if(c.type == collider_type::mesh) {
+            meshes[c.mesh].collide(p, v, r, mesh_stats);
+            return;
+        }
+        float const distance = collider_distance(c, p, normal);
+        if(c.trigger) {
+            if(distance <= 0)
+                trigger_occupied[k] = 1;
+        }
+        else if(distance < r)
+            collision_sphere_plane(p, v, r, normal, p - distance*normal);
+    };
+
+    for(size_t k : planes)
+        apply(k);
+    query(p, r, apply);
+}
+
+// Smallest t >= 0 at which p_start + t*displacement is at distance R from center, if any
+static bool ray_sphere(vec3 const& p_start, vec3 const& displacement, vec3 const& center, float R, float& t)
+{
+    vec3 const m = p_start-center;
+    float const a = dot(displacement, displacement);
+    float const b = dot(m, displacement);
+    float const c = dot(m, m) - R*R;
+    float const discriminant = b*b - a*c;
+    if(a <= 0 || discriminant < 0)
+        return false;
+    t = (-b - std::sqrt(discriminant))/a;
+    return t >= 0;
+}
+
+// Smallest t >= 0 at which p_start + t*displacement is at distance R from the segment [p0,p1], if any
+//  The side of the capsule is reached first when the ray enters its infinite cylinder between the ends, otherwise an end sphere.
+static bool ray_capsule(vec3 const& p_start, vec3 const& displacement, vec3 const& p0, vec3 const& p1, float R, float& t)
+{
+    vec3 const u = p1-p0;
+    float const L2 = dot(u,u);
+    if(L2 > 0) {
+        vec3 const axis = u/std::sqrt(L2);
+        vec3 const m = p_start-p0 - dot(p_start-p0, axis)*axis;
+        vec3 const d = displacement - dot(displacement, axis)*axis;
+        float const a = dot(d,d);
+        float const b = dot(m,d);
+        float const discriminant = b*b - a*(dot(m,m) - R*R);
+        if(a > 0 && discriminant >= 0) {
+            t = (-b - std::sqrt(discriminant))/a;
+            float const h = dot(p_start + t*displacement - p0, u);
+            if(t >= 0 && h >= 0 && h <= L2)
+                return true;
+        }
+    }
+
+    float t0, t1;
+    bool const hit0 = ray_sphere(p_start, displacement, p0, R, t0);
+    bool const hit1 = L2 > 0 && ray_sphere(p_start, displacement, p1, R, t1);
+    if(!hit0 && !hit1)
+        return false;
+    t = !hit1 ? t0 : !hit0 ? t1 : std::min(t0, t1);
+    return true;
+}
+
+bool collider_set::time_of_impact(collider const& c, vec3 const& p_start, vec3 const& displacement, float r, float t_max,
+                                  unsigned int max_iterations, float& t, vec3& normal)
+{
+    float const L = norm(displacement);
+    float const tolerance = std::max(0.01f*r, 1e-4f);
+
+    // Planes and capsules: exact first contact
+    if(c.type == collider_type::plane || c.type == collider_type::capsule) {
+        float const gap = collider_distance(c, p_start, normal) - r;
+        if(gap <= tolerance) {
+            t = 0.0f;
+            if(c.trigger)
+                return true;
+            // Overlapping from the start: left to the discrete response
+            return gap > -tolerance && dot(displacement, normal) < 0;
+        }
+        if(c.type == collider_type::plane) {
+            float const approach = -dot(displacement, c.n);
+            if(approach <= 0)
+                return false;
+            t = gap/approach;
+        }
+        else if(!ray_capsule(p_start, displacement, c.p0, c.p1, c.radius+r, t))
+            return false;
+        if(t > t_max)
+            return false;
+        collider_distance(c, p_start + t*displacement, normal);
+        return true;
+    }
+
+    // Other colliders: conservative advancement
+    t = 0.0f;
+    float gap = std::numeric_limits<float>::max(), previous_gap = gap;
+    for(unsigned int k=0; k<max_iterations; ++k)
+    {
+        vec3 const p = p_start + t*displacement;
+        float distance;
+        if(c.type == collider_type::mesh) // Triangles further than the rest of the motion do not matter
+            distance = meshes[c.mesh].distance(p, r + (t_max-t)*L + tolerance, normal, mesh_stats);
+        else
+            distance = collider_distance(c, p, normal);
+
+        previous_gap = gap;
+        gap = distance - r;
+        if(gap <= tolerance) {
+            if(c.trigger)
+                return true;
+            // Overlapping from the start: left to the discrete response
+            return gap > -tolerance && dot(displacement, normal) < 0;
+        }
+        t += gap/L;
+        if(t > t_max)
+            return false;
+    }
+    // Out of iterations (grazing motion): stop at the last safe t only when the sphere still closes in on the surface
+    //  and touches it where its motion crosses the tangent plane of the closest point, otherwise it passes by
+    float const approach = -dot(displacement, normal);
+    if(c.trigger || gap >= previous_gap || approach <= 0)
+        return false;
+    float const t_reach = t + gap/approach;
+    if(t_reach > t_max)
+        return false;
+    vec3 const p_reach = p_start + t_reach*displacement;
+    vec3 normal_reach;
+    float const distance_reach = c.type == collider_type::mesh ? meshes[c.mesh].distance(p_reach, r + tolerance, normal_reach, mesh_stats)
+                                                                : collider_distance(c, p_reach, normal_reach);
+    return distance_reach - r <= tolerance;
+}
+
+void collider_set::collide_swept(vec3 const& p_start, vec3& p, vec3& v, float r, unsigned int max_iterations)
+{
+    // A sphere moving by less than its radius cannot cross a surface without overlapping it at the end
+    vec3 const displacement = p-p_start;
+    float const L = norm(displacement);
+    if(L <= r) {
+        collide(p, v, r);
+        return;
+    }
+    if(!built)
+        build();
+
+    // Earliest impact with a solid collider
+    float t_impact = 1.0f;
+    vec3 n_impact;
+    bool impact = false;
+    auto const test_solid = [&](size_t k) {
+        float t;
+        vec3 normal;
+        if(!colliders[k].trigger && time_of_impact(colliders[k], p_start, displacement, r, t_impact, max_iterations, t, normal)) {
+            t_impact = t;
+            n_impact = normal;
+            impact = true;
+        }
+    };
+    // Triggers whose center entered before the impact
+    auto const test_trigger = [&](size_t k) {
+        float t;
+        vec3 normal;
+        if(colliders[k].trigger && time_of_impact(colliders[k], p_start, displacement, 0.0f, t_impact, max_iterations, t, normal))
+            trigger_occupied[k] = 1;
+    };
+
+    vec3 const center = p_start + 0.5f*displacement;
+    for(size_t k : planes)
+        test_solid(k);
+    query(center, r + 0.5f*L, test_solid);
+    for(size_t k : planes)
+        test_trigger(k);
+    query(center, r + 0.5f*L, test_trigger);
+
+    if(impact) {
+        p = p_start + t_impact*displacement;
+        if(dot(v, n_impact) < 0) // Stopped by the iterations while moving along the surface
+            collision_sphere_bounce(v, n_impact);
+    }
+    collide(p, v, r);
+}
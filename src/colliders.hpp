@@ -0,0 +1,141 @@
+#pragma once
+
+#include "vcl/vcl.hpp"
+#include "triangle_bvh.hpp"
+#include <algorithm>
+#include <vector>
+
+enum class collider_type { plane, box, cylinder, capsule, mesh };
+
+// Static obstacle of the popcorn simulation
+//  Solid colliders push the particles out and bounce them (same response as the walls of the scene).
+//  Trigger colliders do not interact with the particles: they report when a particle center enters them.
+struct collider
+{
+    collider_type type = collider_type::plane;
+    vcl::vec3 p0;              // plane: point, box: center, cylinder: center of the bottom disc, capsule: first end
+    vcl::vec3 p1;              // capsule: second end
+    vcl::vec3 n = {0,0,1};     // plane: normal (towards the free side), cylinder: axis
+    vcl::vec3 half_size;       // box: half size along its local axes
+    vcl::rotation rotate;      // box: orientation of its local axes
+    float radius = 0;          // cylinder, capsule
+    float height = 0;          // cylinder
+    int mesh = -1;             // mesh: index in collider_set::meshes
+
+    bool trigger = false;
+    int tag = -1;              // Free index for the user of the trigger events (e.g. the cup of a trigger)
+};
+
+collider collider_plane(vcl::vec3 const& p0, vcl::vec3 const& n);
+collider collider_box(vcl::vec3 const& center, vcl::vec3 const& half_size, vcl::rotation const& rotate = vcl::rotation());
+collider collider_cylinder(vcl::vec3 const& base, vcl::vec3 const& axis, float radius, float height);
+collider collider_capsule(vcl::vec3 const& p0, vcl::vec3 const& p1, float radius);
+
+// Signed distance from p to the surface of the collider (negative inside), and the outward normal at the closest point
+//  (not defined for meshes, which can have several contacts)
+float collider_distance(collider const& c, vcl::vec3 const& p, vcl::vec3& normal);
+
+// Node of the bounding volume hierarchy, stored in depth-first order
+//  Leaves have count>0 and reference bvh_index[first] ... bvh_index[first+count-1].
+//  Inner nodes have count=0: their first child is the next node, the second one is node first.
+struct collider_bvh_node
+{
+    vcl::vec3 box_min, box_max;
+    unsigned int first = 0;
+    unsigned int count = 0;
+};
+
+// Set of colliders queried by the particles
+//  Planes are unbounded and always tested, the other colliders are stored in a bounding volume hierarchy
+//  so that a particle only tests the few colliders around it.
+//  Trigger events are collected during a step and dispatched once per event at the end of the step:
+//  a trigger fires when it contains a particle and contained none during the previous step.
+struct collider_set
+{
+    std::vector<collider> colliders;
+
+    size_t add(collider const& c); // Returns the index of the collider
+    size_t add_mesh(std::vector<triangle> const& triangles); // Solid triangle mesh with its own hierarchy
+    void build();                  // Build the hierarchy (called by collide when colliders were added)
+
+    // Solid response against every collider overlapping the sphere, and detection of the triggers containing its center
+    void collide(vcl::vec3& p, vcl::vec3& v, float r);
+
+    // Continuous version for a sphere that moved from p_start to p: it stops at its first time of impact with a solid
+    //  collider and bounces, the triggers crossed before are detected, then collide() resolves the remaining overlaps.
+    //  (The rest of the motion after the impact is dropped.)
+    void collide_swept(vcl::vec3 const& p_start, vcl::vec3& p, vcl::vec3& v, float r, unsigned int max_iterations);
+
+    // First time t in [0,t_max] at which the sphere moving from p_start by displacement touches the collider
+    //  (a trigger: when its center enters it), and the normal of the collider there.
+    //  Planes and capsules are solved exactly. The other colliders use conservative advancement: the sphere can always
+    //  move by its distance to the collider without touching it.
+    //  Returns false when the sphere misses the collider or moves away from it. After max_iterations, a solid collider
+    //  reports an impact at the last t reached (still free of contact) only when the sphere keeps closing in on the surface
+    //  and its motion actually reaches it (a trigger reports none).
+    bool time_of_impact(collider const& c, vcl::vec3 const& p_start, vcl::vec3 const& displacement, float r, float t_max,
+                        unsigned int max_iterations, float& t, vcl::vec3& normal);
+
+    // Call f(collider index) for every bounded collider whose bounding box overlaps the sphere
+    template <typename F> void query(vcl::vec3 const& p, float r, F const& f) const;
+
+    // Call callback(trigger) for every trigger entered since the previous call
+    template <typename F> void dispatch_triggers(F const& callback);
+
+    std::vector<size_t> planes;           // Indices of the unbounded colliders
+    std::vector<unsigned int> bvh_index;  // Indices of the bounded colliders, in the leaf order
+    std::vector<collider_bvh_node> bvh;
+    bool built = false;
+
+    std::vector<triangle_bvh> meshes;
+    triangle_bvh_stats mesh_stats;        // Cost of the mesh queries, accumulated until reset by the user
+
+    std::vector<char> trigger_occupied;   // Per collider: contains a particle during the current step
+    std::vector<char> trigger_previous;   // Per collider: contained a particle during the previous step
+};
+
+// Add the 6 planes of the inside of the box [p_min,p_max]
+void collider_add_box_walls(collider_set& set, vcl::vec3 const& p_min, vcl::vec3 const& p_max);
+
+
+template <typename F>
+void collider_set::query(vcl::vec3 const& p, float r, F const& f) const
+{
+    if(bvh.empty())
+        return;
+
+    unsigned int stack[64];
+    int N_stack = 0;
+    stack[N_stack++] = 0;
+    while(N_stack > 0)
+    {
+        unsigned int const k_node = stack[--N_stack];
+        collider_bvh_node const& node = bvh[k_node];
+        if(p.x+r < node.box_min.x || p.x-r > node.box_max.x ||
+           p.y+r < node.box_min.y || p.y-r > node.box_max.y ||
+           p.z+r < node.box_min.z || p.z-r > node.box_max.z)
+            continue;
+
+        if(node.count > 0) {
+            for(unsigned int k=node.first; k<node.first+node.count; ++k)
+                f(size_t(bvh_index[k]));
+        }
+        else {
+            stack[N_stack++] = node.first;
+            stack[N_stack++] = k_node+1;
+        }
+    }
+}
+
+template <typename F>
+void collider_set::dispatch_triggers(F const& callback)
+{
+    trigger_previous.resize(colliders.size(), 0);
+    trigger_occupied.resize(colliders.size(), 0);
+    for(size_t k=0; k<colliders.size(); ++k) {
+        if(trigger_occupied[k] && !trigger_previous[k])
+            callback(colliders[k]);
+    }
+    trigger_previous.swap(trigger_occupied);
+    std::fill(trigger_occupied.begin(), trigger_occupied.end(), 0);
+}
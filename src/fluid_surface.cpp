@@ -0,0 +1,355 @@
+#include "fluid_surface.hpp"
+#include "profiler.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+using namespace vcl;
+
+// Six tetrahedra sharing the diagonal 0-7 of a cell (corner c is at (c&1, (c>>1)&1, (c>>2)&1))
+static int const cell_tetrahedra[6][4] = { {0,1,3,7}, {0,1,5,7}, {0,2,3,7}, {0,2,6,7}, {0,4,5,7}, {0,4,6,7} };
+
+static uint64_t block_key(int x, int y, int z)
+{
+    uint64_t const mask = (uint64_t(1) << 21) - 1;
+    return ((uint64_t(x) & mask) << 42) | ((uint64_t(y) & mask) << 21) | (uint64_t(z) & mask);
+}
+
+// Whether the triangles of the block still hold for the current positions
+//  Only a motion of its particles by more than the tolerance, or a particle entering the block deeper than the tolerance,
+//  changes a block. The field of an interior block only drops where its particles leave: each kernel falls by at most
+//  1.72/R per unit of motion, and the particles entering only raise it.
+static bool block_unchanged(fluid_surface_block const& block, std::vector<vec3> const& positions, fluid_surface_parameters const& parameters)
+{
+    if(block.field.empty())
+        return false;
+    float const R = parameters.radius;
+    float const tolerance = parameters.rebuild_tolerance * parameters.cell_size;
+
+    float motion2 = 0;
+    for(size_t k=0; k<block.built_indices.size(); ++k) {
+        vec3 const d = positions[block.built_indices[k]] - block.built_particles[k];
+        motion2 = std::max(motion2, dot(d, d));
+    }
+    float const motion = std::sqrt(motion2);
+    if(block.interior_margin > 0)
+        return 1.72f*motion/R * block.interior_neighbors < block.interior_margin;
+    if(motion > tolerance)
+        return false;
+
+    // Both lists are in particle order
+    float const block_size = fluid_surface_block::cells * parameters.cell_size;
+    vec3 const p_min = vec3{float(block.x), float(block.y), float(block.z)} * block_size;
+    vec3 const p_max = p_min + vec3{block_size, block_size, block_size};
+    float const reach = std::max(R-tolerance, 0.0f);
+    size_t j = 0;
+    for(size_t k=0; k<block.indices.size(); ++k) {
+        while(j < block.built_indices.size() && block.built_indices[j] < block.indices[k])
+            ++j;
+        if(j < block.built_indices.size() && block.built_indices[j] == block.indices[k])
+            continue;
+        vec3 const& p = block.particles[k];
+        vec3 d;
+        for(int i=0; i<3; ++i)
+            d[i] = std::max(std::max(p_min[i]-p[i], p[i]-p_max[i]), 0.0f);
+        if(dot(d, d) < reach*reach)
+            return false;
+    }
+    return true;
+}
+
+void fluid_surface::clear()
+{
+    block_list.clear();
+    index_of_block.clear();
+    capacity = 0;
+    free_slots.clear();
+    last_stats = fluid_surface_stats();
+}
+
+size_t fluid_surface::block_index(int x, int y, int z)
+{
+    uint64_t const key = block_key(x, y, z);
+    auto const it = index_of_block.find(key);
+    if(it != index_of_block.end())
+        return it->second;
+
+    block_list.push_back(fluid_surface_block());
+    fluid_surface_block& block = block_list.back();
+    block.x = x;
+    block.y = y;
+    block.z = z;
+    touched.push_back(0);
+    index_of_block[key] = block_list.size()-1;
+    return block_list.size()-1;
+}
+
+void fluid_surface::update(std::vector<vec3> const& positions, thread_pool& pool)
+{
+    // Changing the parameters or the number of particles changes every block
+    if(parameters.radius != built_parameters.radius || parameters.cell_size != built_parameters.cell_size || parameters.iso != built_parameters.iso ||
+       positions.size() != built_count) {
+        clear();
+        built_parameters = parameters;
+        built_count = positions.size();
+    }
+    float const R = parameters.radius;
+    float const block_size = fluid_surface_block::cells * parameters.cell_size;
+
+    // Bucket the particles in the blocks overlapped by their kernel
+    {
+        PROFILE_SCOPE("surface blocks");
+        touched.assign(block_list.size(), 0);
+        for(fluid_surface_block& block : block_list) {
+            block.particles.clear();
+            block.indices.clear();
+        }
+        for(size_t i=0; i<positions.size(); ++i) {
+            vec3 const& p = positions[i];
+            int const x0 = int(std::floor((p.x-R)/block_size)), x1 = int(std::floor((p.x+R)/block_size));
+            int const y0 = int(std::floor((p.y-R)/block_size)), y1 = int(std::floor((p.y+R)/block_size));
+            int const z0 = int(std::floor((p.z-R)/block_size)), z1 = int(std::floor((p.z+R)/block_size));
+            for(int z=z0; z<=z1; ++z) {
+                for(int y=y0; y<=y1; ++y) {
+                    for(int x=x0; x<=x1; ++x) {
+                        size_t const k = block_index(x, y, z);
+                        touched[k] = 1;
+                        block_list[k].particles.push_back(p);
+                        block_list[k].indices.push_back((unsigned int)i);
+                    }
+                }
+            }
+        }
+
+        // Blocks left by the particles
+        for(size_t k=block_list.size(); k-- > 0; ) {
+            if(touched[k])
+                continue;
+            free_slot(block_list[k]);
+            index_of_block.erase(block_key(block_list[k].x, block_list[k].y, block_list[k].z));
+            if(k+1 < block_list.size()) {
+                std::swap(block_list[k], block_list.back());
+                index_of_block[block_key(block_list[k].x, block_list[k].y, block_list[k].z)] = k;
+            }
+            block_list.pop_back();
+        }
+    }
+
+    // Splat and polygonize the blocks whose particles moved
+    std::vector<size_t> rebuilt;
+    for(size_t k=0; k<block_list.size(); ++k)
+        if(!block_unchanged(block_list[k], positions, parameters))
+            rebuilt.push_back(k);
+    {
+        PROFILE_SCOPE("surface polygonize");
+        pool.parallel_for(rebuilt.size(), 1, [&](size_t begin, size_t end, size_t) {
+            for(size_t k=begin; k<end; ++k)
+                polygonize(block_list[rebuilt[k]]);
+        });
+    }
+
+    // Move the blocks that outgrew their slot, and compact the buffer once it is mostly free
+    size_t used = 0;
+    for(size_t k : rebuilt) {
+        fluid_surface_block& block = block_list[k];
+        block.dirty = true;
+        if(block.vertices.size() > block.slot_capacity || 4*block.vertices.size() < block.slot_capacity) {
+            free_slot(block);
+            allocate_slot(block);
+        }
+    }
+    for(fluid_surface_block const& block : block_list)
+        used += block.slot_capacity;
+    if(capacity > 4096 && 2*used < capacity) {
+        capacity = 0;
+        free_slots.clear();
+        for(fluid_surface_block& block : block_list) {
+            block.slot_capacity = 0;
+            allocate_slot(block);
+            block.dirty = true;
+        }
+    }
+
+    last_stats = fluid_surface_stats();
+    last_stats.blocks = block_list.size();
+    last_stats.rebuilt = rebuilt.size();
+    for(fluid_surface_block const& block : block_list) {
+        last_stats.triangles += block.vertices.size()/3;
+        last_stats.interior += block.interior_margin > 0 ? 1 : 0;
+    }
+    if(!positions.empty()) {
+        vec3 p_min = positions[0], p_max = positions[0];
+        for(vec3 const& p : positions) {
+            for(int i=0; i<3; ++i) {
+                p_min[i] = std::min(p_min[i], p[i]);
+                p_max[i] = std::max(p_max[i], p[i]);
+            }
+        }
+        last_stats.bounding_blocks = 1;
+        for(int i=0; i<3; ++i)
+            last_stats.bounding_blocks *= size_t(std::floor((p_max[i]+R)/block_size) - std::floor((p_min[i]-R)/block_size)) + 1;
+    }
+}
+
+void fluid_surface::block_bounds(fluid_surface_block const& block, vec3& center, float& radius) const
+{
+    float const block_size = fluid_surface_block::cells * built_parameters.cell_size;
+    center = (vec3{float(block.x), float(block.y), float(block.z)} + vec3{0.5f, 0.5f, 0.5f}) * block_size;
+    radius = 0.87f * block_size; // Half diagonal
+}
+
+void fluid_surface::clear_dirty()
+{
+    for(fluid_surface_block& block : block_list)
+        block.dirty = false;
+}
+
+// Field of the block, then triangles of its cells
+void fluid_surface::polygonize(fluid_surface_block& block) const
+{
+    int const n = fluid_surface_block::cells;
+    int const n1 = n+1;
+    float const c = parameters.cell_size;
+    float const R = parameters.radius;
+    float const R2 = R*R;
+    float const iso = parameters.iso;
+    vec3 const origin = vec3{float(block.x), float(block.y), float(block.z)} * (n*c);
+
+    // Kernel (1-r^2/R^2)^3 of each particle, and its gradient
+    block.field.assign(4*fluid_surface_block::samples, 0.0f);
+    std::vector<int> neighbors(fluid_surface_block::samples, 0); // Particles within R of each sample
+    for(vec3 const& p : block.particles) {
+        vec3 const q = (p-origin)/c;
+        float const r = R/c;
+        int const i0 = std::max(0, int(std::ceil(q.x-r))), i1 = std::min(n, int(std::floor(q.x+r)));
+        int const j0 = std::max(0, int(std::ceil(q.y-r))), j1 = std::min(n, int(std::floor(q.y+r)));
+        int const k0 = std::max(0, int(std::ceil(q.z-r))), k1 = std::min(n, int(std::floor(q.z+r)));
+        for(int k=k0; k<=k1; ++k) {
+            for(int j=j0; j<=j1; ++j) {
+                for(int i=i0; i<=i1; ++i) {
+                    vec3 const d = origin + c*vec3{float(i), float(j), float(k)} - p;
+                    float const d2 = dot(d, d);
+                    if(d2 >= R2)
+                        continue;
+                    float const t = 1.0f - d2/R2;
+                    int const s = i + n1*(j + n1*k);
+                    float* sample = &block.field[4*s];
+                    neighbors[s]++;
+                    sample[0] += t*t*t;
+                    float const g = -6.0f*t*t/R2;
+                    sample[1] += g*d.x;
+                    sample[2] += g*d.y;
+                    sample[3] += g*d.z;
+                }
+            }
+        }
+    }
+
+    block.built_particles = block.particles;
+    block.built_indices = block.indices;
+    block.vertices.clear();
+
+    // Interior block: no surface to extract
+    float lowest = block.field[0];
+    for(int s=1; s<fluid_surface_block::samples; ++s)
+        lowest = std::min(lowest, block.field[4*s]);
+    block.interior_margin = std::max(lowest-iso, 0.0f);
+    block.interior_neighbors = 0;
+    if(block.interior_margin > 0) {
+        for(int s=0; s<fluid_surface_block::samples; ++s)
+            block.interior_neighbors = std::max(block.interior_neighbors, neighbors[s]);
+        return;
+    }
+
+    auto edge_vertex = [&](int a, int b) {
+        float const* fa = &block.field[4*a];
+        float const* fb = &block.field[4*b];
+        float const t = (iso-fa[0])/(fb[0]-fa[0]);
+        vec3 const pa = origin + c*vec3{float(a%n1), float((a/n1)%n1), float(a/(n1*n1))};
+        vec3 const pb = origin + c*vec3{float(b%n1), float((b/n1)%n1), float(b/(n1*n1))};
+        vec3 const g = vec3{fa[1], fa[2], fa[3]} + t*vec3{fb[1]-fa[1], fb[2]-fa[2], fb[3]-fa[3]};
+        float const length = norm(g);
+        return fluid_surface_vertex{pa + t*(pb-pa), length>0 ? -g/length : vec3{0,0,1}};
+    };
+    // Triangles face the outside (the field decreases outwards)
+    auto add_triangle = [&](fluid_surface_vertex const& v0, fluid_surface_vertex const& v1, fluid_surface_vertex const& v2) {
+        bool const flip = dot(cross(v1.p-v0.p, v2.p-v0.p), v0.n+v1.n+v2.n) < 0;
+        block.vertices.push_back(v0);
+        block.vertices.push_back(flip ? v2 : v1);
+        block.vertices.push_back(flip ? v1 : v2);
+    };
+
+    for(int k=0; k<n; ++k) {
+        for(int j=0; j<n; ++j) {
+            for(int i=0; i<n; ++i) {
+                int corner[8];
+                int N_inside = 0;
+                for(int v=0; v<8; ++v) {
+                    corner[v] = (i+(v&1)) + n1*((j+((v>>1)&1)) + n1*(k+((v>>2)&1)));
+                    N_inside += block.field[4*corner[v]] > iso ? 1 : 0;
+                }
+                if(N_inside == 0 || N_inside == 8)
+                    continue;
+
+                for(int const* tetrahedron : cell_tetrahedra) {
+                    int inside[4], outside[4];
+                    int N_in = 0, N_out = 0;
+                    for(int v=0; v<4; ++v) {
+                        int const s = corner[tetrahedron[v]];
+                        if(block.field[4*s] > iso)
+                            inside[N_in++] = s;
+                        else
+                            outside[N_out++] = s;
+                    }
+                    if(N_in == 1)
+                        add_triangle(edge_vertex(inside[0], outside[0]), edge_vertex(inside[0], outside[1]), edge_vertex(inside[0], outside[2]));
+                    else if(N_in == 3)
+                        add_triangle(edge_vertex(inside[0], outside[0]), edge_vertex(inside[1], outside[0]), edge_vertex(inside[2], outside[0]));
+                    else if(N_in == 2) {
+                        fluid_surface_vertex const ac = edge_vertex(inside[0], outside[0]), ad = edge_vertex(inside[0], outside[1]);
+                        fluid_surface_vertex const bc = edge_vertex(inside[1], outside[0]), bd = edge_vertex(inside[1], outside[1]);
+                        add_triangle(ac, ad, bd);
+                        add_triangle(ac, bd, bc);
+                    }
+                }
+            }
+        }
+    }
+}
+
+// Slots hold a power of two of vertices: the freed slots are reused by blocks of the same size class
+void fluid_surface::allocate_slot(fluid_surface_block& block)
+{
+    block.slot = 0;
+    block.slot_capacity = 0;
+    if(block.vertices.empty())
+        return;
+    size_t k = 7;
+    while((size_t(1) << k) < block.vertices.size())
+        k++;
+    if(free_slots.size() <= k)
+        free_slots.resize(k+1);
+    block.slot_capacity = size_t(1) << k;
+    if(!free_slots[k].empty()) {
+        block.slot = free_slots[k].back();
+        free_slots[k].pop_back();
+    }
+    else {
+        block.slot = capacity;
+        capacity += block.slot_capacity;
+    }
+}
+
+void fluid_surface::free_slot(fluid_surface_block& block)
+{
+    if(block.slot_capacity == 0)
+        return;
+    size_t k = 0;
+    while((size_t(1) << k) < block.slot_capacity)
+        k++;
+    if(free_slots.size() <= k)
+        free_slots.resize(k+1);
+    free_slots[k].push_back(block.slot);
+    block.slot = 0;
+    block.slot_capacity = 0;
+}
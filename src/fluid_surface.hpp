@@ -0,0 +1,100 @@
+#pragma once
+
+#include "vcl/vcl.hpp"
+#include "thread_pool.hpp"
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+// Surface of the fluid reconstructed as a single triangle mesh from the particle positions
+//  Each particle splats a smooth density kernel of support radius into the blocks of a sparse grid: only the blocks
+//  touched by a particle exist, each one holding its own samples of the field on (block_cells+1)^3 corners. The field is
+//  then polygonized block by block in parallel, each cell being split in six tetrahedra along its diagonal (marching
+//  tetrahedra: no ambiguous case, and the neighboring cells always agree on their faces). Two blocks sharing a face compute
+//  the same samples on it, so the surface is continuous across the blocks.
+//
+//  Blocks keep their identity between updates: a block whose particles moved by less than rebuild_tolerance since its
+//  triangles were built keeps them (the positions drawn are interpolated between the simulation steps), and the triangles
+//  of each block live in their own slot of the vertex buffer (see fluid_surface_drawable), so that only the blocks that
+//  changed are uploaded again. A block entirely inside the fluid has no triangles, and is not splatted again as long as
+//  the motion of its particles cannot have lowered its field below iso.
+
+struct fluid_surface_parameters
+{
+    float radius = 0.05f;    // Support of the kernel splatted by each particle
+    float cell_size = 0.02f; // Spacing of the field samples
+    float iso = 0.5f;        // Level of the surface (an isolated particle gives a sphere of about 0.45 radius)
+    float rebuild_tolerance = 0.1f; // Motion of the particles, relative to cell_size, below which a block keeps its triangles
+};
+
+struct fluid_surface_vertex
+{
+    vcl::vec3 p;
+    vcl::vec3 n;
+};
+
+struct fluid_surface_block
+{
+    static int const cells = 8;                        // Cells along each side
+    static int const samples = (cells+1)*(cells+1)*(cells+1);
+
+    int x = 0, y = 0, z = 0;                           // Coordinates of the block (in blocks)
+    std::vector<vcl::vec3> particles;                  // Particles whose kernel overlaps the block (in particle order)
+    std::vector<unsigned int> indices;                 // ... and their index in the positions
+    std::vector<vcl::vec3> built_particles;            // Particles of the block when its triangles were built
+    std::vector<unsigned int> built_indices;
+    std::vector<float> field;                          // Value and gradient at each corner (4 floats per sample)
+    float interior_margin = 0;                         // Lowest sample minus iso when they are all above it (interior block), else 0
+    int interior_neighbors = 0;                        // Most particles within the radius of a sample (interior block)
+    std::vector<fluid_surface_vertex> vertices;        // Triangles of the block, 3 vertices each
+
+    bool dirty = true;                                 // Triangles changed since the last upload
+    size_t slot = 0, slot_capacity = 0;                // Range of the vertex buffer (in vertices) holding the triangles
+};
+
+struct fluid_surface_stats
+{
+    size_t blocks = 0;          // Blocks touched by the particles
+    size_t bounding_blocks = 0; // Blocks of a dense grid over the bounding box of the particles
+    size_t rebuilt = 0;         // Blocks whose particles moved since their triangles were built
+    size_t interior = 0;        // Blocks entirely inside the fluid (no triangles)
+    size_t triangles = 0;
+};
+
+class fluid_surface
+{
+public:
+    fluid_surface_parameters parameters;
+
+    // Reconstruct the surface of the particles (in the scene frame)
+    void update(std::vector<vcl::vec3> const& positions, thread_pool& pool = thread_pool::global());
+    void clear();
+
+    std::vector<fluid_surface_block> const& blocks() const { return block_list; }
+    fluid_surface_stats const& stats() const { return last_stats; }
+
+    // Bounding sphere of a block
+    void block_bounds(fluid_surface_block const& block, vcl::vec3& center, float& radius) const;
+
+    // Layout of the vertex buffer: the slots of the blocks fit in vertex_capacity() vertices
+    size_t vertex_capacity() const { return capacity; }
+    // Called once the dirty blocks are uploaded
+    void clear_dirty();
+
+private:
+    size_t block_index(int x, int y, int z); // Creates the block if needed
+    void polygonize(fluid_surface_block& block) const;
+    void allocate_slot(fluid_surface_block& block);
+    void free_slot(fluid_surface_block& block);
+
+    std::vector<fluid_surface_block> block_list;
+    std::unordered_map<uint64_t, size_t> index_of_block;
+    std::vector<unsigned char> touched;                   // Blocks touched by the current update
+    fluid_surface_parameters built_parameters;            // Parameters of the current triangles
+    size_t built_count = 0;                               // Particles of the current triangles (their indices are kept)
+
+    size_t capacity = 0;
+    std::vector<std::vector<size_t> > free_slots;         // Free slots by capacity (free_slots[k]: 2^k vertices)
+    fluid_surface_stats last_stats;
+};
@@ -0,0 +1,141 @@
+#include "fluid_surface_drawable.hpp"
+#include <algorithm>
+#include <cstddef>
+
+using namespace vcl;
+
+// Same attribute locations as the mesh_drawable buffers (0: position, 1: normal)
+static std::string const fluid_surface_vertex_shader = R"(
+#version 330 core
+layout (location = 0) in vec3 position;
+layout (location = 1) in vec3 normal;
+
+out struct fragment_data
+{
+    vec3 position;
+    vec3 normal;
+} fragment;
+
+uniform mat4 projection;
+uniform mat4 view;
+
+void main()
+{
+    fragment.position = position;
+    fragment.normal = normal;
+    gl_Position = projection * view * vec4(position, 1.0);
+}
+)";
+
+static std::string const fluid_surface_fragment_shader = R"(
+#version 330 core
+in struct fragment_data
+{
+    vec3 position;
+    vec3 normal;
+} fragment;
+
+layout(location=0) out vec4 FragColor;
+
+uniform mat4 view;
+uniform vec3 light = vec3(1.0, 1.0, 1.0);
+uniform vec3 color = vec3(1.0, 1.0, 1.0);
+uniform float alpha = 1.0;
+uniform float ambient = 0.3;
+uniform float diffuse = 0.7;
+uniform float specular = 0.6;
+uniform float specular_exponent = 64.0;
+
+void main()
+{
+    vec3 N = normalize(fragment.normal);
+    if (gl_FrontFacing == false)
+        N = -N;
+    vec3 L = normalize(light-fragment.position);
+
+    float diffuse_component = max(dot(N,L),0.0);
+    float specular_component = 0.0;
+    if(diffuse_component>0.0) {
+        vec3 R = reflect(-L,N);
+        mat3 O = transpose(mat3(view));
+        vec3 camera_position = -O*vec3(view[3]);
+        vec3 V = normalize(camera_position-fragment.position);
+        specular_component = pow( max(dot(R,V),0.0), specular_exponent );
+    }
+
+    vec3 color_shading = (ambient + diffuse * diffuse_component) * color + specular * specular_component * vec3(1.0, 1.0, 1.0);
+    FragColor = vec4(color_shading, alpha);
+}
+)";
+
+fluid_surface_drawable::fluid_surface_drawable(vec3 const& color_arg)
+    :color(color_arg)
+{
+    shader = opengl_create_shader_program(fluid_surface_vertex_shader, fluid_surface_fragment_shader);
+    glGenVertexArrays(1, &vao);
+    glGenBuffers(1, &vbo);
+
+    glBindVertexArray(vao);
+    glBindBuffer(GL_ARRAY_BUFFER, vbo);
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(fluid_surface_vertex), reinterpret_cast<void*>(offsetof(fluid_surface_vertex, p)));
+    glEnableVertexAttribArray(1);
+    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(fluid_surface_vertex), reinterpret_cast<void*>(offsetof(fluid_surface_vertex, n)));
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+void fluid_surface_drawable_upload(fluid_surface_drawable& d, fluid_surface& surface, view_frustum const* frustum)
+{
+    std::vector<fluid_surface_block> const& blocks = surface.blocks();
+    d.uploaded_vertices = 0;
+    d.visible_blocks = 0;
+    d.culled_blocks = 0;
+    d.first.clear();
+    d.count.clear();
+
+    glBindBuffer(GL_ARRAY_BUFFER, d.vbo);
+    // Every block is uploaded again when the buffer grows
+    bool const reallocate = surface.vertex_capacity() > d.vertex_capacity;
+    if(reallocate) {
+        d.vertex_capacity = std::max(surface.vertex_capacity(), 2*d.vertex_capacity);
+        glBufferData(GL_ARRAY_BUFFER, GLsizeiptr(d.vertex_capacity*sizeof(fluid_surface_vertex)), nullptr, GL_DYNAMIC_DRAW);
+    }
+    for(fluid_surface_block const& block : blocks) {
+        if(block.vertices.empty())
+            continue;
+        if(block.dirty || reallocate) {
+            glBufferSubData(GL_ARRAY_BUFFER, GLintptr(block.slot*sizeof(fluid_surface_vertex)),
+                            GLsizeiptr(block.vertices.size()*sizeof(fluid_surface_vertex)), block.vertices.data());
+            d.uploaded_vertices += block.vertices.size();
+        }
+        if(frustum != nullptr) {
+            vec3 center;
+            float radius;
+            surface.block_bounds(block, center, radius);
+            if(!view_frustum_visible(*frustum, center, radius)) {
+                d.culled_blocks++;
+                continue;
+            }
+        }
+        d.visible_blocks++;
+        d.first.push_back(GLint(block.slot));
+        d.count.push_back(GLsizei(block.vertices.size()));
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    surface.clear_dirty();
+}
+
+void fluid_surface_drawable_draw_call(fluid_surface_drawable& d)
+{
+    opengl_uniform(d.shader, "color", d.color);
+    opengl_uniform(d.shader, "alpha", d.alpha);
+    opengl_uniform(d.shader, "ambient", d.phong.x);
+    opengl_uniform(d.shader, "diffuse", d.phong.y);
+    opengl_uniform(d.shader, "specular", d.phong.z);
+
+    glBindVertexArray(d.vao);
+    glMultiDrawArrays(GL_TRIANGLES, d.first.data(), d.count.data(), GLsizei(d.first.size()));
+    glBindVertexArray(0);
+    glUseProgram(0);
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include "vcl/vcl.hpp"
+#include "fluid_surface.hpp"
+#include "frustum_culling.hpp"
+#include <vector>
+
+// Draw a fluid_surface with a single call
+//  The vertex buffer mirrors the slots of the surface blocks: only the blocks rebuilt since the last draw are uploaded,
+//  and the whole buffer is only uploaded again when the surface needs more room. The used part of each slot is drawn
+//  with one glMultiDrawArrays, leaving out the blocks outside the view frustum when one is given.
+struct fluid_surface_drawable
+{
+    fluid_surface_drawable() {}
+    explicit fluid_surface_drawable(vcl::vec3 const& color);
+
+    vcl::vec3 color = {1, 1, 1};
+    float alpha = 1.0f;
+    vcl::vec3 phong = {0.3f, 0.7f, 0.6f}; // Ambient, diffuse, specular
+
+    GLuint shader = 0;
+    GLuint vao = 0;
+    GLuint vbo = 0;
+    size_t vertex_capacity = 0; // Number of vertices the vbo can store
+
+    size_t uploaded_vertices = 0; // During the last draw
+    size_t visible_blocks = 0, culled_blocks = 0;
+    std::vector<GLint> first;
+    std::vector<GLsizei> count;
+};
+
+// Upload the blocks of the surface changed since the last call (and mark them clean), and list the blocks to draw
+void fluid_surface_drawable_upload(fluid_surface_drawable& drawable, fluid_surface& surface, view_frustum const* frustum = nullptr);
+// Issue the draw call (the scene uniforms must already be set)
+void fluid_surface_drawable_draw_call(fluid_surface_drawable& drawable);
+
+template <typename SCENE>
+void draw(fluid_surface_drawable& drawable, fluid_surface& surface, SCENE const& scene, view_frustum const* frustum = nullptr)
+{
+    fluid_surface_drawable_upload(drawable, surface, frustum);
+    if(drawable.first.empty())
+        return;
+    glUseProgram(drawable.shader);
+    opengl_uniform(drawable.shader, scene);
+    fluid_surface_drawable_draw_call(drawable);
+}
@@ -0,0 +1,90 @@
+#include "frustum_culling.hpp"
+
+#include <cmath>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define FRUSTUM_CULLING_SSE
+#include <immintrin.h>
+#endif
+
+using namespace vcl;
+
+view_frustum view_frustum_from_matrix(mat4 const& m)
+{
+    // Clip coordinates c = m [p 1]: inside when -c.w <= c.x,c.y,c.z <= c.w
+    view_frustum f;
+    for(int k=0; k<6; ++k) {
+        int const row = k/2;
+        float const sign = (k%2==0) ? 1.0f : -1.0f;
+        float length2 = 0;
+        for(int i=0; i<4; ++i) {
+            f.plane[k][i] = m(3,i) + sign*m(row,i);
+            if(i < 3)
+                length2 += f.plane[k][i]*f.plane[k][i];
+        }
+        float const length = std::sqrt(length2);
+        for(int i=0; i<4; ++i)
+            f.plane[k][i] = length>0 ? f.plane[k][i]/length : 0.0f;
+    }
+    return f;
+}
+
+bool view_frustum_visible(view_frustum const& f, vec3 const& p, float r)
+{
+    for(int k=0; k<6; ++k)
+        if(f.plane[k][0]*p.x + f.plane[k][1]*p.y + f.plane[k][2]*p.z + f.plane[k][3] < -r)
+            return false;
+    return true;
+}
+
+void bounding_spheres::clear()
+{
+    x.clear();
+    y.clear();
+    z.clear();
+    r.clear();
+}
+
+void bounding_spheres::add(vec3 const& p, float radius)
+{
+    x.push_back(p.x);
+    y.push_back(p.y);
+    z.push_back(p.z);
+    r.push_back(radius);
+}
+
+void frustum_cull(view_frustum const& f, bounding_spheres const& spheres, std::vector<unsigned int>& visible)
+{
+    size_t const N = spheres.size();
+    visible.clear();
+    size_t k = 0;
+
+#ifdef FRUSTUM_CULLING_SSE
+    __m128 plane[6][4];
+    for(int p=0; p<6; ++p)
+        for(int i=0; i<4; ++i)
+            plane[p][i] = _mm_set1_ps(f.plane[p][i]);
+
+    for(; k+4<=N; k+=4) {
+        __m128 const x = _mm_loadu_ps(&spheres.x[k]);
+        __m128 const y = _mm_loadu_ps(&spheres.y[k]);
+        __m128 const z = _mm_loadu_ps(&spheres.z[k]);
+        __m128 const minus_r = _mm_sub_ps(_mm_setzero_ps(), _mm_loadu_ps(&spheres.r[k]));
+        __m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+        for(int p=0; p<6; ++p) {
+            __m128 d = _mm_add_ps(_mm_mul_ps(plane[p][0], x), plane[p][3]);
+            d = _mm_add_ps(d, _mm_mul_ps(plane[p][1], y));
+            d = _mm_add_ps(d, _mm_mul_ps(plane[p][2], z));
+            inside = _mm_and_ps(inside, _mm_cmpge_ps(d, minus_r));
+        }
+        int const mask = _mm_movemask_ps(inside);
+        for(int lane=0; lane<4; ++lane)
+            if(mask & (1<<lane))
+                visible.push_back((unsigned int)(k+lane));
+    }
+#endif
+
+    for(; k<N; ++k)
+        if(view_frustum_visible(f, spheres.center(k), spheres.r[k]))
+            visible.push_back((unsigned int)k);
+}
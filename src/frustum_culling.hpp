@@ -0,0 +1,29 @@
+#pragma once
+
+#include "vcl/vcl.hpp"
+#include <vector>
+
+// View frustum culling of bounding spheres
+//  The six planes are extracted from the rows of the clip matrix projection*view [Gribb and Hartmann 2001], oriented
+//  towards the inside and normalized: plane.xyz.p + plane.w is the signed distance of p to the plane. A sphere is
+//  culled when it lies entirely behind one of the planes.
+struct view_frustum
+{
+    float plane[6][4]; // Left, right, bottom, top, near, far
+};
+view_frustum view_frustum_from_matrix(vcl::mat4 const& projection_view);
+bool view_frustum_visible(view_frustum const& frustum, vcl::vec3 const& p, float r);
+
+// Bounding spheres of instances, stored as arrays of coordinates for the batched test
+struct bounding_spheres
+{
+    std::vector<float> x, y, z, r;
+
+    void clear();
+    void add(vcl::vec3 const& p, float radius);
+    size_t size() const { return x.size(); }
+    vcl::vec3 center(size_t k) const { return {x[k], y[k], z[k]}; }
+};
+
+// Indices of the spheres intersecting the frustum, in increasing order (4 spheres at a time with SSE on x86-64)
+void frustum_cull(view_frustum const& frustum, bounding_spheres const& spheres, std::vector<unsigned int>& visible);
@@ -0,0 +1,144 @@
+#include "instanced_drawable.hpp"
+#include <algorithm>
+
+using namespace vcl;
+
+// Same attribute locations as the mesh_drawable buffers (0: position, 1: normal, 2: color, 3: uv),
+// plus two per-instance attributes.
+static std::string const instanced_vertex_shader = R"(
+#version 330 core
+layout (location = 0) in vec3 position;
+layout (location = 1) in vec3 normal;
+layout (location = 2) in vec3 color;
+layout (location = 3) in vec2 uv;
+layout (location = 4) in vec4 instance_translate_scale;
+layout (location = 5) in vec4 instance_color_alpha;
+
+out struct fragment_data
+{
+    vec3 position;
+    vec3 normal;
+    vec3 color;
+    vec2 uv;
+    float alpha;
+} fragment;
+
+uniform mat4 projection;
+uniform mat4 view;
+uniform mat3 rotation;
+
+void main()
+{
+    vec3 p = instance_translate_scale.xyz + rotation * (instance_translate_scale.w * position);
+    fragment.position = p;
+    fragment.normal = rotation * normal;
+    fragment.color = color * instance_color_alpha.rgb;
+    fragment.uv = uv;
+    fragment.alpha = instance_color_alpha.a;
+    gl_Position = projection * view * vec4(p, 1.0);
+}
+)";
+
+static std::string const instanced_fragment_shader = R"(
+#version 330 core
+in struct fragment_data
+{
+    vec3 position;
+    vec3 normal;
+    vec3 color;
+    vec2 uv;
+    float alpha;
+} fragment;
+
+layout(location=0) out vec4 FragColor;
+
+uniform sampler2D image_texture;
+uniform mat4 view;
+uniform vec3 light = vec3(1.0, 1.0, 1.0);
+uniform vec3 color = vec3(1.0, 1.0, 1.0);
+uniform float ambient = 0.3;
+uniform float diffuse = 0.7;
+uniform float specular = 0.3;
+uniform float specular_exponent = 64.0;
+
+void main()
+{
+    vec3 N = normalize(fragment.normal);
+    if (gl_FrontFacing == false)
+        N = -N;
+    vec3 L = normalize(light-fragment.position);
+
+    float diffuse_component = max(dot(N,L),0.0);
+    float specular_component = 0.0;
+    if(diffuse_component>0.0) {
+        vec3 R = reflect(-L,N);
+        mat3 O = transpose(mat3(view));
+        vec3 camera_position = -O*vec3(view[3]);
+        vec3 V = normalize(camera_position-fragment.position);
+        specular_component = pow( max(dot(R,V),0.0), specular_exponent );
+    }
+
+    vec2 uv_image = vec2(fragment.uv.x, 1.0-fragment.uv.y);
+    vec4 color_image_texture = texture(image_texture, uv_image);
+    vec3 color_object = fragment.color * color * color_image_texture.rgb;
+    vec3 color_shading = (ambient + diffuse * diffuse_component) * color_object + specular * specular_component * vec3(1.0, 1.0, 1.0);
+
+    FragColor = vec4(color_shading, fragment.alpha * color_image_texture.a);
+}
+)";
+
+GLuint instanced_drawable_shader()
+{
+    static GLuint const shader = opengl_create_shader_program(instanced_vertex_shader, instanced_fragment_shader);
+    return shader;
+}
+
+instanced_drawable::instanced_drawable(mesh_drawable const& drawable_arg)
+    :drawable(drawable_arg), shader(instanced_drawable_shader())
+{
+    glGenBuffers(1, &instance_vbo);
+
+    // The per-instance attributes are added to the vertex array of the mesh: the other shaders do not read these locations
+    glBindVertexArray(drawable.vao);
+    glBindBuffer(GL_ARRAY_BUFFER, instance_vbo);
+    for(GLuint k=0; k<2; ++k) {
+        GLuint const location = 4+k;
+        glEnableVertexAttribArray(location);
+        glVertexAttribPointer(location, 4, GL_FLOAT, GL_FALSE, sizeof(instance_attributes), reinterpret_cast<void*>(k*4*sizeof(float)));
+        glVertexAttribDivisor(location, 1);
+    }
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+void instanced_drawable_draw_call(instanced_drawable& d, mat3 const& rotation)
+{
+    size_t const N = d.instances.size();
+
+    // Stream the instances: the buffer is orphaned every frame and only reallocated when it grows
+    glBindBuffer(GL_ARRAY_BUFFER, d.instance_vbo);
+    if(N > d.instance_capacity) {
+        d.instance_capacity = std::max(N, 2*d.instance_capacity);
+    }
+    glBufferData(GL_ARRAY_BUFFER, GLsizeiptr(d.instance_capacity*sizeof(instance_attributes)), nullptr, GL_STREAM_DRAW);
+    glBufferSubData(GL_ARRAY_BUFFER, 0, GLsizeiptr(N*sizeof(instance_attributes)), d.instances.data());
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    opengl_uniform(d.shader, "rotation", rotation);
+    opengl_uniform(d.shader, "color", d.drawable.shading.color);
+    opengl_uniform(d.shader, "ambient", d.drawable.shading.phong.ambient);
+    opengl_uniform(d.shader, "diffuse", d.drawable.shading.phong.diffuse);
+    opengl_uniform(d.shader, "specular", d.drawable.shading.phong.specular);
+
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, d.drawable.texture);
+    opengl_uniform(d.shader, "image_texture", 0);
+
+    glBindVertexArray(d.drawable.vao);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, d.drawable.vbo.at("index"));
+    glDrawElementsInstanced(GL_TRIANGLES, GLsizei(d.drawable.number_triangles*3), GL_UNSIGNED_INT, nullptr, GLsizei(N));
+
+    glBindVertexArray(0);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glUseProgram(0);
+}
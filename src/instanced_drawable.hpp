@@ -0,0 +1,47 @@
+#pragma once
+
+#include "vcl/vcl.hpp"
+#include <vector>
+
+// Per-instance attributes streamed to the GPU
+struct instance_attributes
+{
+    vcl::vec3 translate;
+    float scale;
+    vcl::vec3 color;
+    float alpha;
+};
+
+// Draw every instance of a mesh_drawable with a single draw call
+//  Instances share the mesh, texture, Phong parameters and rotation of the drawable, and have their own
+//  translation, scale, color and alpha. The attributes are uploaded to a streamed vertex buffer at every draw.
+struct instanced_drawable
+{
+    instanced_drawable() {}
+    explicit instanced_drawable(vcl::mesh_drawable const& drawable);
+
+    vcl::mesh_drawable drawable;              // Mesh, texture and shading shared by all instances
+    std::vector<instance_attributes> instances;
+
+    void clear() { instances.clear(); }
+    void add(vcl::vec3 const& translate, float scale, vcl::vec3 const& color = {1,1,1}, float alpha = 1.0f) { instances.push_back({translate, scale, color, alpha}); }
+
+    GLuint shader = 0;
+    GLuint instance_vbo = 0;
+    size_t instance_capacity = 0; // Number of instances the vbo can store
+};
+
+// Shader shared by every instanced_drawable
+GLuint instanced_drawable_shader();
+// Upload the instances and issue the draw call (the scene uniforms must already be set)
+void instanced_drawable_draw_call(instanced_drawable& drawable, vcl::mat3 const& rotation);
+
+template <typename SCENE>
+void draw(instanced_drawable& drawable, SCENE const& scene, vcl::mat3 const& instance_rotation = vcl::rotation().matrix())
+{
+    if(drawable.instances.empty())
+        return;
+    glUseProgram(drawable.shader);
+    opengl_uniform(drawable.shader, scene);
+    instanced_drawable_draw_call(drawable, instance_rotation);
+}
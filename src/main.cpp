@@ -1,7 +1,19 @@
 #include "vcl/vcl.hpp"
 #include <iostream>
+#include <fstream>
+#include <cstdio>
+#include <cstring>
 
 #include "simulation.hpp"
+#include "thread_pool.hpp"
+#include "instanced_drawable.hpp"
+#include "fluid_surface_drawable.hpp"
+#include "frustum_culling.hpp"
+#include "particle_pool.hpp"
+#include "physics_thread.hpp"
+#include "profiler.hpp"
+#include "asset_loader.hpp"
+#include "recording.hpp"
 
 
 using namespace vcl;
@@ -9,6 +21,12 @@ using namespace vcl;
 struct gui_parameters {
 	bool display_frame = true;
 	bool add_sphere = true;
+	int threads = int(thread_pool::global().thread_count()); // threads used by the simulation
+	bool instanced_rendering = true; // one draw call per type of particle
+	bool fluid_surface = true; // draw the fluids as a reconstructed surface instead of one cube per particle
+	bool popcorn_lod = true; // coarser popcorn meshes when they are small on screen
+	bool frustum_culling = true; // only draw the particles whose bounding sphere intersects the view
+	float lod_screen_size = 0.08f; // popcorns larger on screen (radius relative to the half height of the view) use the full mesh
 };
 
 struct user_interaction_parameters {
@@ -30,45 +48,69 @@ struct scene_environment
 };
 
 // SPH parameters
-bool animate = false;
-bool animate2 = false;
 sph_parameters_structure sph_parameters; // Physical parameter related to SPH
-buffer<sph_particle_element> sph_particles;      // Storage of the particles
-buffer<sph_particle_element> sph_particles2;
 mesh_drawable water_particle; // Sphere used to display a particle
+instanced_drawable water_instances; // Fluid particles of all the cups
+fluid_surface water_surface; // Surface of the fluids of all the cups, reconstructed every frame
+fluid_surface_drawable water_surface_drawable;
+thread_pool surface_threads; // The global pool is kept busy by the physics thread
 
-const vec3 shift = {0.4,0.3 ,-1};
-//const vec3 shift = {0.3,0.2 ,-1};
-const vec3 shift2 = {-0.27,-0.4 ,-1};
-const vec3 insideCup =  { 0, 0.15, -0.65};
-const vec3 insideCup2 =  { -0.6,-0.35, -0.65};
+// Fluid of a cup, as displayed
+struct fluid_display
+{
+    buffer<sph_particle_element> particles; // Positions in the frame of the fluid
+    vec3 shift;                             // Frame of the fluid in the scene
+    vec3 inside_cup;                        // Blue disk shown until the cup is hit
+    bool animate = false;
+};
+std::vector<fluid_display> fluids; // One per cup (domain k of physics_state::fluids)
 
 // Some scene elements and their parameters
 scene_environment scene;
 mesh_drawable table;
-mesh_drawable sphere;
+std::vector<mesh_drawable> popcorn_lods; // Popcorn mesh, from the full resolution to the coarsest level of detail
+std::vector<instanced_drawable> popcorn_instances; // Flying and vibrating popcorns, one per level of detail
+size_t const popcorn_lod_count = 4;
+std::vector<size_t> popcorn_lod_usage; // Popcorns drawn with each level during the last frame
 mesh_drawable pan;
 mesh_drawable blueDisk;
-mesh_drawable blueDisk2;
 bool first_time = true;
 const vec3 pan_position = {-1,-1,-1.08};
 std::vector<Cup> cups;
+collider_set scene_colliders; // Walls, table, pan and cup triggers
 std::vector<particle_structure> vibrating_popcorns; // vibrating popcorns
-const double v_factor = 1.8;
-std::vector<particle_structure> particles;
+std::vector<particle_structure> particles; // Displayed popcorns (interpolated from the simulation thread)
+popcorn_parameters_structure popcorn_parameters;
 
-timer_event_periodic timer(0.5f);
+timer_event_periodic timer(0.5f); // Time scale and popcorn emission period edited in the GUI
 
+// Simulation running at a fixed rate on its own thread
+physics_thread physics;
+physics_settings physics_parameters;
 
-// smoke parameters
-struct particle_bubble
+// Culling of the particles outside the view
+view_frustum camera_frustum; // Frustum of scene.camera, updated at the beginning of display_scene
+struct culling_counts
 {
-    vec3 p0;
-    float t0;
-    vec3 color;
-    float radius;
-    float phase;
+    size_t visible = 0;
+    size_t culled = 0;
 };
+culling_counts popcorn_culling, fluid_culling, billboard_culling; // During the last frame
+
+// Recording of the simulation steps (--record), and replay of a recording instead of the simulation (--replay)
+recording_writer recorder;
+recording_reader replay;
+struct replay_parameters
+{
+    bool play = true;
+    float time = 0;     // Displayed time of the recording, edited in the GUI to seek
+    float speed = 1.0f;
+    std::vector<affine_rts> cup_upright; // Transforms of the cups before they are tipped
+};
+replay_parameters replay_state;
+
+
+// smoke parameters
 struct particle_billboard
 {
     vec3 p0;
@@ -76,16 +118,17 @@ struct particle_billboard
 };
 // Visual elements of the scene related to the billboard/smoke
 mesh_drawable quad;   // used to display the sprites
+float const quad_size = 0.3f; // half size of the quad
+instanced_drawable quad_instances;
 
 // smoke-related functions
 particle_billboard create_new_billboard(float t);
 vec3 compute_billboard_position(particle_billboard const& billboard, float t_current);
-template <typename T> void remove_old_particles(std::vector<T>& particles, float t_current, float t_max);
+void update_billboards();
 
 // Particles and their timer
-std::vector<particle_bubble> bubbles;
-timer_event_periodic timer_bubble(0.15f);
-std::vector<particle_billboard> billboards;
+//  The pool holds the billboards alive at once (lifetime/period of the timer: 3 s/0.05 s)
+particle_pool<particle_billboard> billboards(64);
 timer_event_periodic timer_billboard(0.05f);
 
 // some functionalities
@@ -93,19 +136,52 @@ void mouse_move_callback(GLFWwindow* window, double xpos, double ypos);
 void window_size_callback(GLFWwindow* window, int width, int height);
 void initialize_data();
 void display_scene();
+void display_popcorns();
+void display_sph();
+void display_billboards();
 void display_interface();
-void emit_particle();
+void display_profiler();
+physics_state initial_physics_state();
+void update_physics_settings();
+void receive_physics(physics_snapshot const& previous, physics_snapshot const& current, float alpha);
+void update_replay();
+int compare_instancing(GLFWwindow* window, int width, int height, float duration);
 
 
-int main(int, char* argv[])
+int main(int argc, char* argv[])
 {
 	std::cout << "Run " << argv[0] << std::endl;
 
+	// --compare-instancing [seconds]: run the scene offscreen, then render it with and without instancing and compare the images
+	// --record file [--record-lossless]: record every simulation step, --replay file: display a recording without simulating
+	float compare_duration = -1.0f;
+	std::string record_file, replay_file;
+	recording_options record_options;
+	for(int k=1; k<argc; ++k) {
+		if(std::strcmp(argv[k], "--compare-instancing")==0)
+			compare_duration = (k+1<argc) ? float(std::atof(argv[k+1])) : 4.0f;
+		else if(std::strcmp(argv[k], "--record")==0 && k+1<argc)
+			record_file = argv[++k];
+		else if(std::strcmp(argv[k], "--record-lossless")==0)
+			record_options.quantize = false;
+		else if(std::strcmp(argv[k], "--replay")==0 && k+1<argc)
+			replay_file = argv[++k];
+	}
+
 	int const width = 1280, height = 1024;
 	GLFWwindow* window = create_window(width, height);
 	window_size_callback(window, width, height);
 	std::cout << opengl_info_display() << std::endl;
 
+	if(compare_duration>=0) {
+		glfwHideWindow(window);
+		initialize_data();
+		int const status = compare_instancing(window, width, height, compare_duration);
+		glfwDestroyWindow(window);
+		glfwTerminate();
+		return status;
+	}
+
 	imgui_init(window);
 	glfwSetCursorPosCallback(window, mouse_move_callback);
 	glfwSetWindowSizeCallback(window, window_size_callback);
@@ -113,12 +189,36 @@ int main(int, char* argv[])
 	std::cout<<"Initialize data ..."<<std::endl;
 	initialize_data();
 
+	if(!replay_file.empty()) {
+		if(!replay.open(replay_file) || replay.frame_count()==0) {
+			std::cerr << "Cannot replay " << replay_file << " (missing, empty, incomplete or other version)" << std::endl;
+			return 1;
+		}
+		std::cout << "Replay " << replay_file << ": " << replay.frame_count() << " frames, " << replay.duration() << " s" << std::endl;
+		for(Cup const& cup : cups)
+			replay_state.cup_upright.push_back(cup.body.transform);
+	}
+	else {
+		if(!record_file.empty()) {
+			if(recorder.open(record_file, record_options))
+				physics.set_recorder(&recorder);
+			else
+				std::cerr << "Cannot record to " << record_file << std::endl;
+		}
+		std::cout<<"Start simulation thread ..."<<std::endl;
+		update_physics_settings();
+		physics.start(initial_physics_state(), physics_parameters);
+	}
+
 	std::cout<<"Start animation loop ..."<<std::endl;
 	user.fps_record.start();
 	timer.start();
 	glEnable(GL_DEPTH_TEST);
+	profiler::global().set_thread_name("main");
 	while (!glfwWindowShouldClose(window))
 	{
+		profiler::global().new_frame();
+		PROFILE_SCOPE("frame");
 		scene.light = scene.camera.position();
 		user.fps_record.update();
 		timer.update();
@@ -137,24 +237,18 @@ int main(int, char* argv[])
 
 		if(user.gui.display_frame) draw(user.global_frame, scene);
 
-        emit_particle();
         display_interface();
-
-        std::map<size_t,vec3> positional_constraints;
-        float const dt = 0.01f * timer.scale;
-        simulate(particles, cups, dt, animate, animate2);
-        display_scene();
-
-        // SPH simulation
-        if(animate){
-            float const dt2 = 0.005f * timer.scale;
-            simulate(dt2, sph_particles, sph_parameters);
-        }
-
-        if(animate2) {
-            float const dt2 = 0.005f * timer.scale;
-            simulate(dt2, sph_particles2, sph_parameters);
+        update_physics_settings();
+
+        // Display the simulation one step behind, interpolated between its last two steps
+        if(replay.is_open())
+            update_replay();
+        else {
+            float const alpha = physics.update();
+            receive_physics(physics.previous(), physics.current(), alpha);
+            update_billboards();
         }
+        display_scene();
 
         ImGui::End();
         imgui_render_frame(window);
@@ -162,6 +256,12 @@ int main(int, char* argv[])
         glfwPollEvents();
     }
 
+    physics.stop();
+    if(recorder.is_open()) {
+        recorder.close();
+        std::cout << "Recorded " << record_file << ": " << recorder.written_frames << " frames (" << recorder.dropped_frames << " dropped), "
+                  << recorder.written_bytes/1024 << " KB" << std::endl;
+    }
     imgui_cleanup();
 	glfwDestroyWindow(window);
 	glfwTerminate();
@@ -170,55 +270,190 @@ int main(int, char* argv[])
 }
 
 
-void emit_particle()
+// State of the simulation thread at startup
+physics_state initial_physics_state()
 {
-	// Emit particle with random velocity
-	// Assume first that all particles have the same radius and mass
-	static buffer<vec3> const color_lut = {{1,0,0},{0,1,0},{0,0,1},{1,1,0},{1,0,1},{0,1,1}};
-	if (timer.event && user.gui.add_sphere) {
-		float const theta = rand_interval(0, 2*pi);
-		vec3 v = vec3(1.0f*std::cos(theta), 1.0f*std::sin(theta), 4.0f);
-        // add speed
-		v = v_factor*v;
-		particle_structure particle;
-		// starting position
-		particle.p = pan_position;
-		particle.r = 0.045f;
-		particle.c = color_lut[int(rand_interval()*color_lut.size())];
-		particle.v = v;
-		particle.m = 0.5f; //
-
-        particles.push_back(particle);
-	}
+    physics_state state;
+    state.popcorns = particles;
+    state.cups = cups;
+    state.colliders = scene_colliders;
+    for(fluid_display const& fluid : fluids)
+        state.fluids.add(fluid.particles, fluid.shift, sph_parameters, fluid.animate);
+    return state;
+}
+
+// Send the parameters edited in the GUI to the simulation thread
+void update_physics_settings()
+{
+    physics_parameters.time_scale = timer.scale;
+    physics_parameters.emit = user.gui.add_sphere;
+    physics_parameters.emission_period = timer.event_period;
+    physics_parameters.emission_position = pan_position;
+    physics_parameters.threads = size_t(user.gui.threads);
+    physics_parameters.popcorn = popcorn_parameters;
+    physics_parameters.sph = sph_parameters;
+    physics.set_settings(physics_parameters);
+}
+
+// Copy the simulated state to the displayed particles, cups and fluids
+void receive_physics(physics_snapshot const& previous, physics_snapshot const& current, float alpha)
+{
+    // Popcorns emitted during the last step have no previous position (nor the oldest ones emitted again under their id)
+    size_t const N = current.popcorns.size();
+    particles.resize(N);
+    for(size_t k=0; k<N; ++k) {
+        vec3 p = current.popcorns[k];
+        bool const emitted_again = k < previous.popcorn_spawn.size() && k < current.popcorn_spawn.size() && previous.popcorn_spawn[k] != current.popcorn_spawn[k];
+        if(k < previous.popcorns.size() && !emitted_again)
+            p = (1-alpha)*previous.popcorns[k] + alpha*p;
+        particles[k].p = p;
+        particles[k].r = current.popcorn_radius[k];
+    }
+
+    for(size_t k=0; k<current.cup_body.size() && k<cups.size(); ++k) {
+        cups[k].body.transform = current.cup_body[k];
+        cups[k].seat.transform = current.cup_seat[k];
+    }
+
+    for(size_t c=0; c<current.sph.size() && c<fluids.size(); ++c) {
+        std::vector<vec3> const& p1 = current.sph[c];
+        bool const interpolate = c<previous.sph.size() && previous.sph[c].size()==p1.size();
+        fluids[c].particles.resize(p1.size());
+        for(size_t k=0; k<p1.size(); ++k)
+            fluids[c].particles[k].p = interpolate ? (1-alpha)*previous.sph[c][k] + alpha*p1[k] : p1[k];
+        fluids[c].animate = current.animate[c];
+    }
+}
+
+// Displayed part of a recorded frame
+static void snapshot_from_recording(recorded_frame const& frame, physics_snapshot& snapshot)
+{
+    snapshot.popcorns = frame.popcorn_position;
+    snapshot.popcorn_radius = frame.popcorn_radius;
+    size_t const N_cup = std::min(cups.size(), replay_state.cup_upright.size());
+    snapshot.cup_body.resize(N_cup);
+    snapshot.cup_seat.resize(N_cup);
+    for(size_t k=0; k<N_cup; ++k) {
+        bool const tipped = k<2 && frame.cup_tipped[k];
+        snapshot.cup_body[k] = snapshot.cup_seat[k] = tipped ? cups[k].tipped : replay_state.cup_upright[k];
+    }
+    snapshot.sph.assign(frame.sph, frame.sph+2);
+    snapshot.animate.assign(frame.cup_tipped, frame.cup_tipped+2);
+}
+
+// Display the recording at the replay time (advanced while playing), interpolated between the two frames around it
+//  Playing forward only reads the next frame, seeking decodes from the key frame before the new time.
+void update_replay()
+{
+    static std::chrono::steady_clock::time_point previous_update = std::chrono::steady_clock::now();
+    std::chrono::steady_clock::time_point const now = std::chrono::steady_clock::now();
+    float const elapsed = std::chrono::duration<float>(now-previous_update).count();
+    previous_update = now;
+
+    float const duration = replay.duration();
+    if(replay_state.play) {
+        replay_state.time += replay_state.speed*elapsed;
+        if(replay_state.time > duration)
+            replay_state.time = 0; // Loop
+    }
+    replay_state.time = std::min(std::max(replay_state.time, 0.0f), duration);
+
+    static recorded_frame frames[2];
+    static physics_snapshot snapshots[2];
+    static size_t loaded[2] = {size_t(-1), size_t(-1)};
+    size_t const k0 = replay.frame_at(replay_state.time);
+    size_t const k1 = std::min(k0+1, replay.frame_count()-1);
+    if(loaded[1] == k0) {
+        std::swap(frames[0], frames[1]);
+        std::swap(snapshots[0], snapshots[1]);
+        loaded[0] = k0;
+        loaded[1] = size_t(-1);
+    }
+    size_t const k[2] = {k0, k1};
+    for(int i=0; i<2; ++i) {
+        if(loaded[i] != k[i]) {
+            replay.read(k[i], frames[i]);
+            snapshot_from_recording(frames[i], snapshots[i]);
+            loaded[i] = k[i];
+        }
+    }
+
+    float const t0 = replay.frame_time(k0), t1 = replay.frame_time(k1);
+    float const alpha = t1>t0 ? std::min(std::max((replay_state.time-t0)/(t1-t0), 0.0f), 1.0f) : 1.0f;
+    receive_physics(snapshots[0], snapshots[1], alpha);
+
+    // Smoke: the billboards alive at the replay time, on the clock of the recording
+    static std::vector<recorded_billboard> spawned;
+    replay.billboards(replay_state.time-3.0f, replay_state.time, spawned);
+    billboards.clear();
+    for(recorded_billboard const& billboard : spawned)
+        billboards.spawn({billboard.p0, billboard.time});
+    timer_billboard.t = replay_state.time;
 }
 
 
 void initialize_sph()
 {
-    // Initial particle spacing (relative to h)
-    float const c = 0.09f;//0.7f;
-    float h = sph_parameters.h;
-    h+=0.3f;
-    float z = 0.3f;
-    // Fill a square with particles
-    sph_particles.clear();
-    sph_particles2.clear();
-    for(float x=h; x<1.0f-h; x=x+c*h)
+    // Initial particle spacing: the lattice at the rest density (see sph_rest_density), so that each particle only
+    //  neighbors the few particles within h and the grid neighbor search keeps the cost linear in the particle count
+    float const s = sph_parameters.pbf_spacing;
+    // Fill a box of N_x*N_y particles per layer
+    int const N_x = 8, N_y = 16, N_layer = 8;
+    buffer<sph_particle_element> sph_particles;
+    for(int k_layer=0; k_layer<N_layer; ++k_layer)
     {
-        for(float y=-1.0f+h; y<1.0f-h; y=y+c*h)
+        float const z = 0.06f + k_layer*s;
+        for(int i=0; i<N_x; ++i)
         {
-            sph_particle_element particle;
-            particle.p = {x+h/8.0*rand_interval(),y+h/8.0*rand_interval(),z+h/8.0*rand_interval()}; // a zero value in z position will lead to a 2D simulation
-            particle.p /= 5;
-            sph_particles.push_back(particle);
-            sph_particles2.push_back(particle);
+            for(int j=0; j<N_y; ++j)
+            {
+                float const x = 0.085f + i*s, y = (j-0.5f*N_y)*s;
+                sph_particle_element particle;
+                particle.p = {x+s/8*rand_interval(),y+s/8*rand_interval(),z+s/8*rand_interval()};
+                particle.id = (unsigned int)sph_particles.size();
+                sph_particles.push_back(particle);
+            }
         }
     }
+
+    // The same fluid in each cup
+    fluids.resize(2);
+    fluids[0].shift = {0.4,0.3 ,-1};
+    fluids[0].inside_cup = { 0, 0.15, -0.65};
+    fluids[1].shift = {-0.27,-0.4 ,-1};
+    fluids[1].inside_cup = { -0.6,-0.35, -0.65};
+    for(fluid_display& fluid : fluids) {
+        fluid.particles = sph_particles;
+        fluid.animate = false;
+    }
 }
 
 
 void initialize_data()
 {
+    // Assets are loaded on the worker threads during the rest of the initialization, and uploaded when first used
+    //  The table and the pan are rotated and scaled when their cache entry is built.
+    auto const time_assets = std::chrono::steady_clock::now();
+    asset_cache cache("cache");
+    asset_loader assets(cache);
+    mat3 rot = {
+            1.0,0,0,
+            0,float(cos(1.5708)),-1*float(sin(1.5708)),
+            0,float(sin(1.5708)),float(cos(1.5708))
+    };
+    std::vector<size_t> popcorn_meshes;
+    for(unsigned int lod=0; lod<popcorn_lod_count; ++lod)
+        popcorn_meshes.push_back(assets.request_mesh("assets/Rock.obj", rotation().matrix(), 1.0f, lod));
+    size_t const table_mesh = assets.request_mesh("assets/Wood_Table.obj", rot, 4.0f);
+    size_t const pan_mesh = assets.request_mesh("assets/pan.obj", rot, 1/20.0f);
+    size_t const popcorn_texture = assets.request_texture("assets/popcorn.png");
+    size_t const pan_texture = assets.request_texture("assets/pan.png");
+    size_t const wood_texture = assets.request_texture("assets/wood.png");
+    size_t const cup_body_texture = assets.request_texture("assets/cup_body.png");
+    size_t const cup_seat_texture = assets.request_texture("assets/cup_seat.png");
+    size_t const smoke_texture = assets.request_texture("assets/smoke.png");
+    assets.start();
+
 	GLuint const shader_mesh = opengl_create_shader_program(opengl_shader_preset("mesh_vertex"), opengl_shader_preset("mesh_fragment"));
 	GLuint const shader_uniform_color = opengl_create_shader_program(opengl_shader_preset("single_color_vertex"), opengl_shader_preset("single_color_fragment"));
 	GLuint const texture_white = opengl_texture_to_gpu(image_raw{1,1,image_color_type::rgba,{255,255,255,255}});
@@ -233,39 +468,23 @@ void initialize_data()
 	scene.camera.look_at({5,5,5}, {0,0,0}, {0,0,2});
 
 	// popcorn
-	mesh popcorn = mesh_load_file_obj("assets/Rock.obj");
-    sphere = mesh_drawable(popcorn);
-    sphere.texture = opengl_texture_to_gpu(image_load_png("assets/popcorn.png"));
-
-	// table and pan meshes
-    mesh table_m = mesh_load_file_obj("assets/Wood_Table.obj");
-    mesh pan_m = mesh_load_file_obj("assets/pan.obj");
-
-    // rotation
-    mat3 rot = {
-            1.0,0,0,
-            0,float(cos(1.5708)),-1*float(sin(1.5708)),
-            0,float(sin(1.5708)),float(cos(1.5708))
-    };
-    for(int i=0; i<pan_m.position.size(); i++) {
-        pan_m.position.at(i) = rot*pan_m.position.at(i);
+    for(size_t const popcorn_mesh : popcorn_meshes) {
+        popcorn_lods.push_back(assets.drawable(popcorn_mesh));
+        popcorn_lods.back().texture = assets.texture(popcorn_texture);
+        popcorn_instances.push_back(instanced_drawable(popcorn_lods.back()));
     }
 
-    for(int i=0; i<table_m.position.size(); i++) {
-        table_m.position.at(i) = rot*table_m.position.at(i);
-    }
-
-    // scaling
-    pan_m.position /= 20;
-    table_m.position *= 4;
+	// table and pan meshes
+    mesh_asset const& table_m = assets.mesh(table_mesh);
+    mesh_asset const& pan_m = assets.mesh(pan_mesh);
 
     // mesh_draw
-    pan = mesh_drawable(pan_m);
-    pan.texture = opengl_texture_to_gpu(image_load_png("assets/pan.png"));
-    table = mesh_drawable(table_m);
+    pan = assets.drawable(pan_mesh);
+    pan.texture = assets.texture(pan_texture);
+    table = assets.drawable(table_mesh);
     table.transform.translate = {-0.5,-0.5,-2.93};
     pan.transform.translate = pan_position;
-    table.texture = opengl_texture_to_gpu(image_load_png("assets/wood.png"));
+    table.texture = assets.texture(wood_texture);
 
     // cups
     for(int i=0;i<2;i++){
@@ -273,14 +492,47 @@ void initialize_data()
 	    cup.body = mesh_drawable(mesh_primitive_cylinder(0.2f));
         cup.seat = mesh_drawable(mesh_primitive_disc(0.2f));
     	cups.push_back(cup);
-        cups[i].body.texture = opengl_texture_to_gpu(image_load_png("assets/cup_body.png"));
-    	cups[i].seat.texture = opengl_texture_to_gpu(image_load_png("assets/cup_seat.png"));
+        cups[i].body.texture = assets.texture(cup_body_texture); // Uploaded once, shared by the cups
+    	cups[i].seat.texture = assets.texture(cup_seat_texture);
    	}
 	cups[0].body.transform.translate = cups[0].seat.transform.translate = {0, 0.15, -1.04};
     cups[1].body.transform.translate = cups[1].seat.transform.translate = {-0.6,-0.35,-1.04};
     cups[0].body.transform.scale = cups[0].seat.transform.scale = 0.5;
     cups[1].body.transform.scale = cups[1].seat.transform.scale = 0.5;
 
+    // Cups tipped over when a popcorn falls into them
+    mat3 rot_diag = {
+            0, 0, 1,
+            1, 1, 0,
+            -1, 0, 0
+    };
+    mat3 rot_x = {
+            0, 0, 1,
+            0, 1, 0,
+            -1, 0, 0
+    };
+    cups[0].tipped = cups[0].body.transform;
+    cups[0].tipped.rotate = rotation(rot_diag);
+    cups[0].tipped.translate = {0,0.15,-0.92};
+    cups[1].tipped = cups[1].body.transform;
+    cups[1].tipped.rotate = rotation(rot_x);
+    cups[1].tipped.translate = {-0.6,-0.35,-0.92};
+
+    // Colliders: walls around the table (the floor is at the level of the feet of the table), table and pan meshes,
+    // and a trigger inside each cup
+    collider_add_box_walls(scene_colliders, {-1,-1,-2.91f}, {1,1,1});
+    std::vector<triangle> table_triangles, pan_triangles;
+    triangles_append(table_triangles, table_m.position, table_m.connectivity, table_m.N_triangle, table.transform);
+    triangles_append(pan_triangles, pan_m.position, pan_m.connectivity, pan_m.N_triangle, pan.transform);
+    scene_colliders.add_mesh(table_triangles);
+    scene_colliders.add_mesh(pan_triangles);
+    for(size_t k=0; k<cups.size(); ++k) {
+        collider trigger = collider_cylinder(cups[k].body.transform.translate, {0,0,1}, 0.2f, 0.55f);
+        trigger.trigger = true;
+        trigger.tag = int(k);
+        scene_colliders.add(trigger);
+    }
+
     // adding vibrating popcorns
     for(int i=0;i<70;i++){
         particle_structure particle;
@@ -297,17 +549,21 @@ void initialize_data()
     water_particle.transform.scale = 0.08f;
     water_particle.shading.phong = {10, 0, 0};
     water_particle.shading.color = {0, 0, 1};
+    water_instances = instanced_drawable(water_particle);
+    water_instances.drawable.shading.color = {1,1,1}; // The color is given per instance
+    water_surface_drawable = fluid_surface_drawable(vec3{0.2f, 0.4f, 1.0f});
     blueDisk = mesh_drawable(mesh_primitive_disc());
     blueDisk.shading.color = {0,0,1};
 
-    blueDisk2 = mesh_drawable(mesh_primitive_disc());
-    blueDisk2.shading.color = {0,0,1};
-
     // Smoke: billboard texture and associated quadrangle
-    GLuint const texture_billboard = opengl_texture_to_gpu(image_load_png("assets/smoke.png"));
-    float const L = 0.3f; // size of the quad
+    GLuint const texture_billboard = assets.texture(smoke_texture);
+    std::cout << "  assets: " << cache.hits << " from the cache, " << cache.rebuilds << " rebuilt, "
+              << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now()-time_assets).count() << " ms" << std::endl;
+    assets.report(std::cout);
+    float const L = quad_size;
     quad = mesh_drawable(mesh_primitive_quadrangle({-L,-L,0},{L,-L,0},{L,L,0},{-L,L,0}));
     quad.texture = texture_billboard;
+    quad_instances = instanced_drawable(quad);
 }
 
 
@@ -341,30 +597,26 @@ vec3 compute_billboard_position(particle_billboard const& billboard, float t_cur
 }
 
 
-void display_scene()
+// Indices of the visible spheres (all of them when the culling is disabled)
+void cull(bounding_spheres const& spheres, std::vector<unsigned int>& visible, culling_counts& counts)
 {
-    // displaying the popcorns going out from the pan
-	size_t const N = particles.size();
-	for(size_t k=0; k<N; ++k)
-	{
-		particle_structure const& particle = particles[k];
-		sphere.shading.color = {1,1,1};
-		sphere.transform.translate = particle.p;
-		sphere.transform.scale = particle.r;
-		if(first_time){
-            first_time = false;
-		}
-
-		draw(sphere, scene);
-	}
-
-    // displaying vibrating popcorns
-    for(int i=0;i<vibrating_popcorns.size();i++) {
-        particle_structure const& particle = vibrating_popcorns[i];
-        sphere.transform.translate = {RandomFloat(-0.9, -1.34), RandomFloat(-0.9, -1.2), -0.92};
-        sphere.transform.scale = particle.r;
-        draw(sphere, scene);
+    PROFILE_SCOPE("culling");
+    if(user.gui.frustum_culling)
+        frustum_cull(camera_frustum, spheres, visible);
+    else {
+        visible.resize(spheres.size());
+        for(size_t k = 0; k < spheres.size(); ++k)
+            visible[k] = (unsigned int)k;
     }
+    counts.visible = visible.size();
+    counts.culled = spheres.size() - visible.size();
+}
+
+void display_scene()
+{
+    PROFILE_SCOPE("display scene");
+    camera_frustum = view_frustum_from_matrix(scene.projection * scene.camera.matrix_view());
+    display_popcorns();
 
     draw(table, scene); // displaying table
 	draw(pan, scene); // displaying pan
@@ -374,39 +626,136 @@ void display_scene()
         draw(cups[i].seat, scene);
     }
 
-    // SPH display
-    // remove this to remove the spheres of the particles of fluid
-    if(animate){
-        for (size_t k = 0; k < sph_particles.size(); ++k) {
-            vec3 const& p = sph_particles[k].p;
-            water_particle.transform.translate = p + shift;
-            draw(water_particle, scene);
+    display_sph();
+    display_billboards();
+}
+
+// Level of detail of a popcorn: each coarser level is used once the popcorn is half as large on screen
+size_t popcorn_lod(vec3 const& p, float r)
+{
+    if(!user.gui.popcorn_lod)
+        return 0;
+    // Radius on screen relative to the half height of the view
+    float const size = r * scene.projection(1,1) / std::max(norm(p - scene.camera.position()), 1e-3f);
+    size_t lod = 0;
+    for(float threshold = user.gui.lod_screen_size; lod+1<popcorn_lods.size() && size<threshold; threshold /= 2)
+        lod++;
+    return lod;
+}
+
+void display_popcorns()
+{
+    PROFILE_SCOPE("display popcorns");
+    bool const instanced = user.gui.instanced_rendering;
+    for(instanced_drawable& instances : popcorn_instances)
+        instances.clear();
+    popcorn_lod_usage.assign(popcorn_lods.size(), 0);
+
+    // Bounding spheres of the popcorns going out from the pan, then of the vibrating popcorns
+    static bounding_spheres spheres; // Kept between calls to reuse their memory
+    static std::vector<unsigned int> visible;
+    spheres.clear();
+	for(particle_structure const& particle : particles)
+		spheres.add(particle.p, particle.r);
+    for(int i=0;i<vibrating_popcorns.size();i++)
+        spheres.add({RandomFloat(-0.9, -1.34), RandomFloat(-0.9, -1.2), -0.92}, vibrating_popcorns[i].r);
+    cull(spheres, visible, popcorn_culling);
+
+    for(unsigned int k : visible)
+    {
+        vec3 const p = spheres.center(k);
+        float const r = spheres.r[k];
+        size_t const lod = popcorn_lod(p, r);
+        popcorn_lod_usage[lod]++;
+        if(instanced) {
+            popcorn_instances[lod].add(p, r);
+            continue;
         }
+        mesh_drawable& sphere = popcorn_lods[lod];
+        sphere.shading.color = {1,1,1};
+        sphere.transform.translate = p;
+        sphere.transform.scale = r;
+        draw(sphere, scene);
     }
-    else {
-        blueDisk.transform.translate = insideCup;
-        blueDisk.transform.scale = 0.1f;
-        draw(blueDisk, scene);
+
+    if(instanced)
+        for(instanced_drawable& instances : popcorn_instances)
+            draw(instances, scene);
+}
+
+void display_sph()
+{
+    PROFILE_SCOPE("display sph");
+    bool const instanced = user.gui.instanced_rendering;
+    water_instances.clear();
+
+    // One surface for the fluids of all the cups
+    if(user.gui.fluid_surface) {
+        static std::vector<vec3> positions; // Kept between calls to reuse its memory
+        positions.clear();
+        for(fluid_display const& fluid : fluids)
+            if(fluid.animate)
+                for(size_t k = 0; k < fluid.particles.size(); ++k)
+                    positions.push_back(fluid.particles[k].p + fluid.shift);
+        {
+            PROFILE_SCOPE("fluid surface");
+            water_surface.update(positions, surface_threads);
+        }
+        draw(water_surface_drawable, water_surface, scene, user.gui.frustum_culling ? &camera_frustum : nullptr);
     }
 
-    // for the second cup
-    if(animate2){
-        for (size_t k = 0; k < sph_particles2.size(); ++k) {
-            vec3 const& p = sph_particles2[k].p;
-            water_particle.transform.translate = p + shift2;
-            draw(water_particle, scene);
+    // SPH display
+    // remove this to remove the spheres of the particles of fluid
+    static bounding_spheres spheres; // Kept between calls to reuse their memory
+    static std::vector<unsigned int> visible;
+    spheres.clear();
+    float const particle_radius = 0.87f*water_particle.transform.scale; // Half diagonal of the cube
+    for(fluid_display const& fluid : fluids) {
+        if(fluid.animate){
+            if(user.gui.fluid_surface)
+                continue;
+            for (size_t k = 0; k < fluid.particles.size(); ++k)
+                spheres.add(fluid.particles[k].p + fluid.shift, particle_radius);
+        }
+        else {
+            blueDisk.transform.translate = fluid.inside_cup;
+            blueDisk.transform.scale = 0.1f;
+            draw(blueDisk, scene);
         }
     }
-    else {
-        blueDisk2.transform.translate = insideCup2;
-        blueDisk2.transform.scale = 0.1f;
-        draw(blueDisk2, scene);
+    cull(spheres, visible, fluid_culling);
+    for(unsigned int k : visible) {
+        if(instanced) {
+            water_instances.add(spheres.center(k), water_particle.transform.scale, water_particle.shading.color);
+            continue;
+        }
+        water_particle.transform.translate = spheres.center(k);
+        draw(water_particle, scene);
     }
 
-    // Smoke
+    if(instanced)
+        draw(water_instances, scene);
+}
+
+// Smoke: spawn the new billboards and remove the old ones
+void update_billboards()
+{
+    PROFILE_SCOPE("update billboards");
     timer_billboard.update();
-    if(timer_billboard.event)
-        billboards.push_back( create_new_billboard(timer_billboard.t) );
+    if(timer_billboard.event) {
+        billboards.spawn( create_new_billboard(timer_billboard.t) );
+        if(recorder.is_open())
+            recorder.record_billboard(billboards.back().p0, std::chrono::steady_clock::now());
+    }
+    billboards.expire(timer_billboard.t, 3.0f);
+}
+
+void display_billboards()
+{
+    PROFILE_SCOPE("display billboards");
+    bool const instanced = user.gui.instanced_rendering;
+    quad_instances.clear();
+
     // Enable transparency using alpha blending (if display_transparent_billboard is true)
     if(user.display_transparent_billboard){
         glEnable(GL_BLEND);
@@ -416,33 +765,131 @@ void display_scene()
     else
         glDisable(GL_BLEND);
 
+    // The quads face the camera: their bounding sphere is the circle through their corners
+    static bounding_spheres spheres; // Kept between calls to reuse their memory
+    static std::vector<unsigned int> visible;
+    spheres.clear();
     for(size_t k = 0; k < billboards.size(); ++k)
-    {
-        vec3 const p = compute_billboard_position(billboards[k], timer_billboard.t);
-        quad.transform.translate = p;
-        quad.transform.rotate = scene.camera.orientation();
+        spheres.add(compute_billboard_position(billboards[k], timer_billboard.t), 1.42f*quad_size);
+    cull(spheres, visible, billboard_culling);
 
+    for(unsigned int k : visible)
+    {
+        vec3 const p = spheres.center(k);
         float const alpha = (timer_billboard.t-billboards[k].t0)/3.0f;
-        quad.shading.alpha = (1-alpha)*std::sqrt(alpha);
+        float const opacity = (1-alpha)*std::sqrt(alpha);
 
+        // Instances are drawn in order, so the blending gives the same result as one draw per billboard
+        if(instanced) {
+            quad_instances.add(p, 1.0f, {1,1,1}, opacity);
+            continue;
+        }
+        quad.transform.translate = p;
+        quad.transform.rotate = scene.camera.orientation();
+        quad.shading.alpha = opacity;
         draw(quad, scene);
     }
+    if(instanced)
+        draw(quad_instances, scene, scene.camera.orientation().matrix());
     glDepthMask(true);
-    remove_old_particles(billboards, timer_billboard.t, 3.0f);
 }
 
 
-// Generic function allowing to remove particles with a lifetime greater than t_max
-template <typename T>
-void remove_old_particles(std::vector<T>& particles, float t_current, float t_max)
+// Write the RGBA pixels read by glReadPixels (bottom row first) as a binary PPM
+static void write_ppm(std::string const& filename, std::vector<unsigned char> const& rgba, int width, int height)
 {
-    for (auto it = particles.begin(); it != particles.end();)
-    {
-        if (t_current - it->t0 > t_max)
-            it = particles.erase(it);
-        if(it!=particles.end())
-            ++it;
+    std::ofstream stream(filename, std::ios::binary);
+    stream << "P6\n" << width << " " << height << "\n255\n";
+    for(int y=height-1; y>=0; --y)
+        for(int x=0; x<width; ++x)
+            stream.write(reinterpret_cast<char const*>(&rgba[4*(size_t(y)*width+x)]), 3);
+}
+
+// Render the current scene into the framebuffer object and read it back
+static std::vector<unsigned char> render_offscreen(int width, int height, bool instanced)
+{
+    user.gui.instanced_rendering = instanced;
+    user.gui.fluid_surface = false; // Compare the fluid particles too
+    std::srand(5); // Same positions for the vibrating popcorns in both renderings
+
+    glClearColor(1.0f, 1.0f, 1.0f, 1.0f);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    display_scene();
+    glFinish();
+
+    std::vector<unsigned char> rgba(4*size_t(width)*height);
+    glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, rgba.data());
+    return rgba;
+}
+
+// Simulate duration seconds worth of physics steps without displaying them, then render the last frame
+// once per draw and once instanced in an offscreen framebuffer. Both images are written as PPM files.
+// Returns 0 when the images match (up to rasterization differences on a few pixels).
+// Runs without a GPU using Mesa software rendering: LIBGL_ALWAYS_SOFTWARE=1 (llvmpipe), e.g. under xvfb-run.
+int compare_instancing(GLFWwindow*, int width, int height, float duration)
+{
+    physics_state state = initial_physics_state();
+    for(sph_domain& domain : state.fluids.domains)
+        domain.active = true;
+    timer.event_period = 0.05f;
+    update_physics_settings();
+
+    // Same steps as the simulation thread, run synchronously
+    physics_snapshot snapshot;
+    timer_billboard.start();
+    int const N_step = int(duration*physics_parameters.step_rate);
+    for(int k=0; k<N_step; ++k) {
+        physics_step(state, physics_parameters);
+        update_billboards();
+    }
+    physics_snapshot_capture(snapshot, state);
+    receive_physics(snapshot, snapshot, 1.0f);
+    scene.light = scene.camera.position();
+
+    GLuint fbo = 0, color = 0, depth = 0;
+    glGenFramebuffers(1, &fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    glGenRenderbuffers(1, &color);
+    glBindRenderbuffer(GL_RENDERBUFFER, color);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, color);
+    glGenRenderbuffers(1, &depth);
+    glBindRenderbuffer(GL_RENDERBUFFER, depth);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depth);
+    if(glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+        std::cerr << "Cannot create the offscreen framebuffer" << std::endl;
+        return 1;
     }
+    glViewport(0, 0, width, height);
+    glEnable(GL_DEPTH_TEST);
+
+    std::vector<unsigned char> const per_draw = render_offscreen(width, height, false);
+    std::vector<unsigned char> const instanced = render_offscreen(width, height, true);
+    write_ppm("instancing_per_draw.ppm", per_draw, width, height);
+    write_ppm("instancing_instanced.ppm", instanced, width, height);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glDeleteRenderbuffers(1, &color);
+    glDeleteRenderbuffers(1, &depth);
+    glDeleteFramebuffers(1, &fbo);
+
+    // Count the pixels differing by more than a few intensity levels
+    size_t N_different = 0;
+    int max_difference = 0;
+    for(size_t k=0; k<per_draw.size(); k+=4) {
+        int difference = 0;
+        for(size_t c=0; c<3; ++c)
+            difference = std::max(difference, std::abs(int(per_draw[k+c])-int(instanced[k+c])));
+        max_difference = std::max(max_difference, difference);
+        if(difference > 8)
+            N_different++;
+    }
+    float const ratio = N_different / float(size_t(width)*height);
+
+    std::cout << "Instancing comparison: " << particles.size() << " popcorns, " << state.fluids.particles.size() << " fluid particles, " << billboards.size() << " billboards" << std::endl;
+    std::cout << "  different pixels: " << N_different << " (" << 100*ratio << "%), max difference: " << max_difference << std::endl;
+    return ratio < 0.001f ? 0 : 1;
 }
 
 
@@ -452,6 +899,95 @@ void display_interface()
 	ImGui::SliderFloat("Time scale", &timer.scale, 0.05f, 2.0f, "%.2f s");
     ImGui::SliderFloat("Interval create sphere", &timer.event_period, 0.05f, 2.0f, "%.2f s");
     ImGui::Checkbox("Add sphere", &user.gui.add_sphere);
+    int max_popcorns = int(physics_parameters.max_popcorns);
+    ImGui::SliderInt("Popcorn budget", &max_popcorns, 16, 1024);
+    physics_parameters.max_popcorns = (unsigned int)max_popcorns;
+    ImGui::Text("Popcorns %zu/%u, smoke %zu/%zu (%zu replaced before their end)", particles.size(), physics_parameters.max_popcorns,
+                billboards.size(), billboards.budget(), billboards.replaced());
+    ImGui::Checkbox("Grid broad phase", &popcorn_parameters.use_grid_broad_phase);
+    ImGui::Checkbox("Sleeping popcorn", &popcorn_parameters.use_sleeping);
+    ImGui::Checkbox("SPH symmetric forces", &sph_parameters.symmetric_forces);
+    ImGui::Checkbox("Instanced rendering", &user.gui.instanced_rendering);
+    ImGui::Checkbox("Frustum culling", &user.gui.frustum_culling);
+    ImGui::Text("Visible/culled: popcorns %zu/%zu, fluid %zu/%zu, smoke %zu/%zu, surface blocks %zu/%zu",
+                popcorn_culling.visible, popcorn_culling.culled, fluid_culling.visible, fluid_culling.culled,
+                billboard_culling.visible, billboard_culling.culled, water_surface_drawable.visible_blocks, water_surface_drawable.culled_blocks);
+    ImGui::Checkbox("Popcorn LOD", &user.gui.popcorn_lod);
+    if(user.gui.popcorn_lod) {
+        ImGui::SliderFloat("LOD screen size", &user.gui.lod_screen_size, 0.01f, 0.5f, "%.2f");
+        std::string lod_usage;
+        size_t popcorn_triangles = 0;
+        for(size_t lod=0; lod<popcorn_lod_usage.size(); ++lod) {
+            lod_usage += (lod>0 ? " / " : "") + str(popcorn_lod_usage[lod]);
+            popcorn_triangles += popcorn_lod_usage[lod]*popcorn_lods[lod].number_triangles;
+        }
+        ImGui::Text("Popcorns per LOD: %s, %zu triangles", lod_usage.c_str(), popcorn_triangles);
+    }
+    ImGui::Checkbox("Fluid surface", &user.gui.fluid_surface);
+    if(user.gui.fluid_surface) {
+        ImGui::SliderFloat("Surface radius", &water_surface.parameters.radius, 0.02f, 0.1f, "%.3f");
+        ImGui::SliderFloat("Surface cell", &water_surface.parameters.cell_size, 0.005f, 0.05f, "%.3f");
+        fluid_surface_stats const& surface_stats = water_surface.stats();
+        ImGui::Text("Surface: %zu triangles, %zu blocks (%zu rebuilt), %zu vertices uploaded", surface_stats.triangles, surface_stats.blocks,
+                    surface_stats.rebuilt, water_surface_drawable.uploaded_vertices);
+    }
+    ImGui::SliderFloat("Physics steps/s", &physics_parameters.step_rate, 10.0f, 240.0f, "%.0f");
+    ImGui::Text("Physics: %d steps/s, last step %.2f ms, %d skipped", physics.steps_per_second.load(), 1000*physics.current().step_duration, physics.skipped_steps.load());
+    ImGui::Checkbox("Adaptive popcorn substeps", &popcorn_parameters.adaptive_substeps);
+    ImGui::Checkbox("Continuous popcorn collisions", &popcorn_parameters.use_ccd);
+    ImGui::Checkbox("Parallel popcorn contacts", &popcorn_parameters.parallel_contacts);
+    ImGui::SliderFloat("Popcorn CFL", &popcorn_parameters.substep_cfl, 0.05f, 1.0f, "%.2f");
+    int sph_solver_index = int(sph_parameters.solver);
+    ImGui::RadioButton("Explicit SPH", &sph_solver_index, int(sph_solver::explicit_pressure)); ImGui::SameLine();
+    ImGui::RadioButton("Position based SPH", &sph_solver_index, int(sph_solver::position_based));
+    sph_parameters.solver = sph_solver(sph_solver_index);
+    ImGui::SliderFloat("SPH time step", &physics_parameters.dt_sph, 0.001f, 0.05f, "%.3f s");
+    ImGui::Checkbox("Adaptive SPH time step", &sph_parameters.adaptive_time_step);
+    ImGui::SliderFloat("SPH CFL velocity", &sph_parameters.cfl_velocity, 0.05f, 1.0f, "%.2f");
+    ImGui::SliderFloat("SPH CFL force", &sph_parameters.cfl_force, 0.05f, 1.0f, "%.2f");
+    ImGui::SliderFloat("Popcorn reorder disorder", &popcorn_parameters.reorder_disorder, 0.0f, 2.0f, "%.2f");
+    ImGui::SliderFloat("SPH reorder disorder", &sph_parameters.reorder_disorder, 0.0f, 2.0f, "%.2f");
+    std::string fluid_substeps;
+    for(size_t c=0; c<physics.current().sph_substeps.size(); ++c)
+        fluid_substeps += (c>0 ? " / " : "") + str(physics.current().sph_substeps[c]);
+    ImGui::Text("Substeps: popcorn %zu, fluids %s", physics.current().popcorn_substeps, fluid_substeps.c_str());
+    triangle_bvh_stats const& mesh_stats = physics.current().mesh_stats;
+    float const N_query = float(std::max(mesh_stats.queries, size_t(1)));
+    ImGui::Text("Mesh queries: %zu, %.1f nodes and %.1f triangles per query, %zu contacts", mesh_stats.queries, mesh_stats.nodes_visited/N_query, mesh_stats.triangles_tested/N_query, mesh_stats.contacts);
+    ImGui::SliderInt("Threads", &user.gui.threads, 1, int(std::thread::hardware_concurrency()));
+    if(recorder.is_open())
+        ImGui::Text("Recording: %zu frames, %zu KB, %zu dropped", recorder.written_frames.load(), recorder.written_bytes.load()/1024, recorder.dropped_frames.load());
+    if(replay.is_open()) {
+        ImGui::Checkbox("Play", &replay_state.play);
+        ImGui::SliderFloat("Replay time", &replay_state.time, 0.0f, replay.duration(), "%.2f s");
+        ImGui::SliderFloat("Replay speed", &replay_state.speed, 0.1f, 4.0f, "%.2f");
+    }
+    display_profiler();
+}
+
+// Time spent in each profiled scope during the last frames, and capture of a trace of the next frames
+void display_profiler()
+{
+    if(!ImGui::CollapsingHeader("Profiler"))
+        return;
+#ifdef MAGICAL_POPCORN_PROFILER
+    profiler& p = profiler::global();
+    for(profiler::scope_stats const& scope : p.stats()) {
+        char overlay[64];
+        std::snprintf(overlay, sizeof(overlay), "%.2f ms, %zu calls", scope.average_ms, scope.calls);
+        float const max_ms = *std::max_element(scope.history_ms.begin(), scope.history_ms.end());
+        ImGui::PlotHistogram(scope.name.c_str(), scope.history_ms.data(), int(scope.history_ms.size()), int(p.history_offset()),
+                             overlay, 0.0f, std::max(max_ms, 0.01f), ImVec2(0, 40));
+    }
+    if(p.tracing())
+        ImGui::Text("Capturing the trace ...");
+    else if(ImGui::Button("Capture trace (120 frames)"))
+        p.start_trace("trace.json", 120);
+    if(!p.last_trace().empty())
+        ImGui::Text("Last trace: %s", p.last_trace().c_str());
+#else
+    ImGui::Text("Disabled: configure with -DPROFILER=ON");
+#endif
 }
 
 void window_size_callback(GLFWwindow* , int width, int height)
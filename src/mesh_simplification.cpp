@@ -0,0 +1,360 @@
+#include "mesh_simplification.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <map>
+#include <queue>
+#include <set>
+#include <tuple>
+#include <vector>
+
+using namespace vcl;
+
+namespace
+{
+    // Symmetric 4x4 matrix of the squared distance to a set of planes: error(p) = [p 1] Q [p 1]^t
+    struct quadric
+    {
+        double a[10] = {0,0,0,0,0,0,0,0,0,0}; // xx xy xz xw yy yz yw zz zw ww
+
+        quadric& operator+=(quadric const& q)
+        {
+            for(int k=0; k<10; ++k)
+                a[k] += q.a[k];
+            return *this;
+        }
+    };
+
+    // Plane n.p + d = 0 (n of unit length)
+    quadric plane_quadric(vec3 const& n, float d, double weight)
+    {
+        double const x = n.x, y = n.y, z = n.z, w = d;
+        quadric q;
+        double const v[10] = {x*x, x*y, x*z, x*w, y*y, y*z, y*w, z*z, z*w, w*w};
+        for(int k=0; k<10; ++k)
+            q.a[k] = weight*v[k];
+        return q;
+    }
+
+    double quadric_error(quadric const& q, vec3 const& p)
+    {
+        double const x = p.x, y = p.y, z = p.z;
+        double const* a = q.a;
+        return a[0]*x*x + 2*a[1]*x*y + 2*a[2]*x*z + 2*a[3]*x + a[4]*y*y + 2*a[5]*y*z + 2*a[6]*y + a[7]*z*z + 2*a[8]*z + a[9];
+    }
+
+    // Position minimizing the error, false when the system is singular (flat or cylindrical neighborhood)
+    bool quadric_minimum(quadric const& q, vec3& p)
+    {
+        double const* a = q.a;
+        double const m[3][3] = { {a[0], a[1], a[2]}, {a[1], a[4], a[5]}, {a[2], a[5], a[7]} };
+        double const b[3] = {-a[3], -a[6], -a[8]};
+        double const det = m[0][0]*(m[1][1]*m[2][2]-m[1][2]*m[2][1]) - m[0][1]*(m[1][0]*m[2][2]-m[1][2]*m[2][0]) + m[0][2]*(m[1][0]*m[2][1]-m[1][1]*m[2][0]);
+        double const scale = std::abs(m[0][0]) + std::abs(m[1][1]) + std::abs(m[2][2]);
+        if(std::abs(det) <= 1e-9*scale*scale*scale || scale == 0)
+            return false;
+        // Cramer's rule
+        double x[3];
+        for(int c=0; c<3; ++c) {
+            double mc[3][3];
+            for(int i=0; i<3; ++i)
+                for(int j=0; j<3; ++j)
+                    mc[i][j] = j==c ? b[i] : m[i][j];
+            x[c] = (mc[0][0]*(mc[1][1]*mc[2][2]-mc[1][2]*mc[2][1]) - mc[0][1]*(mc[1][0]*mc[2][2]-mc[1][2]*mc[2][0]) + mc[0][2]*(mc[1][0]*mc[2][1]-mc[1][1]*mc[2][0])) / det;
+        }
+        p = {float(x[0]), float(x[1]), float(x[2])};
+        return true;
+    }
+
+    struct simplification_vertex
+    {
+        vec3 p;
+        quadric q;
+        std::vector<unsigned int> triangles; // May still list removed triangles
+        unsigned int version = 0;          // Incremented at every collapse involving the vertex
+        bool removed = false;
+    };
+
+    struct simplification_triangle
+    {
+        unsigned int v[3];
+        vec2 uv[3];
+        bool removed = false;
+    };
+
+    struct collapse_candidate
+    {
+        double cost;
+        unsigned int a, b;
+        unsigned int version_a, version_b; // The candidate is stale once a vertex changed
+        vec3 p;
+
+        bool operator>(collapse_candidate const& c) const { return cost > c.cost; }
+    };
+
+    class simplifier
+    {
+    public:
+        std::vector<simplification_vertex> vertices;
+        std::vector<simplification_triangle> triangles;
+        size_t N_live = 0;
+
+        void initialize_quadrics();
+        void run(size_t target_triangles);
+
+    private:
+        void push_candidate(unsigned int a, unsigned int b);
+        bool collapse(collapse_candidate const& c);
+        void neighbors(unsigned int v, std::vector<unsigned int>& result) const;
+        vec3 normal(simplification_triangle const& t) const;
+
+        std::priority_queue<collapse_candidate, std::vector<collapse_candidate>, std::greater<collapse_candidate> > heap;
+    };
+
+    vec3 simplifier::normal(simplification_triangle const& t) const
+    {
+        return cross(vertices[t.v[1]].p-vertices[t.v[0]].p, vertices[t.v[2]].p-vertices[t.v[0]].p);
+    }
+
+    void simplifier::neighbors(unsigned int v, std::vector<unsigned int>& result) const
+    {
+        result.clear();
+        for(unsigned int t : vertices[v].triangles) {
+            if(triangles[t].removed)
+                continue;
+            for(unsigned int w : triangles[t].v)
+                if(w != v)
+                    result.push_back(w);
+        }
+        std::sort(result.begin(), result.end());
+        result.erase(std::unique(result.begin(), result.end()), result.end());
+    }
+
+    void simplifier::initialize_quadrics()
+    {
+        // Planes of the triangles, weighted by their area
+        for(simplification_triangle const& t : triangles) {
+            vec3 const n = normal(t);
+            float const length = norm(n);
+            if(length == 0)
+                continue;
+            vec3 const u = n/length;
+            quadric const q = plane_quadric(u, -dot(u, vertices[t.v[0]].p), 0.5*length);
+            for(unsigned int v : t.v)
+                vertices[v].q += q;
+        }
+
+        // Border edges (a single triangle): plane through the edge orthogonal to the triangle, heavily weighted
+        std::map<std::pair<unsigned int, unsigned int>, int> edge_count;
+        for(simplification_triangle const& t : triangles)
+            for(int k=0; k<3; ++k)
+                edge_count[std::make_pair(std::min(t.v[k], t.v[(k+1)%3]), std::max(t.v[k], t.v[(k+1)%3]))]++;
+        for(simplification_triangle const& t : triangles) {
+            for(int k=0; k<3; ++k) {
+                unsigned int const a = t.v[k], b = t.v[(k+1)%3];
+                if(edge_count[std::make_pair(std::min(a, b), std::max(a, b))] != 1)
+                    continue;
+                vec3 const e = vertices[b].p - vertices[a].p;
+                vec3 const n = cross(e, normal(t));
+                float const length = norm(n);
+                if(length == 0)
+                    continue;
+                vec3 const u = n/length;
+                quadric const q = plane_quadric(u, -dot(u, vertices[a].p), 1000.0*dot(e, e));
+                vertices[a].q += q;
+                vertices[b].q += q;
+            }
+        }
+    }
+
+    void simplifier::push_candidate(unsigned int a, unsigned int b)
+    {
+        simplification_vertex const& va = vertices[a];
+        simplification_vertex const& vb = vertices[b];
+        quadric q = va.q;
+        q += vb.q;
+
+        // Best of the optimal position, the two ends and the middle
+        collapse_candidate c;
+        c.a = a;
+        c.b = b;
+        c.version_a = va.version;
+        c.version_b = vb.version;
+        c.p = (va.p+vb.p)/2.0f;
+        c.cost = quadric_error(q, c.p);
+        vec3 options[3] = {va.p, vb.p, va.p};
+        int const N_option = quadric_minimum(q, options[2]) ? 3 : 2;
+        for(int k=0; k<N_option; ++k) {
+            double const cost = quadric_error(q, options[k]);
+            if(cost < c.cost) {
+                c.cost = cost;
+                c.p = options[k];
+            }
+        }
+        heap.push(c);
+    }
+
+    bool simplifier::collapse(collapse_candidate const& c)
+    {
+        simplification_vertex& va = vertices[c.a];
+        simplification_vertex& vb = vertices[c.b];
+        if(va.removed || vb.removed || va.version != c.version_a || vb.version != c.version_b)
+            return false;
+
+        // Link condition: the only common neighbors are the opposite vertices of the triangles of the edge
+        std::vector<unsigned int> na, nb, common;
+        neighbors(c.a, na);
+        neighbors(c.b, nb);
+        std::set_intersection(na.begin(), na.end(), nb.begin(), nb.end(), std::back_inserter(common));
+        size_t N_shared = 0;
+        for(unsigned int t : va.triangles) {
+            simplification_triangle const& tri = triangles[t];
+            if(!tri.removed && (tri.v[0]==c.b || tri.v[1]==c.b || tri.v[2]==c.b))
+                N_shared++;
+        }
+        if(N_shared == 0 || common.size() != N_shared)
+            return false;
+
+        // No triangle may flip or degenerate
+        for(unsigned int end : {c.a, c.b}) {
+            for(unsigned int t : vertices[end].triangles) {
+                simplification_triangle const& tri = triangles[t];
+                if(tri.removed || std::count(tri.v, tri.v+3, c.a) + std::count(tri.v, tri.v+3, c.b) == 2)
+                    continue;
+                vec3 const before = normal(tri);
+                vec3 p[3];
+                for(int k=0; k<3; ++k)
+                    p[k] = tri.v[k]==end ? c.p : vertices[tri.v[k]].p;
+                vec3 const after = cross(p[1]-p[0], p[2]-p[0]);
+                if(dot(before, after) <= 0.2f*norm(before)*norm(after) || norm(after) == 0)
+                    return false;
+            }
+        }
+
+        // b is merged into a
+        for(unsigned int t : va.triangles) {
+            simplification_triangle& tri = triangles[t];
+            if(!tri.removed && (tri.v[0]==c.b || tri.v[1]==c.b || tri.v[2]==c.b)) {
+                tri.removed = true;
+                N_live--;
+            }
+        }
+        for(unsigned int t : vb.triangles) {
+            simplification_triangle& tri = triangles[t];
+            if(tri.removed)
+                continue;
+            for(unsigned int& v : tri.v)
+                if(v == c.b)
+                    v = c.a;
+            va.triangles.push_back(t);
+        }
+        std::vector<unsigned int> live;
+        for(unsigned int t : va.triangles)
+            if(!triangles[t].removed)
+                live.push_back(t);
+        std::sort(live.begin(), live.end());
+        live.erase(std::unique(live.begin(), live.end()), live.end());
+        va.triangles.swap(live);
+        va.p = c.p;
+        va.q += vb.q;
+        va.version++;
+        vb.removed = true;
+        vb.triangles.clear();
+
+        neighbors(c.a, na);
+        for(unsigned int n : na)
+            push_candidate(c.a, n);
+        return true;
+    }
+
+    void simplifier::run(size_t target_triangles)
+    {
+        std::set<std::pair<unsigned int, unsigned int> > edges;
+        for(simplification_triangle const& t : triangles)
+            for(int k=0; k<3; ++k)
+                edges.insert(std::make_pair(std::min(t.v[k], t.v[(k+1)%3]), std::max(t.v[k], t.v[(k+1)%3])));
+        for(auto const& e : edges)
+            push_candidate(e.first, e.second);
+
+        while(N_live > target_triangles && !heap.empty()) {
+            collapse_candidate const c = heap.top();
+            heap.pop();
+            collapse(c);
+        }
+    }
+}
+
+mesh mesh_simplify(mesh const& m, size_t target_triangles)
+{
+    simplifier s;
+
+    // Weld the vertices sharing a position
+    std::map<std::array<float, 3>, unsigned int> welded;
+    std::vector<unsigned int> welded_index(m.position.size());
+    for(size_t k=0; k<m.position.size(); ++k) {
+        std::array<float, 3> const key = {{m.position[k].x, m.position[k].y, m.position[k].z}};
+        auto const it = welded.find(key);
+        if(it != welded.end()) {
+            welded_index[k] = it->second;
+            continue;
+        }
+        welded_index[k] = (unsigned int)s.vertices.size();
+        welded[key] = welded_index[k];
+        s.vertices.push_back(simplification_vertex());
+        s.vertices.back().p = m.position[k];
+    }
+    bool const has_uv = m.uv.size() == m.position.size();
+    for(size_t k=0; k<m.connectivity.size(); ++k) {
+        simplification_triangle t;
+        for(int i=0; i<3; ++i) {
+            unsigned int const v = m.connectivity[k][i];
+            t.v[i] = welded_index[v];
+            t.uv[i] = has_uv ? m.uv[v] : vec2{0, 0};
+        }
+        if(t.v[0]==t.v[1] || t.v[1]==t.v[2] || t.v[0]==t.v[2])
+            continue;
+        for(unsigned int v : t.v)
+            s.vertices[v].triangles.push_back((unsigned int)s.triangles.size());
+        s.triangles.push_back(t);
+    }
+    s.N_live = s.triangles.size();
+
+    s.initialize_quadrics();
+    s.run(target_triangles);
+
+    // One vertex per position and uv used by the remaining triangles, normals averaged over the welded position
+    std::vector<vec3> welded_normal(s.vertices.size(), vec3{0, 0, 0});
+    for(simplification_triangle const& t : s.triangles) {
+        if(t.removed)
+            continue;
+        vec3 const n = cross(s.vertices[t.v[1]].p-s.vertices[t.v[0]].p, s.vertices[t.v[2]].p-s.vertices[t.v[0]].p);
+        for(unsigned int v : t.v)
+            welded_normal[v] += n;
+    }
+
+    mesh result;
+    std::map<std::tuple<unsigned int, float, float>, unsigned int> output_index; // (welded vertex, u, v)
+    for(simplification_triangle const& t : s.triangles) {
+        if(t.removed)
+            continue;
+        uint3 triangle;
+        for(int i=0; i<3; ++i) {
+            auto const key = std::make_tuple(t.v[i], t.uv[i].x, t.uv[i].y);
+            auto const it = output_index.find(key);
+            if(it != output_index.end()) {
+                triangle[i] = it->second;
+                continue;
+            }
+            triangle[i] = (unsigned int)result.position.size();
+            output_index[key] = triangle[i];
+            float const length = norm(welded_normal[t.v[i]]);
+            result.position.push_back(s.vertices[t.v[i]].p);
+            result.normal.push_back(length > 0 ? welded_normal[t.v[i]]/length : vec3{0, 0, 1});
+            result.uv.push_back(t.uv[i]);
+        }
+        result.connectivity.push_back(triangle);
+    }
+    result.fill_empty_field();
+    return result;
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include "vcl/vcl.hpp"
+#include <algorithm>
+
+// Simplification of a triangle mesh by quadric edge collapse [Garland and Heckbert 1997]
+//  The edge of smallest quadric error is collapsed until target_triangles triangles remain (or no edge can be
+//  collapsed without folding a triangle over or making the mesh non-manifold). The vertices of the input sharing a
+//  position (uv seams of the OBJ files) are collapsed together so that the seams stay closed: each triangle corner keeps
+//  its own uv, and the normals are computed again on the welded positions. Borders are kept by penalizing their motion.
+vcl::mesh mesh_simplify(vcl::mesh const& m, size_t target_triangles);
+
+// Number of triangles of level lod of a chain where each level halves the previous one
+inline size_t mesh_lod_triangles(size_t N_triangle, unsigned int lod)
+{
+    return std::max(N_triangle >> lod, size_t(4));
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include "vcl/vcl.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <type_traits>
+#include <vector>
+
+// Order of the particles along a Z-order (Morton) curve of their positions
+//  Particles close along the curve are close in space: storing the particles in this order keeps the neighbors
+//  visited by the grid loops close in memory. Positions are quantized on 10 bits per axis over their bounding box.
+
+// Interleave the 10 low bits of x with two zero bits: ...x9 0 0 x8 0 0 ... x0
+inline uint32_t morton_expand_bits(uint32_t x)
+{
+    x &= 0x3ff;
+    x = (x | (x << 16)) & 0x030000ff;
+    x = (x | (x <<  8)) & 0x0300f00f;
+    x = (x | (x <<  4)) & 0x030c30c3;
+    x = (x | (x <<  2)) & 0x09249249;
+    return x;
+}
+
+inline uint32_t morton_code(uint32_t x, uint32_t y, uint32_t z)
+{
+    return (morton_expand_bits(x) << 2) | (morton_expand_bits(y) << 1) | morton_expand_bits(z);
+}
+
+// Morton code of every particle (any container of elements having a position p)
+template <typename T>
+void morton_codes(T const& particles, std::vector<uint32_t>& codes)
+{
+    size_t const N = particles.size();
+    codes.resize(N);
+    if(N == 0)
+        return;
+
+    vcl::vec3 p_min = particles[0].p, p_max = particles[0].p;
+    for(size_t k=1; k<N; ++k) {
+        for(int i=0; i<3; ++i) {
+            p_min[i] = std::min(p_min[i], particles[k].p[i]);
+            p_max[i] = std::max(p_max[i], particles[k].p[i]);
+        }
+    }
+    // Same scale on every axis so that the cells are cubes
+    float const extent = std::max(p_max.x-p_min.x, std::max(p_max.y-p_min.y, p_max.z-p_min.z));
+    float const scale = extent>0 ? 1023.0f/extent : 0.0f;
+
+    for(size_t k=0; k<N; ++k) {
+        vcl::vec3 const q = (particles[k].p - p_min) * scale;
+        codes[k] = morton_code(uint32_t(std::min(q.x, 1023.0f)), uint32_t(std::min(q.y, 1023.0f)), uint32_t(std::min(q.z, 1023.0f)));
+    }
+}
+
+// Permutation sorting the particles by code: particle order[k] goes to index k
+inline void morton_sort_order(std::vector<uint32_t> const& codes, std::vector<unsigned int>& order)
+{
+    size_t const N = codes.size();
+    std::vector<uint64_t> keys(N);
+    for(size_t k=0; k<N; ++k)
+        keys[k] = (uint64_t(codes[k]) << 32) | k; // Ties keep the current order
+    std::sort(keys.begin(), keys.end());
+    order.resize(N);
+    for(size_t k=0; k<N; ++k)
+        order[k] = (unsigned int)(keys[k] & 0xffffffffu);
+}
+
+// Move particles[order[k]] to index k
+template <typename T>
+void apply_order(T& particles, std::vector<unsigned int> const& order)
+{
+    typedef typename std::decay<decltype(particles[0])>::type element;
+    std::vector<element> reordered(order.size());
+    for(size_t k=0; k<order.size(); ++k)
+        reordered[k] = particles[order[k]];
+    for(size_t k=0; k<order.size(); ++k)
+        particles[k] = reordered[k];
+}
+
+// Average distance between consecutive particles in memory: it grows as the particles move away from the sorted order
+template <typename T>
+float consecutive_distance(T const& particles)
+{
+    size_t const N = particles.size();
+    if(N < 2)
+        return 0.0f;
+    double sum = 0;
+    for(size_t k=0; k+1<N; ++k)
+        sum += vcl::norm(particles[k+1].p - particles[k].p);
+    return float(sum/(N-1));
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <algorithm>
+#include <vector>
+
+// Fixed-capacity pool of short-lived particles (the smoke billboards), stored in a ring buffer
+//  Particles are spawned at the back and expire from the front: as long as they share the same lifetime, the ring stays
+//  sorted by spawn time t0, so spawning and expiring are O(1) and the memory never grows past the budget. Once the budget
+//  is reached, a spawn replaces the oldest particle. Elements only need a spawn time t0.
+//  Particles are indexed from the oldest (0) to the youngest (size()-1).
+template <typename T>
+class particle_pool
+{
+public:
+    explicit particle_pool(size_t budget) : ring(std::max(budget, size_t(1))) {}
+
+    // Maximum number of particles alive, at least one (keeps the youngest ones when reduced)
+    void set_budget(size_t budget);
+    size_t budget() const { return ring.size(); }
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    T& operator[](size_t k) { return ring[wrap(first+k)]; }
+    T const& operator[](size_t k) const { return ring[wrap(first+k)]; }
+    T& back() { return (*this)[count-1]; }
+
+    // Add a particle (replaces the oldest one when the pool is full)
+    T& spawn(T const& particle);
+    // Remove the particles older than lifetime at time t_current
+    void expire(float t_current, float lifetime);
+    void clear() { first = 0; count = 0; }
+
+    size_t replaced() const { return replaced_count; } // Particles replaced before their expiry since the creation
+
+private:
+    size_t wrap(size_t k) const { return k < ring.size() ? k : k - ring.size(); }
+
+    std::vector<T> ring;
+    size_t first = 0; // Oldest particle
+    size_t count = 0;
+    size_t replaced_count = 0;
+};
+
+
+template <typename T>
+void particle_pool<T>::set_budget(size_t budget)
+{
+    budget = std::max(budget, size_t(1));
+    if(budget == ring.size())
+        return;
+    size_t const N = std::min(count, budget);
+    std::vector<T> resized(budget);
+    for(size_t k=0; k<N; ++k)
+        resized[k] = (*this)[count-N+k];
+    ring.swap(resized);
+    first = 0;
+    count = N;
+}
+
+template <typename T>
+T& particle_pool<T>::spawn(T const& particle)
+{
+    if(count == ring.size()) {
+        first = wrap(first+1);
+        count--;
+        replaced_count++;
+    }
+    T& slot = ring[wrap(first+count)];
+    slot = particle;
+    count++;
+    return slot;
+}
+
+template <typename T>
+void particle_pool<T>::expire(float t_current, float lifetime)
+{
+    while(count > 0 && t_current - ring[first].t0 > lifetime) {
+        first = wrap(first+1);
+        count--;
+    }
+}
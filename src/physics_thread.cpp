@@ -0,0 +1,243 @@
+#include "physics_thread.hpp"
+#include "profiler.hpp"
+#include "recording.hpp"
+#include "thread_pool.hpp"
+
+#include <algorithm>
+
+using namespace vcl;
+
+// Wake up the sleeping islands of the given ids (sorted), so that the popcorns resting on a removed one fall again
+static void wake_islands(std::vector<particle_structure>& popcorns, std::vector<unsigned int> const& islands)
+{
+	if(islands.empty())
+		return;
+	for(particle_structure& particle : popcorns) {
+		if(particle.sleeping && std::binary_search(islands.begin(), islands.end(), particle.island)) {
+			particle.sleeping = false;
+			particle.rest_time = 0;
+		}
+	}
+}
+
+// Emit a popcorn from the pan with a random velocity
+//  Ids stay within [0, max_popcorns): once the budget is reached, the oldest popcorn is taken back to the pan, so that the
+//  simulation and the snapshots stop growing.
+static void emit_popcorn(physics_state& state, vec3 const& position, unsigned int max_popcorns)
+{
+	// Assume first that all particles have the same radius and mass
+	static buffer<vec3> const color_lut = {{1,0,0},{0,1,0},{0,0,1},{1,1,0},{1,0,1},{0,1,1}};
+	double const v_factor = 1.8;
+
+	float const theta = rand_interval(0, 2*pi);
+	vec3 v = vec3(1.0f*std::cos(theta), 1.0f*std::sin(theta), 4.0f);
+	// add speed
+	v = v_factor*v;
+	particle_structure particle;
+	// starting position
+	particle.p = position;
+	particle.r = 0.045f;
+	particle.c = color_lut[int(rand_interval()*color_lut.size())];
+	particle.v = v;
+	particle.m = 0.5f;
+
+	// A reduced budget removes the popcorns of the largest ids
+	max_popcorns = std::max(max_popcorns, 1u);
+	if(state.popcorns.size() > max_popcorns) {
+		std::vector<unsigned int> islands;
+		for(particle_structure const& removed : state.popcorns)
+			if(removed.id >= max_popcorns && removed.sleeping && removed.island != 0)
+				islands.push_back(removed.island);
+		std::sort(islands.begin(), islands.end());
+		wake_islands(state.popcorns, islands);
+		state.popcorns.erase(std::remove_if(state.popcorns.begin(), state.popcorns.end(),
+			[max_popcorns](particle_structure const& p) { return p.id >= max_popcorns; }), state.popcorns.end());
+		state.popcorn_spawn.resize(max_popcorns);
+	}
+
+	if(state.popcorns.size() < max_popcorns) {
+		particle.id = (unsigned int)state.popcorns.size();
+		state.popcorns.push_back(particle);
+	}
+	else {
+		// The popcorns are reordered in memory: search the oldest one by its id (once per emission)
+		particle.id = state.recycled_popcorn % max_popcorns;
+		state.recycled_popcorn = particle.id + 1;
+		for(particle_structure& recycled : state.popcorns) {
+			if(recycled.id == particle.id) {
+				if(recycled.sleeping && recycled.island != 0)
+					wake_islands(state.popcorns, {recycled.island});
+				recycled = particle;
+			}
+		}
+	}
+	state.popcorn_spawn.resize(state.popcorns.size());
+	state.popcorn_spawn[particle.id] = state.emitted_popcorns++;
+}
+
+void physics_step(physics_state& state, physics_settings const& settings)
+{
+    PROFILE_SCOPE("physics step");
+    // The emission period is counted in steps so that it does not depend on the time spent computing them
+    state.emission_time += 1.0f/settings.step_rate;
+    if(state.emission_time >= settings.emission_period) {
+        state.emission_time = 0;
+        if(settings.emit)
+            emit_popcorn(state, settings.emission_position, settings.max_popcorns);
+    }
+
+    {
+        PROFILE_SCOPE("popcorns");
+        reorder_particles(state.popcorns, settings.popcorn, state.popcorn_reordering);
+        state.colliders.mesh_stats = triangle_bvh_stats();
+        state.popcorn_substeps = simulate(state.popcorns, state.colliders, settings.dt_popcorn, settings.popcorn, state.popcorn_work);
+        state.mesh_stats = state.colliders.mesh_stats;
+    }
+
+    // A popcorn falling into a cup tips it over and starts the simulation of its fluid
+    state.colliders.dispatch_triggers([&state](collider const& trigger) {
+        Cup& cup = state.cups[trigger.tag];
+        cup.body.transform = cup.seat.transform = cup.tipped;
+        if(trigger.tag >= 0 && size_t(trigger.tag) < state.fluids.domains.size())
+            state.fluids.domains[trigger.tag].active = true;
+    });
+
+    // All the active fluids are stepped together
+    PROFILE_SCOPE("fluids");
+    for(sph_domain& domain : state.fluids.domains)
+        domain.parameters = settings.sph;
+    reorder_particles(state.fluids);
+    simulate(settings.dt_sph, state.fluids);
+}
+
+void physics_snapshot_capture(physics_snapshot& snapshot, physics_state const& state)
+{
+    size_t const N = state.popcorns.size();
+    snapshot.popcorns.resize(N);
+    snapshot.popcorn_radius.resize(N);
+    snapshot.popcorn_spawn = state.popcorn_spawn;
+    for(particle_structure const& particle : state.popcorns) {
+        snapshot.popcorns[particle.id] = particle.p;
+        snapshot.popcorn_radius[particle.id] = particle.r;
+    }
+
+    snapshot.cup_body.resize(state.cups.size());
+    snapshot.cup_seat.resize(state.cups.size());
+    for(size_t k=0; k<state.cups.size(); ++k) {
+        snapshot.cup_body[k] = state.cups[k].body.transform;
+        snapshot.cup_seat[k] = state.cups[k].seat.transform;
+    }
+
+    snapshot.popcorn_substeps = state.popcorn_substeps;
+    snapshot.mesh_stats = state.mesh_stats;
+    size_t const N_fluid = state.fluids.domains.size();
+    snapshot.sph.resize(N_fluid);
+    snapshot.animate.resize(N_fluid);
+    snapshot.sph_substeps.resize(N_fluid);
+    for(size_t c=0; c<N_fluid; ++c) {
+        sph_domain const& domain = state.fluids.domains[c];
+        snapshot.animate[c] = domain.active;
+        snapshot.sph_substeps[c] = domain.substeps;
+        snapshot.sph[c].resize(domain.count);
+        for(size_t k=0; k<domain.count; ++k) {
+            sph_particle_element const& particle = state.fluids.particles[domain.offset+k];
+            snapshot.sph[c][particle.id] = particle.p;
+        }
+    }
+}
+
+
+void physics_thread::start(physics_state const& initial_state, physics_settings const& settings)
+{
+    stop();
+    state = initial_state;
+    shared_settings = settings;
+
+    // The renderer starts from the initial state
+    physics_snapshot_capture(snapshots.write_buffer(), state);
+    snapshots.write_buffer().time = std::chrono::steady_clock::now();
+    snapshots.publish();
+
+    running = true;
+    thread = std::thread(&physics_thread::run, this);
+}
+
+void physics_thread::stop()
+{
+    running = false;
+    if(thread.joinable())
+        thread.join();
+}
+
+void physics_thread::set_settings(physics_settings const& settings)
+{
+    std::lock_guard<std::mutex> lock(settings_mutex);
+    shared_settings = settings;
+}
+
+float physics_thread::update()
+{
+    snapshots.receive();
+    physics_snapshot const& p = snapshots.previous();
+    physics_snapshot const& c = snapshots.current();
+
+    // Display the time now - (c.time - p.time), which is between p.time and c.time until the next snapshot is due
+    std::chrono::duration<float> const interval = c.time - p.time;
+    if(interval.count() <= 0)
+        return 1.0f;
+    std::chrono::duration<float> const elapsed = std::chrono::steady_clock::now() - c.time;
+    return std::min(std::max(elapsed.count()/interval.count(), 0.0f), 1.0f);
+}
+
+void physics_thread::run()
+{
+    typedef std::chrono::steady_clock clock;
+    clock::time_point next_step = clock::now();
+    clock::time_point second_start = next_step;
+    int steps = 0, skipped = 0;
+    profiler::global().set_thread_name("physics");
+
+    while(running)
+    {
+        physics_settings settings;
+        {
+            std::lock_guard<std::mutex> lock(settings_mutex);
+            settings = shared_settings;
+        }
+        clock::duration const period = std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(1.0/(settings.step_rate*settings.time_scale)));
+
+        // The steps size their per-thread buffers from the thread count: it only changes between them
+        thread_pool::global().set_thread_count(settings.threads);
+
+        std::this_thread::sleep_until(next_step);
+        clock::time_point const step_start = clock::now();
+        physics_step(state, settings);
+        clock::time_point const step_end = clock::now();
+
+        physics_snapshot& snapshot = snapshots.write_buffer();
+        {
+            PROFILE_SCOPE("snapshot capture");
+            physics_snapshot_capture(snapshot, state);
+        }
+        snapshot.time = next_step;
+        snapshot.step_duration = std::chrono::duration<double>(step_end-step_start).count();
+        snapshots.publish();
+        if(recorder != nullptr)
+            recorder->record(state, next_step);
+        steps++;
+
+        // After a spike, only catch up on a few steps: the late ones are dropped instead of stalling the simulation
+        next_step += period;
+        if(step_end - next_step > 4*period) {
+            skipped += int((step_end - next_step)/period);
+            next_step = step_end;
+        }
+
+        if(step_end - second_start >= std::chrono::seconds(1)) {
+            steps_per_second = steps;
+            skipped_steps = skipped;
+            steps = skipped = 0;
+            second_start = step_end;
+        }
+    }
+}
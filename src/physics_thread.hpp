@@ -0,0 +1,152 @@
+#pragma once
+
+#include "simulation.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Lock-free hand-over of snapshots from one producer thread to one consumer thread
+//  The producer fills write_buffer() and publishes it, the consumer receives the latest published snapshot
+//  and keeps the one it received before (for interpolation). Four buffers rotate between the producer (back),
+//  the exchange slot (middle) and the consumer (previous, current): nobody ever waits for the other thread.
+//  Snapshots published while the consumer is busy are overwritten by the newer ones.
+template <typename T>
+class snapshot_exchange
+{
+public:
+    // Producer side
+    T& write_buffer() { return buffers[back]; }
+    void publish() { back = middle.exchange(back | fresh) & index_mask; }
+
+    // Consumer side: returns true when a new snapshot became current()
+    bool receive()
+    {
+        if((middle.load() & fresh) == 0)
+            return false;
+        unsigned int const received = middle.exchange(previous_index) & index_mask;
+        previous_index = current_index;
+        current_index = received;
+        return true;
+    }
+    T const& previous() const { return buffers[previous_index]; }
+    T const& current() const { return buffers[current_index]; }
+
+private:
+    static unsigned int const fresh = 4;      // Set in middle when it holds a snapshot not yet received
+    static unsigned int const index_mask = 3;
+
+    T buffers[4];
+    unsigned int back = 0;                    // Owned by the producer
+    std::atomic<unsigned int> middle{1};      // Exchanged by both threads
+    unsigned int previous_index = 2, current_index = 3; // Owned by the consumer
+};
+
+
+// Simulated state of the scene (popcorns, cups and fluids)
+struct physics_state
+{
+    std::vector<particle_structure> popcorns;
+    std::vector<Cup> cups;
+    collider_set colliders;                  // Walls, obstacles and one trigger per cup (tagged with the index of the cup)
+    sph_domain_set fluids;                   // Fluid of each cup (domain k in cup k), simulated once the cup is hit
+    particle_reordering popcorn_reordering;  // Morton reordering of the popcorns
+    popcorn_workspace popcorn_work;          // Contact buffers and sleeping islands of the popcorns
+
+    float emission_time = 0; // Time since the last popcorn was emitted
+    unsigned int recycled_popcorn = 0;       // Id of the popcorn emitted again once the budget is reached (the oldest one)
+    std::vector<unsigned int> popcorn_spawn; // Emission of each popcorn id, counted from the start
+    unsigned int emitted_popcorns = 0;
+
+    // Substeps taken by the last step (the fluids keep theirs in their domain)
+    size_t popcorn_substeps = 0;
+    triangle_bvh_stats mesh_stats; // Cost of the mesh collisions during the last step
+};
+
+// Parameters edited in the GUI, read by the simulation at the beginning of each step
+struct physics_settings
+{
+    float step_rate = 60.0f;        // Steps per second of wall-clock time (at time scale 1)
+    float time_scale = 1.0f;        // Slows down or speeds up the stepping
+    float dt_popcorn = 0.01f;       // Simulated time of a step
+    float dt_sph = 0.005f;
+    size_t threads = 0;             // Threads of the global pool, changed between two steps (0 = one per core)
+
+    bool emit = true;               // Emit popcorns from the pan
+    float emission_period = 0.5f;   // In wall-clock seconds at time scale 1
+    vcl::vec3 emission_position;
+    unsigned int max_popcorns = 256; // Budget of the emitter: past it, the oldest popcorn is emitted again
+
+    popcorn_parameters_structure popcorn;
+    sph_parameters_structure sph;
+};
+
+// Advance the state by one fixed step (emission, popcorns, then fluids)
+void physics_step(physics_state& state, physics_settings const& settings);
+
+
+// What the renderer needs from one step
+struct physics_snapshot
+{
+    std::chrono::steady_clock::time_point time; // Wall-clock time at which the step was due
+    double step_duration = 0;                   // Time spent computing the step (s)
+
+    std::vector<vcl::vec3> popcorns;            // Indexed by particle id: the same index is the same popcorn in the next snapshots
+    std::vector<float> popcorn_radius;
+    std::vector<unsigned int> popcorn_spawn;    // Emission of each id: a popcorn emitted again is not interpolated
+    std::vector<vcl::affine_rts> cup_body, cup_seat;
+    std::vector<std::vector<vcl::vec3> > sph;   // Fluid of each domain, indexed by particle id
+    std::vector<bool> animate;                  // Active domains
+
+    size_t popcorn_substeps = 0;
+    std::vector<size_t> sph_substeps;
+    triangle_bvh_stats mesh_stats;
+};
+
+class recording_writer;
+
+// Copy the displayed part of the state
+void physics_snapshot_capture(physics_snapshot& snapshot, physics_state const& state);
+
+// Runs physics_step at a fixed rate on its own thread
+//  The renderer receives snapshots without locking and displays the state interpolated between the last two,
+//  one step behind the simulation: a slow step delays the next snapshots but never the display.
+class physics_thread
+{
+public:
+    ~physics_thread() { stop(); }
+
+    void start(physics_state const& initial_state, physics_settings const& settings);
+    void stop();
+
+    // Settings are copied and read by the next step
+    void set_settings(physics_settings const& settings);
+
+    // Record every step (set before start(), nullptr to stop recording)
+    void set_recorder(recording_writer* recorder_arg) { recorder = recorder_arg; }
+
+    // Renderer side: receive the latest snapshot and return the interpolation weight of current() for the present time
+    //  The display is one step behind: alpha=0 shows previous(), alpha=1 shows current().
+    float update();
+    physics_snapshot const& previous() const { return snapshots.previous(); }
+    physics_snapshot const& current() const { return snapshots.current(); }
+
+    // Statistics of the last second (written by the simulation thread)
+    std::atomic<int> steps_per_second{0};
+    std::atomic<int> skipped_steps{0};     // Steps dropped because the simulation could not keep up
+
+private:
+    void run();
+
+    physics_state state;               // Only accessed by the simulation thread once started
+    snapshot_exchange<physics_snapshot> snapshots;
+    recording_writer* recorder = nullptr;
+
+    std::mutex settings_mutex;         // Only held to copy the settings
+    physics_settings shared_settings;
+
+    std::thread thread;
+    std::atomic<bool> running{false};
+};
@@ -0,0 +1,145 @@
+#include "profiler.hpp"
+
+#include <cstdio>
+#include <iostream>
+
+profiler& profiler::global()
+{
+    static profiler instance;
+    return instance;
+}
+
+profiler::profiler()
+    :epoch(clock::now())
+{}
+
+profiler::thread_buffer& profiler::local_buffer()
+{
+    // Buffers are never freed: a thread that ended keeps its buffer until the program ends
+    static thread_local thread_buffer* buffer = nullptr;
+    if(buffer == nullptr) {
+        std::lock_guard<std::mutex> lock(threads_mutex);
+        threads.emplace_back(new thread_buffer());
+        buffer = threads.back().get();
+        buffer->id = (unsigned int)(threads.size()-1);
+        buffer->name = "thread " + std::to_string(buffer->id);
+    }
+    return *buffer;
+}
+
+void profiler::record(char const* name, clock::time_point start, clock::time_point end)
+{
+    thread_buffer& buffer = local_buffer();
+    event const e = {name, std::chrono::duration_cast<std::chrono::nanoseconds>(start-epoch).count(),
+                     std::chrono::duration_cast<std::chrono::nanoseconds>(end-start).count()};
+    std::lock_guard<std::mutex> lock(buffer.mutex); // Only contended while new_frame collects this thread
+    if(buffer.events.size() < max_pending_events)
+        buffer.events.push_back(e);
+}
+
+void profiler::set_thread_name(std::string const& name)
+{
+    thread_buffer& buffer = local_buffer();
+    std::lock_guard<std::mutex> lock(buffer.mutex);
+    buffer.name = name;
+}
+
+size_t profiler::scope_index(char const* name)
+{
+    auto const it = scope_of_name.find(name);
+    if(it != scope_of_name.end())
+        return it->second;
+
+    size_t k = 0;
+    while(k<scopes.size() && scopes[k].name != name)
+        k++;
+    if(k == scopes.size()) {
+        scopes.push_back(scope_stats());
+        scopes.back().name = name;
+        scopes.back().history_ms.assign(history_size, 0.0f);
+    }
+    scope_of_name[name] = k;
+    return k;
+}
+
+void profiler::new_frame()
+{
+    frame++;
+    size_t const slot = frame % history_size;
+    for(scope_stats& scope : scopes) {
+        scope.history_ms[slot] = 0;
+        scope.calls = 0;
+    }
+
+    std::vector<thread_buffer*> buffers;
+    {
+        std::lock_guard<std::mutex> lock(threads_mutex);
+        for(auto const& buffer : threads)
+            buffers.push_back(buffer.get());
+    }
+    for(thread_buffer* buffer : buffers) {
+        {
+            std::lock_guard<std::mutex> lock(buffer->mutex);
+            collected.swap(buffer->events);
+        }
+        for(event const& e : collected) {
+            size_t const k = scope_index(e.name);
+            scopes[k].history_ms[slot] += e.duration_ns*1e-6f;
+            scopes[k].calls++;
+            if(trace_frames > 0)
+                trace.push_back({k, buffer->id, e.start_ns, e.duration_ns});
+        }
+        collected.clear();
+    }
+
+    for(scope_stats& scope : scopes) {
+        float sum = 0;
+        for(float ms : scope.history_ms)
+            sum += ms;
+        scope.average_ms = sum/history_size;
+    }
+
+    if(trace_frames > 0 && --trace_frames == 0)
+        write_trace();
+}
+
+void profiler::start_trace(std::string const& filename, size_t N_frame)
+{
+    trace_filename = filename;
+    trace_frames = N_frame;
+    trace.clear();
+}
+
+// Chrome trace_event format: one complete event ("X") per measure, times in microseconds
+void profiler::write_trace()
+{
+    FILE* file = std::fopen(trace_filename.c_str(), "w");
+    if(file == nullptr) {
+        std::cerr << "Cannot write the trace " << trace_filename << std::endl;
+        trace.clear();
+        return;
+    }
+
+    std::fprintf(file, "{\"traceEvents\":[\n");
+    char const* separator = "";
+    {
+        std::lock_guard<std::mutex> lock(threads_mutex);
+        for(auto const& buffer : threads) {
+            std::lock_guard<std::mutex> buffer_lock(buffer->mutex);
+            std::fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%s\"}}",
+                         separator, buffer->id, buffer->name.c_str());
+            separator = ",\n";
+        }
+    }
+    for(trace_event const& e : trace) {
+        std::fprintf(file, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}", separator,
+                     scopes[e.scope].name.c_str(), e.thread, e.start_ns*1e-3, e.duration_ns*1e-3);
+        separator = ",\n";
+    }
+    std::fprintf(file, "\n]}\n");
+    std::fclose(file);
+
+    std::cout << "Trace of " << trace.size() << " events written to " << trace_filename << std::endl;
+    trace_written = trace_filename;
+    trace.clear();
+}
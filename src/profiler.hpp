@@ -0,0 +1,112 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Scoped profiling timers
+//  PROFILE_SCOPE("name") measures the rest of the enclosing scope on the calling thread (name: string literal).
+//  The timers are compiled out unless MAGICAL_POPCORN_PROFILER is defined (CMake option PROFILER, on by default).
+//
+//  Each thread appends its measures to its own buffer. The main loop calls profiler::global().new_frame() once per frame
+//  to collect them: the total time spent in each scope during the frame is kept for the last history_size frames.
+//  During a trace capture, every measure is also kept and written as a Chrome trace_event JSON file
+//  (open it in chrome://tracing or ui.perfetto.dev).
+#ifdef MAGICAL_POPCORN_PROFILER
+#define PROFILE_CONCATENATE_(a, b) a##b
+#define PROFILE_CONCATENATE(a, b) PROFILE_CONCATENATE_(a, b)
+#define PROFILE_SCOPE(name) profiler_scope PROFILE_CONCATENATE(profiler_scope_, __LINE__)(name)
+#else
+#define PROFILE_SCOPE(name) ((void)0)
+#endif
+
+class profiler
+{
+public:
+    typedef std::chrono::steady_clock clock;
+
+    static profiler& global();
+
+    // Any thread
+    void record(char const* name, clock::time_point start, clock::time_point end);
+    void set_thread_name(std::string const& name); // Name of the calling thread in the traces
+
+    // Main thread: collect the measures of the frame
+    void new_frame();
+
+    // Total time of a scope during each of the last frames (ring buffer: the oldest frame is at history_offset())
+    struct scope_stats
+    {
+        std::string name;
+        std::vector<float> history_ms;
+        float average_ms = 0; // Over the history
+        size_t calls = 0;     // During the last frame
+    };
+    static size_t const history_size = 120;
+    std::vector<scope_stats> const& stats() const { return scopes; }
+    size_t history_offset() const { return (frame+1) % history_size; }
+
+    // Keep every measure of the next N_frame frames, then write them to filename
+    void start_trace(std::string const& filename, size_t N_frame);
+    bool tracing() const { return trace_frames > 0; }
+    std::string const& last_trace() const { return trace_written; } // File of the last written trace
+
+    // Measures not collected by new_frame are dropped beyond this count per thread
+    static size_t const max_pending_events = size_t(1) << 20;
+
+private:
+    struct event
+    {
+        char const* name;
+        int64_t start_ns; // Since the creation of the profiler
+        int64_t duration_ns;
+    };
+    struct thread_buffer
+    {
+        std::mutex mutex;
+        std::vector<event> events;
+        unsigned int id = 0;
+        std::string name;
+    };
+    struct trace_event
+    {
+        size_t scope;
+        unsigned int thread;
+        int64_t start_ns;
+        int64_t duration_ns;
+    };
+
+    profiler();
+    thread_buffer& local_buffer();
+    size_t scope_index(char const* name);
+    void write_trace();
+
+    clock::time_point epoch;
+    std::mutex threads_mutex; // Protects threads
+    std::vector<std::unique_ptr<thread_buffer> > threads;
+
+    // Main thread
+    std::vector<scope_stats> scopes;
+    std::map<char const*, size_t> scope_of_name; // The same literal may have several addresses: also matched by content
+    std::vector<event> collected;
+    size_t frame = 0;
+    size_t trace_frames = 0;
+    std::string trace_filename, trace_written;
+    std::vector<trace_event> trace;
+};
+
+// Measures its lifetime
+class profiler_scope
+{
+public:
+    explicit profiler_scope(char const* name_arg) : name(name_arg), start(profiler::clock::now()) {}
+    ~profiler_scope() { profiler::global().record(name, start, profiler::clock::now()); }
+
+private:
+    char const* name;
+    profiler::clock::time_point start;
+};
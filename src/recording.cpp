@@ -0,0 +1,465 @@
+#include "recording.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+using namespace vcl;
+
+namespace
+{
+    uint32_t const recording_version = 1;
+    char const recording_magic[4] = {'M','P','R','C'};
+
+    struct recording_header
+    {
+        char magic[4];
+        uint32_t version;
+        uint32_t quantize;
+        uint32_t delta;
+        uint32_t key_interval;
+        float position_min[3];
+        float position_max[3];
+        float velocity_max;
+        uint64_t frame_count;      // 0 until the recording is closed
+        uint64_t index_offset;     // frame_count entries of {uint64 offset, float time, uint32 size}
+        uint64_t billboard_count;
+        uint64_t billboard_offset; // billboard_count entries of {float time, float p0[3]}, sorted by time
+    };
+    size_t const index_entry_size = 16;
+    size_t const billboard_entry_size = 16;
+
+    uint8_t const frame_key = 0x80; // Flag of the key frames, bits 0 and 1 are the cup trigger states
+
+    // The 4 streams of vec3 of a frame: popcorn positions, popcorn velocities, fluid of each cup
+    std::vector<vec3>& frame_stream(recorded_frame& frame, int stream)
+    {
+        return stream==0 ? frame.popcorn_position : stream==1 ? frame.popcorn_velocity : frame.sph[stream-2];
+    }
+
+    // Stored form of a coordinate: 16-bit quantized value, or the bits of the float
+    void stream_bounds(recording_options const& options, int stream, int i, float& lo, float& hi)
+    {
+        if(stream == 1) {
+            lo = -options.velocity_max;
+            hi = options.velocity_max;
+        }
+        else {
+            lo = options.position_min[i];
+            hi = options.position_max[i];
+        }
+    }
+
+    void stored_from_values(std::vector<vec3> const& v, recording_options const& options, int stream, std::vector<uint32_t>& stored)
+    {
+        stored.resize(3*v.size());
+        if(!options.quantize) {
+            for(size_t k=0; k<v.size(); ++k)
+                for(int i=0; i<3; ++i)
+                    std::memcpy(&stored[3*k+i], &v[k][i], sizeof(float));
+            return;
+        }
+        for(int i=0; i<3; ++i) {
+            float lo, hi;
+            stream_bounds(options, stream, i, lo, hi);
+            float const scale = 65535.0f/(hi-lo);
+            for(size_t k=0; k<v.size(); ++k) {
+                float const x = std::min(std::max(v[k][i], lo), hi);
+                stored[3*k+i] = uint32_t(std::lround((x-lo)*scale));
+            }
+        }
+    }
+
+    void values_from_stored(std::vector<uint32_t> const& stored, recording_options const& options, int stream, std::vector<vec3>& v)
+    {
+        v.resize(stored.size()/3);
+        if(!options.quantize) {
+            for(size_t k=0; k<v.size(); ++k)
+                for(int i=0; i<3; ++i)
+                    std::memcpy(&v[k][i], &stored[3*k+i], sizeof(float));
+            return;
+        }
+        for(int i=0; i<3; ++i) {
+            float lo, hi;
+            stream_bounds(options, stream, i, lo, hi);
+            float const scale = (hi-lo)/65535.0f;
+            for(size_t k=0; k<v.size(); ++k)
+                v[k][i] = lo + stored[3*k+i]*scale;
+        }
+    }
+
+    void put_bytes(std::vector<unsigned char>& out, void const* data, size_t size)
+    {
+        unsigned char const* p = static_cast<unsigned char const*>(data);
+        out.insert(out.end(), p, p+size);
+    }
+    void put_varint(std::vector<unsigned char>& out, uint32_t v)
+    {
+        while(v >= 0x80) {
+            out.push_back((unsigned char)(v | 0x80));
+            v >>= 7;
+        }
+        out.push_back((unsigned char)v);
+    }
+    uint32_t zigzag(int32_t v) { return (uint32_t(v) << 1) ^ uint32_t(v >> 31); }
+    int32_t unzigzag(uint32_t v) { return int32_t(v >> 1) ^ -int32_t(v & 1); }
+
+    // Bounded reading of an encoded frame (a corrupted frame reads zeros instead of overflowing)
+    struct byte_reader
+    {
+        unsigned char const* p;
+        unsigned char const* end;
+
+        void get(void* data, size_t size)
+        {
+            if(size_t(end-p) < size) {
+                std::memset(data, 0, size);
+                p = end;
+                return;
+            }
+            std::memcpy(data, p, size);
+            p += size;
+        }
+        uint32_t varint()
+        {
+            uint32_t v = 0;
+            for(int shift=0; p<end && shift<35; shift+=7) {
+                unsigned char const b = *p++;
+                v |= uint32_t(b & 0x7f) << shift;
+                if((b & 0x80) == 0)
+                    break;
+            }
+            return v;
+        }
+    };
+}
+
+
+bool recording_writer::open(std::string const& filename, recording_options const& options_arg)
+{
+    close();
+    file = std::fopen(filename.c_str(), "wb");
+    if(file == nullptr)
+        return false;
+
+    options = options_arg;
+    options.key_interval = std::max(options.key_interval, 1u);
+    start = std::chrono::steady_clock::now();
+    written_frames = dropped_frames = 0;
+    written_bytes = sizeof(recording_header);
+    pending.clear();
+    billboards.clear();
+    index.clear();
+    stopping = false;
+
+    // Placeholder header, completed by close()
+    recording_header header;
+    std::memset(&header, 0, sizeof(header));
+    std::fwrite(&header, sizeof(header), 1, file);
+
+    writer = std::thread(&recording_writer::run, this);
+    return true;
+}
+
+void recording_writer::record(physics_state const& state, std::chrono::steady_clock::time_point time)
+{
+    recorded_frame frame;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if(file==nullptr || stopping)
+            return;
+        if(pending.size() >= max_pending) {
+            dropped_frames++;
+            return;
+        }
+        if(!recycled.empty()) {
+            frame = std::move(recycled.back());
+            recycled.pop_back();
+        }
+    }
+
+    frame.time = std::chrono::duration<float>(time-start).count();
+    size_t const N = state.popcorns.size();
+    frame.popcorn_position.resize(N);
+    frame.popcorn_velocity.resize(N);
+    frame.popcorn_radius.resize(N);
+    for(particle_structure const& particle : state.popcorns) {
+        frame.popcorn_position[particle.id] = particle.p;
+        frame.popcorn_velocity[particle.id] = particle.v;
+        frame.popcorn_radius[particle.id] = particle.r;
+    }
+    // The recordings hold the fluids of the two cups of the scene
+    for(size_t c=0; c<2 && c<state.fluids.domains.size(); ++c) {
+        sph_domain const& domain = state.fluids.domains[c];
+        frame.sph[c].resize(domain.count);
+        for(size_t k=0; k<domain.count; ++k) {
+            sph_particle_element const& particle = state.fluids.particles[domain.offset+k];
+            frame.sph[c][particle.id] = particle.p;
+        }
+        frame.cup_tipped[c] = domain.active;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        pending.push_back(std::move(frame));
+    }
+    wake.notify_one();
+}
+
+void recording_writer::record_billboard(vec3 const& p0, std::chrono::steady_clock::time_point time)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if(file==nullptr || stopping)
+        return;
+    billboards.push_back({std::chrono::duration<float>(time-start).count(), p0});
+}
+
+void recording_writer::run()
+{
+    std::vector<uint32_t> previous[4], current[4];
+    size_t N_popcorn_previous = 0;
+    uint64_t offset = sizeof(recording_header);
+    std::vector<unsigned char> bytes;
+
+    while(true)
+    {
+        recorded_frame frame;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait(lock, [this]() { return !pending.empty() || stopping; });
+            if(pending.empty())
+                break;
+            frame = std::move(pending.front());
+            pending.pop_front();
+        }
+
+        bool const key = !options.delta || index.size()%options.key_interval == 0;
+        size_t const N_popcorn = frame.popcorn_position.size();
+
+        bytes.clear();
+        uint8_t const flags = (key ? frame_key : 0) | (frame.cup_tipped[0] ? 1 : 0) | (frame.cup_tipped[1] ? 2 : 0);
+        put_bytes(bytes, &flags, 1);
+        put_bytes(bytes, &frame.time, sizeof(float));
+        put_varint(bytes, uint32_t(N_popcorn));
+        put_varint(bytes, uint32_t(frame.sph[0].size()));
+        put_varint(bytes, uint32_t(frame.sph[1].size()));
+
+        // Popcorns are only appended: the radius is stored for the new ones
+        size_t const N_radius_known = key ? 0 : std::min(N_popcorn_previous, N_popcorn);
+        for(size_t k=N_radius_known; k<N_popcorn; ++k)
+            put_bytes(bytes, &frame.popcorn_radius[k], sizeof(float));
+
+        for(int s=0; s<4; ++s) {
+            stored_from_values(frame_stream(frame, s), options, s, current[s]);
+            std::vector<uint32_t> const& values = current[s];
+            std::vector<uint32_t> const& reference = previous[s];
+            if(key) {
+                for(uint32_t v : values)
+                    put_bytes(bytes, &v, options.quantize ? 2 : 4);
+            }
+            else {
+                for(size_t i=0; i<values.size(); ++i) {
+                    uint32_t const r = i<reference.size() ? reference[i] : 0;
+                    put_varint(bytes, options.quantize ? zigzag(int32_t(values[i]-r)) : (values[i]^r));
+                }
+            }
+            previous[s].swap(current[s]);
+        }
+        N_popcorn_previous = N_popcorn;
+
+        std::fwrite(bytes.data(), 1, bytes.size(), file);
+        index.push_back({offset, frame.time, uint32_t(bytes.size())});
+        offset += bytes.size();
+        written_bytes += bytes.size();
+        written_frames++;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        recycled.push_back(std::move(frame));
+    }
+}
+
+void recording_writer::close()
+{
+    if(file == nullptr)
+        return;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_one();
+    writer.join(); // Writes the pending frames
+
+    recording_header header;
+    std::memcpy(header.magic, recording_magic, 4);
+    header.version = recording_version;
+    header.quantize = options.quantize;
+    header.delta = options.delta;
+    header.key_interval = options.key_interval;
+    for(int i=0; i<3; ++i) {
+        header.position_min[i] = options.position_min[i];
+        header.position_max[i] = options.position_max[i];
+    }
+    header.velocity_max = options.velocity_max;
+    header.frame_count = index.size();
+    header.index_offset = written_bytes;
+
+    std::vector<unsigned char> bytes;
+    for(index_entry const& e : index) {
+        put_bytes(bytes, &e.offset, 8);
+        put_bytes(bytes, &e.time, 4);
+        put_bytes(bytes, &e.size, 4);
+    }
+    std::stable_sort(billboards.begin(), billboards.end(), [](recorded_billboard const& a, recorded_billboard const& b) { return a.time < b.time; });
+    header.billboard_count = billboards.size();
+    header.billboard_offset = header.index_offset + bytes.size();
+    for(recorded_billboard const& b : billboards) {
+        put_bytes(bytes, &b.time, 4);
+        put_bytes(bytes, &b.p0, 12);
+    }
+    std::fwrite(bytes.data(), 1, bytes.size(), file);
+    written_bytes += bytes.size();
+
+    std::fseek(file, 0, SEEK_SET);
+    std::fwrite(&header, sizeof(header), 1, file);
+    std::fclose(file);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    file = nullptr;
+    pending.clear();
+    recycled.clear();
+}
+
+
+bool recording_reader::open(std::string const& filename)
+{
+    file.reset(new mapped_file(filename));
+    recording_header header;
+    bool valid = file->size() >= sizeof(header);
+    if(valid) {
+        std::memcpy(&header, file->data(), sizeof(header));
+        valid = std::memcmp(header.magic, recording_magic, 4)==0 && header.version==recording_version && header.key_interval>0
+                && header.index_offset + header.frame_count*index_entry_size <= file->size()
+                && header.billboard_offset + header.billboard_count*billboard_entry_size <= file->size();
+    }
+    if(!valid) {
+        file.reset();
+        return false;
+    }
+
+    options.quantize = header.quantize != 0;
+    options.delta = header.delta != 0;
+    options.key_interval = header.key_interval;
+    for(int i=0; i<3; ++i) {
+        options.position_min[i] = header.position_min[i];
+        options.position_max[i] = header.position_max[i];
+    }
+    options.velocity_max = header.velocity_max;
+
+    N_frame = size_t(header.frame_count);
+    index = file->data() + header.index_offset;
+    N_billboard = size_t(header.billboard_count);
+    billboard_data = file->data() + header.billboard_offset;
+    decoded = size_t(-1);
+    return true;
+}
+
+float recording_reader::frame_time(size_t k) const
+{
+    float t;
+    std::memcpy(&t, index + k*index_entry_size + 8, 4);
+    return t;
+}
+
+size_t recording_reader::frame_at(float time) const
+{
+    // Binary search of the last frame with frame_time <= time
+    size_t lo = 0, hi = N_frame;
+    while(hi-lo > 1) {
+        size_t const mid = (lo+hi)/2;
+        if(frame_time(mid) <= time)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+void recording_reader::read(size_t k, recorded_frame& frame)
+{
+    assert_vcl(k < N_frame, "Frame out of the recording");
+
+    // Decode from the key frame, unless the frames before k are already decoded
+    size_t first = options.delta ? k - k%options.key_interval : k;
+    if(decoded != size_t(-1) && decoded <= k && decoded >= first)
+        first = decoded+1;
+
+    for(size_t j=first; j<=k; ++j)
+    {
+        uint64_t offset;
+        uint32_t size;
+        std::memcpy(&offset, index + j*index_entry_size, 8);
+        std::memcpy(&size, index + j*index_entry_size + 12, 4);
+        byte_reader in = {file->data()+offset, file->data()+std::min<uint64_t>(offset+size, file->size())};
+
+        uint8_t flags;
+        in.get(&flags, 1);
+        bool const key = (flags & frame_key) != 0;
+        in.get(&last.time, sizeof(float));
+        last.cup_tipped[0] = (flags & 1) != 0;
+        last.cup_tipped[1] = (flags & 2) != 0;
+        size_t const N_popcorn = in.varint();
+        size_t const N_sph[2] = {in.varint(), in.varint()};
+
+        size_t const N_radius_known = key ? 0 : std::min(last.popcorn_radius.size(), N_popcorn);
+        last.popcorn_radius.resize(N_popcorn);
+        for(size_t i=N_radius_known; i<N_popcorn; ++i)
+            in.get(&last.popcorn_radius[i], sizeof(float));
+
+        for(int s=0; s<4; ++s) {
+            size_t const N = 3*(s<2 ? N_popcorn : N_sph[s-2]);
+            std::vector<uint32_t>& v = values[s];
+            if(key) {
+                v.assign(N, 0);
+                for(size_t i=0; i<N; ++i)
+                    in.get(&v[i], options.quantize ? 2 : 4); // Little endian: the low bytes of the value
+            }
+            else {
+                size_t const N_previous = v.size();
+                v.resize(N, 0);
+                for(size_t i=0; i<N; ++i) {
+                    uint32_t const r = i<N_previous ? v[i] : 0;
+                    uint32_t const d = in.varint();
+                    v[i] = options.quantize ? uint32_t(r + uint32_t(unzigzag(d))) : (r^d);
+                }
+            }
+            values_from_stored(v, options, s, frame_stream(last, s));
+        }
+        decoded = j;
+    }
+
+    frame = last;
+}
+
+void recording_reader::billboards(float t_min, float t_max, std::vector<recorded_billboard>& result) const
+{
+    result.clear();
+    // Billboards are sorted by time: binary search of the first one at or after t_min
+    size_t lo = 0, hi = N_billboard;
+    while(lo < hi) {
+        size_t const mid = (lo+hi)/2;
+        float t;
+        std::memcpy(&t, billboard_data + mid*billboard_entry_size, 4);
+        if(t < t_min)
+            lo = mid+1;
+        else
+            hi = mid;
+    }
+    for(size_t k=lo; k<N_billboard; ++k) {
+        recorded_billboard b;
+        std::memcpy(&b.time, billboard_data + k*billboard_entry_size, 4);
+        if(b.time > t_max)
+            break;
+        std::memcpy(&b.p0, billboard_data + k*billboard_entry_size + 4, 12);
+        result.push_back(b);
+    }
+}
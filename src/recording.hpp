@@ -0,0 +1,123 @@
+#pragma once
+
+#include "physics_thread.hpp"
+#include "asset_cache.hpp" // mapped_file
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// State of the scene after one recorded step
+struct recorded_frame
+{
+    float time = 0;                      // Seconds since the start of the recording
+    std::vector<vcl::vec3> popcorn_position;
+    std::vector<vcl::vec3> popcorn_velocity;
+    std::vector<float> popcorn_radius;
+    std::vector<vcl::vec3> sph[2];       // Fluid of each cup (in the frame of the cup)
+    bool cup_tipped[2] = {false, false}; // Trigger state of the cups: a tipped cup simulates its fluid
+};
+
+// Smoke billboard spawned by the renderer
+struct recorded_billboard
+{
+    float time;                          // Seconds since the start of the recording
+    vcl::vec3 p0;
+};
+
+struct recording_options
+{
+    // Store the coordinates on 16 bits in [position_min, position_max] and the velocities in [-velocity_max, velocity_max]
+    bool quantize = true;
+    vcl::vec3 position_min = {-4,-4,-4};
+    vcl::vec3 position_max = { 4, 4, 4};
+    float velocity_max = 32.0f;
+
+    // Store the difference with the previous frame as variable-length integers (the difference of the quantized values,
+    // or the xor of the bits of the floats), except for a key frame every key_interval frames
+    bool delta = true;
+    unsigned int key_interval = 60;
+};
+
+// Records the steps of the simulation to a file
+//  record() is called by the simulation thread after a step: it copies the state into a recycled frame and returns.
+//  The frames are encoded and written by a background thread. When the writer is more than max_pending frames behind,
+//  the new frames are dropped (and counted) instead of slowing down the simulation.
+//
+// File: header, encoded frames, then the frame index (offset and time of every frame) and the billboard spawns.
+//  close() writes the index and rewrites the header: an unclosed recording cannot be replayed.
+class recording_writer
+{
+public:
+    ~recording_writer() { close(); }
+
+    bool open(std::string const& filename, recording_options const& options = recording_options());
+    void close();
+    bool is_open() const { return file != nullptr; }
+
+    // Times are converted to seconds since open()
+    void record(physics_state const& state, std::chrono::steady_clock::time_point time); // Simulation thread
+    void record_billboard(vcl::vec3 const& p0, std::chrono::steady_clock::time_point time); // Any thread
+
+    size_t max_pending = 256;
+    std::atomic<size_t> written_frames{0};
+    std::atomic<size_t> dropped_frames{0};
+    std::atomic<size_t> written_bytes{0};
+
+private:
+    void run();
+
+    FILE* file = nullptr;
+    recording_options options;
+    std::chrono::steady_clock::time_point start;
+
+    std::thread writer;
+    std::mutex mutex;                       // Protects the members below
+    std::condition_variable wake;
+    std::deque<recorded_frame> pending;     // Frames to write, oldest first
+    std::vector<recorded_frame> recycled;   // Written frames whose buffers are reused
+    std::vector<recorded_billboard> billboards;
+    bool stopping = false;
+
+    // Writer thread
+    struct index_entry { uint64_t offset; float time; uint32_t size; };
+    std::vector<index_entry> index;
+};
+
+// Replay of a recording mapped in memory
+//  Any frame can be read: it is decoded from the last key frame before it, or from the frame read just before.
+class recording_reader
+{
+public:
+    bool open(std::string const& filename);
+    bool is_open() const { return file != nullptr; }
+
+    size_t frame_count() const { return N_frame; }
+    float frame_time(size_t k) const;
+    float duration() const { return N_frame>0 ? frame_time(N_frame-1) : 0.0f; }
+    size_t frame_at(float time) const; // Last frame at or before time (0 before the first one)
+
+    void read(size_t k, recorded_frame& frame);
+
+    // Billboards spawned in [t_min, t_max]
+    void billboards(float t_min, float t_max, std::vector<recorded_billboard>& result) const;
+
+private:
+    std::unique_ptr<mapped_file> file;
+    recording_options options;
+    size_t N_frame = 0;
+    unsigned char const* index = nullptr;
+    size_t N_billboard = 0;
+    unsigned char const* billboard_data = nullptr;
+
+    // Last decoded frame, in its stored form (quantized values or float bits)
+    size_t decoded = size_t(-1);
+    std::vector<uint32_t> values[4]; // Popcorn positions, velocities, fluid of each cup
+    recorded_frame last;
+};
@@ -1,26 +1,39 @@
 #include "simulation.hpp"
+#include "thread_pool.hpp"
+#include "morton_order.hpp"
+#include "profiler.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
 
 using namespace vcl;
 
 
-void collision_sphere_plane(vcl::vec3& p, vcl::vec3& v, float r, vcl::vec3 const& n, vcl::vec3 const& p0)
+// Velocity after hitting a surface of normal n
+void collision_sphere_bounce(vcl::vec3& v, vcl::vec3 const& n)
 {
-    float const epsilon = 1e-5f;
     float const alpha_n = 0.95f;  // attenuation normal
     float const alpha_t = 0.90f;  // attenuation tangential
 
+    vec3 const vn = dot(v,n) * n;
+    vec3 const vt = v - vn;
+    v = -alpha_n * vn + alpha_t * vt;
+}
+
+void collision_sphere_plane(vcl::vec3& p, vcl::vec3& v, float r, vcl::vec3 const& n, vcl::vec3 const& p0)
+{
+    float const epsilon = 1e-5f;
+
     float const s = dot(p-p0,n) - r;
     if( s<-epsilon )
     {
-        vec3 const vn = dot(v,n) * n;
-        vec3 const vt = v - vn;
-
         p = p - (s * n);
-        v = -alpha_n * vn + alpha_t * vt;
+        collision_sphere_bounce(v, n);
     }
 }
 
-void collision_sphere_sphere(vcl::vec3& p1, vcl::vec3& v1, float r1, vcl::vec3& p2, vcl::vec3& v2, float r2)
+bool collision_sphere_sphere(vcl::vec3& p1, vcl::vec3& v1, float r1, vcl::vec3& p2, vcl::vec3& v2, float r2)
 {
     float const epsilon = 1e-5f;
     float const alpha = 0.95f;
@@ -46,86 +59,506 @@ void collision_sphere_sphere(vcl::vec3& p1, vcl::vec3& v1, float r1, vcl::vec3&
             v1 = v1/1.2f;
             v2 = v2/1.2f;
         }
+        return true;
+    }
+    return false;
+}
+
+// Continuous version for spheres that started the substep at p1_start and p2_start
+//  Spheres that do not overlap at the end of the substep but met during it are moved back to their first contact
+//  (time of impact of the relative motion) and bounce.
+bool collision_sphere_sphere_swept(vcl::vec3 const& p1_start, vcl::vec3& p1, vcl::vec3& v1, float r1, vcl::vec3 const& p2_start, vcl::vec3& p2, vcl::vec3& v2, float r2)
+{
+    float const alpha = 0.95f;
+    if(collision_sphere_sphere(p1,v1,r1, p2,v2,r2))
+        return true;
+
+    // |d0 + t dd| = r1+r2 <=> a t^2 + 2 b t + c = 0
+    vec3 const d0 = p1_start-p2_start;
+    vec3 const dd = (p1-p1_start)-(p2-p2_start);
+    float const a = dot(dd,dd);
+    float const b = dot(d0,dd);
+    float const c = dot(d0,d0) - (r1+r2)*(r1+r2);
+    float const delta = b*b - a*c;
+    if(c <= 0 || b >= 0 || delta < 0) // Overlapping at the start (left to the discrete test), moving apart, or missing each other
+        return false;
+    float const t = (-b - std::sqrt(delta))/a;
+    if(t > 1) // Not in contact yet
+        return false;
+
+    p1 = p1_start + t*(p1-p1_start);
+    p2 = p2_start + t*(p2-p2_start);
+    vec3 const u12 = normalize(p1-p2);
+    float const j = dot(v1-v2,u12);
+    if(j < 0) {
+        v1 = v1 - alpha*j*u12;
+        v2 = v2 + alpha*j*u12;
+    }
+    return true;
+}
+
+// Collision between the popcorns k1 and k2, taking their sleeping state into account
+//  Returns true when they touched. A sleeping island hit by a fast particle is returned in island_to_wake (0 otherwise).
+static bool resolve_popcorn_pair(std::vector<particle_structure>& particles, size_t k1, size_t k2, popcorn_parameters_structure const& parameters, unsigned int& island_to_wake)
+{
+    particle_structure& p1 = particles[k1];
+    particle_structure& p2 = particles[k2];
+    auto const collide_pair = [&]() {
+        if(parameters.use_ccd)
+            return collision_sphere_sphere_swept(p1.p_substep,p1.p,p1.v,p1.r, p2.p_substep,p2.p,p2.v,p2.r);
+        return collision_sphere_sphere(p1.p,p1.v,p1.r, p2.p,p2.v,p2.r);
+    };
+    island_to_wake = 0;
+    if(!parameters.use_sleeping)
+        return collide_pair();
+    if(p1.sleeping && p2.sleeping)
+        return false;
+
+    if(p1.sleeping || p2.sleeping)
+    {
+        particle_structure& awake = p1.sleeping ? p2 : p1;
+        particle_structure& asleep = p1.sleeping ? p1 : p2;
+        vec3 const d = awake.p-asleep.p;
+        float const d_norm = norm(d);
+        if(d_norm >= awake.r+asleep.r || d_norm == 0)
+            return false;
+
+        if(norm(awake.v) > parameters.sleep_velocity) {
+            // Fast impact: the sleeping particle wakes up now, the rest of its island at the end of the pass
+            island_to_wake = asleep.island;
+            asleep.sleeping = false;
+            asleep.rest_time = 0;
+            return collide_pair();
+        }
+        // Slow contact: the sleeping particle acts as a static obstacle
+        vec3 const n = d/d_norm;
+        collision_sphere_plane(awake.p, awake.v, awake.r, n, asleep.p + asleep.r*n);
+        return true;
+    }
+    return collide_pair();
+}
+
+void collision_popcorn_pair(std::vector<particle_structure>& particles, size_t k1, size_t k2, popcorn_parameters_structure const& parameters, popcorn_contacts& contacts)
+{
+    unsigned int island_to_wake = 0;
+    bool const contact = resolve_popcorn_pair(particles, k1, k2, parameters, island_to_wake);
+    if(island_to_wake != 0)
+        contacts.islands_to_wake.push_back(island_to_wake);
+    if(contact && parameters.use_sleeping)
+        contacts.pairs.push_back({(unsigned int)k1, (unsigned int)k2});
+}
+
+// Sphere-sphere collisions tested on all pairs
+void collision_sphere_sphere_brute_force(std::vector<particle_structure>& particles, popcorn_parameters_structure const& parameters, popcorn_contacts& contacts)
+{
+	size_t const N = particles.size();
+	for(size_t k1=0; k1<N; ++k1)
+	{
+		for(size_t k2=k1+1; k2<N; ++k2)
+			collision_popcorn_pair(particles, k1, k2, parameters, contacts);
+	}
+}
+
+void popcorn_broad_phase::build(std::vector<particle_structure> const& particles, popcorn_parameters_structure const& parameters)
+{
+    size_t const N = particles.size();
+    r_max = 0.0f;
+    displacement.assign(N, 0.0f);
+    for(size_t k=0; k<N; ++k) {
+        particle_structure const& particle = particles[k];
+        r_max = std::max(r_max, particle.r);
+        if(parameters.use_ccd && norm(particle.p-particle.p_substep) > particle.r)
+            displacement[k] = norm(particle.p-particle.p_substep);
+    }
+    grid.build(particles, 2*r_max);
+}
+
+void popcorn_broad_phase::candidates(std::vector<particle_structure> const& particles, size_t k1, popcorn_parameters_structure const& parameters,
+                                     std::vector<unsigned int>& result, std::vector<unsigned int>& buckets) const
+{
+    // Pairs of awake particles are visited from their fastest particle, then from their lowest index, sleeping neighbors always
+    auto const visits = [&](unsigned int k2) {
+        if(k2==k1 || (parameters.use_sleeping && particles[k2].sleeping))
+            return k2!=k1;
+        if(displacement[k2] != displacement[k1])
+            return displacement[k2] < displacement[k1];
+        return k2>k1;
+    };
+
+    result.clear();
+    if(displacement[k1] > 0) {
+        float const reach = 2*r_max + 2*displacement[k1];
+        vec3 const p = particles[k1].p;
+        grid.box_buckets(p - vec3{reach,reach,reach}, p + vec3{reach,reach,reach}, buckets);
+    }
+    else {
+        unsigned int neighbors[27];
+        int const N_bucket = grid.neighbor_buckets(grid.particle_cell[k1], neighbors);
+        buckets.assign(neighbors, neighbors+N_bucket);
+    }
+    for(unsigned int b : buckets) {
+        for(unsigned int idx=grid.bucket_start[b]; idx<grid.bucket_start[b+1]; ++idx) {
+            unsigned int const k2 = grid.sorted_index[idx];
+            if(visits(k2))
+                result.push_back(k2);
+        }
+    }
+    std::sort(result.begin(), result.end());
+}
+
+// Sphere-sphere collisions tested only between particles of neighboring grid cells (sequential)
+void collision_sphere_sphere_grid(std::vector<particle_structure>& particles, popcorn_broad_phase& broad_phase, popcorn_parameters_structure const& parameters, popcorn_contacts& contacts)
+{
+    size_t const N = particles.size();
+    if(N==0)
+        return;
+    broad_phase.build(particles, parameters);
+
+    std::vector<unsigned int> buckets;
+    std::vector<unsigned int> candidates;
+    for(size_t k1=0; k1<N; ++k1)
+    {
+        bool const sleeping_k1 = parameters.use_sleeping && particles[k1].sleeping;
+        if(sleeping_k1)
+            continue;
+
+        broad_phase.candidates(particles, k1, parameters, candidates, buckets);
+        for(unsigned int k2 : candidates)
+            collision_popcorn_pair(particles, std::min<size_t>(k1,k2), std::max<size_t>(k1,k2), parameters, contacts);
+    }
+}
+
+
+// Parallel sphere-sphere collisions
+//  Contact generation: the pairs that may touch during the substep are listed in parallel, then sorted.
+//  Contact solver: the contacts are colored so that no two contacts of a color share a particle (greedy coloring in the
+//  order of the list), then the colors are resolved one after the other, the contacts of a color in parallel (Gauss-Seidel).
+//  The list, the colors and the order of the colors do not depend on the number of threads: neither does the result.
+
+// Conservative test done before any contact is resolved: the particles still move during the resolution of the previous
+// colors, so pairs up to contact_margin times the sum of the radii apart are kept
+static bool popcorn_pair_may_touch(particle_structure const& p1, particle_structure const& p2, popcorn_parameters_structure const& parameters)
+{
+    float const contact_margin = 1.1f;
+    if(parameters.use_sleeping && p1.sleeping && p2.sleeping)
+        return false;
+
+    float const R = contact_margin*(p1.r+p2.r);
+    vec3 const d = p1.p-p2.p;
+    if(dot(d,d) < R*R)
+        return true;
+    if(!parameters.use_ccd)
+        return false;
+
+    // Closest approach of the relative motion during the substep
+    vec3 const d0 = p1.p_substep-p2.p_substep;
+    vec3 const dd = d - d0;
+    float const a = dot(dd,dd);
+    float const t = a>0 ? std::min(std::max(-dot(d0,dd)/a, 0.0f), 1.0f) : 0.0f;
+    vec3 const closest = d0 + t*dd;
+    return dot(closest,closest) < R*R;
+}
+
+void collision_sphere_sphere_parallel(std::vector<particle_structure>& particles, popcorn_broad_phase& broad_phase, popcorn_contact_solver& solver,
+                                      popcorn_parameters_structure const& parameters, popcorn_contacts& contacts)
+{
+    size_t const N = particles.size();
+    solver.pairs.clear();
+    if(N==0)
+        return;
+    if(parameters.use_grid_broad_phase)
+        broad_phase.build(particles, parameters);
+
+    // Contact generation
+    thread_pool& pool = thread_pool::global();
+    solver.thread_pairs.resize(pool.thread_count());
+    for(std::vector<uint64_t>& list : solver.thread_pairs)
+        list.clear();
+    pool.parallel_for(N, 256, [&](size_t begin, size_t end, size_t thread) {
+        std::vector<uint64_t>& list = solver.thread_pairs[thread];
+        std::vector<unsigned int> buckets, candidates;
+        for(size_t k1=begin; k1<end; ++k1) {
+            if(parameters.use_grid_broad_phase) {
+                if(parameters.use_sleeping && particles[k1].sleeping)
+                    continue;
+                broad_phase.candidates(particles, k1, parameters, candidates, buckets);
+            }
+            else {
+                candidates.clear();
+                for(size_t k2=k1+1; k2<N; ++k2)
+                    candidates.push_back((unsigned int)k2);
+            }
+            for(unsigned int k2 : candidates) {
+                if(popcorn_pair_may_touch(particles[k1], particles[k2], parameters))
+                    list.push_back((uint64_t(std::min<size_t>(k1,k2)) << 32) | std::max<size_t>(k1,k2));
+            }
+        }
+    });
+    for(std::vector<uint64_t> const& list : solver.thread_pairs)
+        solver.pairs.insert(solver.pairs.end(), list.begin(), list.end());
+    std::sort(solver.pairs.begin(), solver.pairs.end());
+
+    // Greedy coloring: the lowest color used by none of the contacts of both particles
+    //  Contacts of particles already having 64 colors go to an extra color resolved sequentially.
+    size_t const N_contact = solver.pairs.size();
+    unsigned int const overflow_color = 64;
+    solver.particle_colors.assign(N, 0);
+    solver.order.resize(N_contact);
+    solver.color_start.assign(overflow_color+2, 0);
+    std::vector<unsigned char> color(N_contact);
+    for(size_t k=0; k<N_contact; ++k) {
+        unsigned int const k1 = (unsigned int)(solver.pairs[k] >> 32);
+        unsigned int const k2 = (unsigned int)(solver.pairs[k] & 0xffffffffu);
+        uint64_t const used = solver.particle_colors[k1] | solver.particle_colors[k2];
+        unsigned int c = 0;
+        while(c<overflow_color && (used & (uint64_t(1)<<c)))
+            c++;
+        if(c < overflow_color) {
+            solver.particle_colors[k1] |= uint64_t(1)<<c;
+            solver.particle_colors[k2] |= uint64_t(1)<<c;
+        }
+        color[k] = (unsigned char)c;
+        solver.color_start[c+1]++;
+    }
+    for(unsigned int c=0; c<=overflow_color; ++c)
+        solver.color_start[c+1] += solver.color_start[c];
+    {
+        std::vector<unsigned int> offset(solver.color_start.begin(), solver.color_start.end()-1);
+        for(size_t k=0; k<N_contact; ++k)
+            solver.order[offset[color[k]]++] = (unsigned int)k;
+    }
+
+    // Resolution, color by color
+    solver.touched.assign(N_contact, 0);
+    solver.island_to_wake.assign(N_contact, 0);
+    for(unsigned int c=0; c<=overflow_color; ++c) {
+        size_t const first = solver.color_start[c];
+        size_t const count = solver.color_start[c+1]-first;
+        if(count == 0)
+            continue;
+        auto const resolve = [&](size_t begin, size_t end, size_t) {
+            for(size_t i=first+begin; i<first+end; ++i) {
+                size_t const k = solver.order[i];
+                size_t const k1 = size_t(solver.pairs[k] >> 32);
+                size_t const k2 = size_t(solver.pairs[k] & 0xffffffffu);
+                solver.touched[k] = resolve_popcorn_pair(particles, k1, k2, parameters, solver.island_to_wake[k]) ? 1 : 0;
+            }
+        };
+        if(c == overflow_color)
+            resolve(0, count, 0);
+        else
+            pool.parallel_for(count, 256, resolve);
+    }
+
+    // Effects on the sleeping islands, in the order of the list
+    for(size_t k=0; k<N_contact; ++k) {
+        if(solver.island_to_wake[k] != 0)
+            contacts.islands_to_wake.push_back(solver.island_to_wake[k]);
+        if(solver.touched[k] && parameters.use_sleeping)
+            contacts.pairs.push_back({(unsigned int)(solver.pairs[k] >> 32), (unsigned int)(solver.pairs[k] & 0xffffffffu)});
     }
 }
 
-void simulate(std::vector<particle_structure>& particles, std::vector<Cup>& cups, float dt_true, bool &animate, bool &animate2)
+// Union-find root of particle k
+static unsigned int island_root(std::vector<unsigned int>& parent, unsigned int k)
 {
+    while(parent[k]!=k) {
+        parent[k] = parent[parent[k]];
+        k = parent[k];
+    }
+    return k;
+}
+
+// Wake up the islands hit during the substep, then put to sleep the contact islands that stayed at rest long enough
+void update_sleeping(std::vector<particle_structure>& particles, popcorn_workspace& workspace, float dt, popcorn_parameters_structure const& parameters)
+{
+    popcorn_contacts const& contacts = workspace.contacts;
+    size_t const N = particles.size();
+
+    if(!contacts.islands_to_wake.empty()) {
+        std::vector<unsigned int> islands = contacts.islands_to_wake;
+        std::sort(islands.begin(), islands.end());
+        for(size_t k=0; k<N; ++k) {
+            particle_structure& particle = particles[k];
+            if(particle.sleeping && std::binary_search(islands.begin(), islands.end(), particle.island)) {
+                particle.sleeping = false;
+                particle.rest_time = 0;
+            }
+        }
+    }
+
+    for(size_t k=0; k<N; ++k) {
+        particle_structure& particle = particles[k];
+        if(!particle.sleeping)
+            particle.rest_time = norm(particle.v) < parameters.sleep_velocity ? particle.rest_time+dt : 0;
+    }
+
+    // Contact islands of the awake particles
+    //  Islands are capped to max_island_size particles, so that a large pile is split into local islands
+    //  instead of being entirely woken up by every impact.
+    std::vector<unsigned int>& parent = workspace.island_parent;
+    std::vector<unsigned int>& island_size = workspace.island_size;
+    parent.resize(N);
+    island_size.assign(N, 1);
+    for(size_t k=0; k<N; ++k)
+        parent[k] = (unsigned int)k;
+    for(auto const& pair : contacts.pairs) {
+        if(particles[pair.first].sleeping || particles[pair.second].sleeping)
+            continue;
+        unsigned int const root1 = island_root(parent, pair.first);
+        unsigned int const root2 = island_root(parent, pair.second);
+        if(root1!=root2 && island_size[root1]+island_size[root2] <= parameters.max_island_size) {
+            parent[root1] = root2;
+            island_size[root2] += island_size[root1];
+        }
+    }
+
+    // An island falls asleep when all its particles rested long enough
+    std::vector<char>& rested = workspace.island_rested;
+    std::vector<unsigned int>& island_id = workspace.island_id;
+    rested.assign(N, 1);
+    island_id.assign(N, 0);
+    for(size_t k=0; k<N; ++k) {
+        particle_structure const& particle = particles[k];
+        if(!particle.sleeping && particle.rest_time < parameters.sleep_time)
+            rested[island_root(parent, (unsigned int)k)] = 0;
+    }
+    for(size_t k=0; k<N; ++k) {
+        particle_structure& particle = particles[k];
+        unsigned int const root = island_root(parent, (unsigned int)k);
+        if(particle.sleeping || !rested[root])
+            continue;
+        if(island_id[root]==0)
+            island_id[root] = workspace.next_island++;
+
+        particle.sleeping = true;
+        particle.island = island_id[root];
+        particle.v = {0,0,0};
+    }
+}
+
+// Number of substeps such that no particle moves by more than substep_cfl times its radius during a substep
+//  (ccd_substep_cfl with continuous collisions)
+size_t popcorn_substep_count(std::vector<particle_structure> const& particles, float dt, vec3 const& g, popcorn_parameters_structure const& popcorn_parameters)
+{
+	bool const ccd = popcorn_parameters.use_ccd;
+	float const cfl = ccd ? popcorn_parameters.ccd_substep_cfl : popcorn_parameters.substep_cfl;
+	size_t const min_substeps = ccd ? popcorn_parameters.ccd_min_substeps : popcorn_parameters.min_substeps;
+
+	float v_max = 0.0f;
+	float r_min = std::numeric_limits<float>::max();
+	for(particle_structure const& particle : particles) {
+		if(popcorn_parameters.use_sleeping && particle.sleeping)
+			continue;
+		v_max = std::max(v_max, norm(particle.v));
+		r_min = std::min(r_min, particle.r);
+	}
+	if(v_max == 0.0f)
+		return min_substeps;
+
+	// Bound of the speed at the end of the step
+	v_max += norm(g)*dt;
+	size_t const N_substep = size_t(std::ceil(v_max*dt / (cfl*r_min)));
+	return std::min(std::max(N_substep, min_substeps), size_t(popcorn_parameters.max_substeps));
+}
+
+size_t simulate(std::vector<particle_structure>& particles, collider_set& colliders, float dt_true, popcorn_parameters_structure const& popcorn_parameters, popcorn_workspace& workspace)
+{
+	popcorn_broad_phase& broad_phase = workspace.broad_phase;
+	popcorn_contacts& contacts = workspace.contacts;
+	bool const use_sleeping = popcorn_parameters.use_sleeping;
+
 	vec3 const g = {0,0,-9.81f};
-	size_t const N_substep = 10;
+	size_t const N_substep = popcorn_parameters.adaptive_substeps ? popcorn_substep_count(particles, dt_true, g, popcorn_parameters) : 10;
 	float const dt = dt_true/N_substep;
 	for(size_t k_substep=0; k_substep<N_substep; ++k_substep)
 	{
 		size_t const N = particles.size();
-		for (size_t k = 0; k < N; ++k)
 		{
-			particle_structure& particle = particles[k];
+			PROFILE_SCOPE("popcorn integration");
+			for (size_t k = 0; k < N; ++k)
+			{
+				particle_structure& particle = particles[k];
+				particle.p_substep = particle.p;
+				if(use_sleeping && particle.sleeping)
+					continue;
 
-			vec3 const f = particle.m * g;
+				vec3 const f = particle.m * g;
 
-			particle.v = (1-0.9f*dt)*particle.v + dt*f;
-			particle.p = particle.p + dt*particle.v;
+				particle.v = (1-0.9f*dt)*particle.v + dt*f;
+				particle.p = particle.p + dt*particle.v;
+			}
 		}
 
 		// Collisions between spheres
-		for(size_t k1=0; k1<N; ++k1)
 		{
-			for(size_t k2=k1+1; k2<N; ++k2)
-			{
-				particle_structure& p1 = particles[k1];
-				particle_structure& p2 = particles[k2];
+			PROFILE_SCOPE("popcorn contacts");
+			contacts.pairs.clear();
+			contacts.islands_to_wake.clear();
+			if(popcorn_parameters.parallel_contacts)
+				collision_sphere_sphere_parallel(particles, broad_phase, workspace.solver, popcorn_parameters, contacts);
+			else if(popcorn_parameters.use_grid_broad_phase)
+				collision_sphere_sphere_grid(particles, broad_phase, popcorn_parameters, contacts);
+			else
+				collision_sphere_sphere_brute_force(particles, popcorn_parameters, contacts);
+		}
 
-				collision_sphere_sphere(p1.p,p1.v,p1.r, p2.p,p2.v,p2.r);
+		// Collisions with the walls and obstacles, detection of the triggers
+		{
+			PROFILE_SCOPE("popcorn colliders");
+			for(size_t k=0; k<N; ++k){
+				particle_structure& part = particles[k];
+				if(use_sleeping && part.sleeping)
+					continue;
+				if(popcorn_parameters.use_ccd)
+					colliders.collide_swept(part.p_substep, part.p, part.v, part.r, popcorn_parameters.ccd_iterations);
+				else
+					colliders.collide(part.p, part.v, part.r);
 			}
 		}
 
-		// Collisions with plane
-		const std::vector<vec3> face_normal  = {{0, 1,0}, { 1,0,0}, {0,0, 1}, {0,-1,0}, {-1,0,0}, {0,0,-1}};
-		const std::vector<vec3> face_position = {{0,-1,0}, {-1,0,0}, {0,0,-1}, {0, 1,0}, { 1,0,0}, {0,0, 1}};
-		const size_t N_face = face_normal.size();
-		for(size_t k=0; k<N; ++k){
-			particle_structure& part = particles[k];
-			for(size_t k_face=0; k_face<N_face; ++k_face)
-				collision_sphere_plane(part.p, part.v, part.r, face_normal[k_face], face_position[k_face]);
-		}
+        if(use_sleeping) {
+            PROFILE_SCOPE("popcorn sleeping");
+            update_sleeping(particles, workspace, dt, popcorn_parameters);
+        }
+    }
+    return N_substep;
+}
 
-		// Collisions with cups
-		mat3 rot_diag = {
-                0, 0, 1,
-                1, 1, 0,
-                -1, 0, 0
-        };
 
-        mat3 rot_x = {
-                0, 0, 1,
-                0, 1, 0,
-                -1, 0, 0
-        };
+// Reordering
 
-        float x0, y0, z0;
-        for (size_t k = 0; k < N; ++k){
-            particle_structure& particle = particles[k];
-            float x = particle.p[0], y = particle.p[1], z = particle.p[2];
-            // cup 1
-            x0 = 0., y0 = 0.15, z0 = -1.04;
-            if((x0-x)*(x0-x) + (y0-y)*(y0-y) <= 0.2*0.2 && z>=z0 && z<=z0+0.55){ // collision detection
-                cups[0].body.transform.rotate = rotation(rot_diag);
-                cups[0].body.transform.translate = {0,0.15,-0.92};
-                cups[0].seat.transform.rotate = rotation(rot_diag);
-                cups[0].seat.transform.translate = {0,0.15,-0.92};
-                animate = true;
-            }
-            // cup 2
-            x0 = -0.6, y0 = -0.35, z0 = -1.04;
-            if((x0-x)*(x0-x) + (y0-y)*(y0-y) <= 0.2*0.2 && z>=z0 && z<=z0+0.55){ // collision detection
-                cups[1].body.transform.rotate = rotation(rot_x);
-                cups[1].body.transform.translate = {-0.6,-0.35,-0.92};
-                cups[1].seat.transform.rotate = rotation(rot_x);
-                cups[1].seat.transform.translate = {-0.6,-0.35,-0.92};
-                animate2 = true;
-            }
-        }
-    }
+template <typename T>
+static bool reorder_if_due(T& particles, unsigned int period, float max_disorder, particle_reordering& reordering)
+{
+    reordering.steps++;
+    if((period==0 && max_disorder<=0) || particles.size()<2)
+        return false;
+
+    // Particles added since the last reordering (never sorted) also increase the distance
+    float const distance = consecutive_distance(particles);
+    reordering.disorder = reordering.sorted_distance>0 ? distance/reordering.sorted_distance-1.0f : 1.0f;
+    bool const due = (period>0 && reordering.steps>=period) || (max_disorder>0 && reordering.disorder>max_disorder);
+    if(!due)
+        return false;
+
+    morton_codes(particles, reordering.codes);
+    morton_sort_order(reordering.codes, reordering.order);
+    apply_order(particles, reordering.order);
+    reordering.sorted_distance = consecutive_distance(particles);
+    reordering.steps = 0;
+    reordering.reorders++;
+    return true;
+}
+
+bool reorder_particles(std::vector<particle_structure>& particles, popcorn_parameters_structure const& parameters, particle_reordering& reordering)
+{
+    return reorder_if_due(particles, parameters.reorder_period, parameters.reorder_disorder, reordering);
+}
+
+bool reorder_particles(sph_particle_range particles, sph_parameters_structure const& parameters, particle_reordering& reordering)
+{
+    return reorder_if_due(particles, parameters.reorder_period, parameters.reorder_disorder, reordering);
 }
 
 
@@ -136,106 +569,223 @@ float density_to_pressure(float rho, float rho0, float stiffness) {
     return stiffness * (rho - rho0);
 }
 
-float W_laplacian_viscosity(vec3 const &p_i, vec3 const &p_j, float h) {
-    float const r = norm(p_i - p_j);
-    assert_vcl_no_msg(r <= h);
-    return 45 / (3.14159f * std::pow(h, 6.0f)) * (h - r);
-}
-
-vec3 W_gradient_pressure(vec3 const &p_i, vec3 const &p_j, float h) {
-    float const r = norm(p_i - p_j);
-    assert_vcl_no_msg(r <= h);
-    return -45 / (3.14159f * std::pow(h, 6.0f)) * std::pow(h - r, 2) * (p_i - p_j) / r;
-}
-
-float W_density(vec3 const &p_i, const vec3 &p_j, float h) {
-    float const r = norm(p_i - p_j);
-    assert_vcl_no_msg(r <= h);
-    return 315.0 / (64.0 * 3.14159f * std::pow(h, 9)) * std::pow(h * h - r * r, 3.0f);
+// Distance between two particles, only computed when the kernel needs more than the squared distance
+template <bool needs_distance>
+float kernel_distance(float r2) {
+    return needs_distance ? std::sqrt(r2) : 0.0f;
 }
 
 
-void update_density(buffer<sph_particle_element> &particles, float h, float m) {
+template <typename kernels_type>
+void update_density(sph_particle_range particles, spatial_grid const &grid, kernels_type const &kernels, float m) {
 
     size_t const N = particles.size();
 
     for (size_t i = 0; i < N; ++i)
         particles[i].rho = 0.0f;
 
+    unsigned int buckets[27];
     for (size_t i = 0; i < N; ++i) {
-        for (size_t j = 0; j < N; ++j) {
-            vec3 const &pi = particles[i].p;
-            vec3 const &pj = particles[j].p;
+        int const N_bucket = grid.neighbor_buckets(grid.particle_cell[i], buckets);
+        for (int b = 0; b < N_bucket; ++b) {
+            for (unsigned int idx = grid.bucket_start[buckets[b]]; idx < grid.bucket_start[buckets[b] + 1]; ++idx) {
+                size_t const j = grid.sorted_index[idx];
+                vec3 const &pi = particles[i].p;
+                vec3 const &pj = particles[j].p;
 
-            float const r = norm(pi - pj);
-            if (r < h)
-                particles[i].rho += m * W_density(pi, pj, h);
+                float const r2 = dot(pi - pj, pi - pj);
+                if (r2 < kernels.h2)
+                    particles[i].rho += m * kernels.density.value(r2, kernel_distance<kernels_type::density_needs_distance>(r2));
+            }
         }
     }
 }
 
 // Convert the particle density to pressure
-void update_pressure(buffer<sph_particle_element> &particles, float rho0, float stiffness) {
+void update_pressure(sph_particle_range particles, float rho0, float stiffness) {
     const size_t N = particles.size();
     for (size_t i = 0; i < N; ++i)
         particles[i].pressure = density_to_pressure(particles[i].rho, rho0, stiffness);
 }
 
 // Compute the forces and update the acceleration of the particles
-void update_force(buffer<sph_particle_element> &particles, float h, float m, float nu) {
+template <typename kernels_type>
+void update_force(sph_particle_range particles, spatial_grid const &grid, kernels_type const &kernels, float m, float nu) {
     // gravity
     const size_t N = particles.size();
     for (size_t i = 0; i < N; ++i)
         particles[i].f = m * vec3{0, 0, -9.81f};
 
+    unsigned int buckets[27];
     for (size_t i = 0; i < N; ++i) {
-        for (size_t j = 0; j < N; ++j) {
-            if (i == j)
-                continue;
+        int const N_bucket = grid.neighbor_buckets(grid.particle_cell[i], buckets);
+        for (int b = 0; b < N_bucket; ++b) {
+            for (unsigned int idx = grid.bucket_start[buckets[b]]; idx < grid.bucket_start[buckets[b] + 1]; ++idx) {
+                size_t const j = grid.sorted_index[idx];
+                if (i == j)
+                    continue;
 
-            const vec3 &pi = particles[i].p;
-            const vec3 &pj = particles[j].p;
-            float r = norm(pi - pj);
+                const vec3 &pi = particles[i].p;
+                const vec3 &pj = particles[j].p;
+                vec3 const pij = pi - pj;
+                float const r2 = dot(pij, pij);
 
-            if (r < h) {
-                const vec3 &vi = particles[i].v;
-                const vec3 &vj = particles[j].v;
+                if (r2 < kernels.h2) {
+                    float const r = kernel_distance<kernels_type::force_needs_distance>(r2);
+                    const vec3 &vi = particles[i].v;
+                    const vec3 &vj = particles[j].v;
 
-                const float pressure_i = particles[i].pressure;
-                const float pressure_j = particles[j].pressure;
+                    const float pressure_i = particles[i].pressure;
+                    const float pressure_j = particles[j].pressure;
 
-                const float rho_i = particles[i].rho;
-                const float rho_j = particles[j].rho;
+                    const float rho_i = particles[i].rho;
+                    const float rho_j = particles[j].rho;
 
-                vec3 force_pressure = {0, 0, 0};
-                vec3 force_viscosity = {0, 0, 0};
+                    vec3 force_pressure = {0, 0, 0};
+                    vec3 force_viscosity = {0, 0, 0};
 
-                force_pressure =
-                        -m / rho_i * (pressure_i + pressure_j) / (2 * rho_j) * W_gradient_pressure(pi, pj, h);
-                force_viscosity = nu * m * m * (vj - vi) / rho_j * W_laplacian_viscosity(pi, pj, h);
+                    force_pressure =
+                            -m / rho_i * (pressure_i + pressure_j) / (2 * rho_j) * kernels.pressure.gradient(r2, r) * pij;
+                    force_viscosity = nu * m * m * (vj - vi) / rho_j * kernels.viscosity.laplacian(r2, r);
 
-                particles[i].f += force_pressure / 20 + force_viscosity / 20;
+                    particles[i].f += force_pressure / 20 + force_viscosity / 20;
+                }
             }
-
         }
     }
 }
 
 
-// Simulate SPH
-void simulate(float dt, buffer<sph_particle_element> &particles, sph_parameters_structure const &sph_parameters) {
+// Copy the particles into the structure of arrays, in the order of the grid buckets so that the neighbors are contiguous
+//  (elements begin ... end-1 of soa, which must already have the size of particles)
+void sph_gather(sph_particles_soa &soa, sph_particle_range particles, spatial_grid const &grid, size_t begin, size_t end) {
+    for (size_t s = begin; s < end; ++s) {
+        sph_particle_element const &particle = particles[grid.sorted_index[s]];
+        soa.x[s] = particle.p.x;  soa.y[s] = particle.p.y;  soa.z[s] = particle.p.z;
+        soa.vx[s] = particle.v.x; soa.vy[s] = particle.v.y; soa.vz[s] = particle.v.z;
+    }
+}
+
+void sph_gather(sph_particles_soa &soa, sph_particle_range particles, spatial_grid const &grid) {
+    soa.resize(particles.size());
+    thread_pool::global().parallel_for(particles.size(), 1024, [&](size_t begin, size_t end, size_t) {
+        sph_gather(soa, particles, grid, begin, end);
+    });
+}
+
+// Copy back the computed density, pressure and force
+void sph_scatter(sph_particle_range particles, sph_particles_soa const &soa, spatial_grid const &grid, size_t begin, size_t end) {
+    for (size_t s = begin; s < end; ++s) {
+        sph_particle_element &particle = particles[grid.sorted_index[s]];
+        particle.rho = soa.rho[s];
+        particle.pressure = soa.pressure[s];
+        particle.f = {soa.fx[s], soa.fy[s], soa.fz[s]};
+    }
+}
+
+void sph_scatter(sph_particle_range particles, sph_particles_soa const &soa, spatial_grid const &grid) {
+    thread_pool::global().parallel_for(particles.size(), 1024, [&](size_t begin, size_t end, size_t) {
+        sph_scatter(particles, soa, grid, begin, end);
+    });
+}
+
+// Pressure of the particles begin ... end-1 of soa
+void sph_update_pressure_soa(sph_particles_soa &soa, float rho0, float stiffness, size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i)
+        soa.pressure[i] = density_to_pressure(soa.rho[i], rho0, stiffness);
+}
+
+
+// Compute the density, pressure and forces of the particles
+void sph_update_forces(sph_particle_range particles, sph_parameters_structure const &sph_parameters, sph_workspace &workspace) {
+
+    // Neighbor search structure with cells of the kernel size, shared by the density and force computation
+    spatial_grid &grid = workspace.grid;
+    {
+        PROFILE_SCOPE("sph grid");
+        grid.build(particles, sph_parameters.h);
+    }
 
     // Update values
-    update_density(particles, sph_parameters.h,
-                   sph_parameters.m);                   // First compute updated density
-    update_pressure(particles, sph_parameters.rho0, sph_parameters.stiffness);       // Compute associated pressure
-    update_force(particles, sph_parameters.h, sph_parameters.m, sph_parameters.nu);  // Update forces
+    sph_kernels const &kernels = sph_parameters.kernels();
+    sph_kernels_muller const *const simd_kernels = sph_simd_kernels(kernels);
+    sph_kernel_isa const isa = sph_kernel_isa_resolve(sph_parameters.isa);
+    if (isa == sph_kernel_isa::reference || simd_kernels == nullptr) {
+        {
+            PROFILE_SCOPE("sph density");
+            update_density(particles, grid, kernels,
+                           sph_parameters.m);                   // First compute updated density
+        }
+        {
+            PROFILE_SCOPE("sph pressure");
+            update_pressure(particles, sph_parameters.rho0, sph_parameters.stiffness);       // Compute associated pressure
+        }
+        PROFILE_SCOPE("sph forces");
+        update_force(particles, grid, kernels, sph_parameters.m, sph_parameters.nu);  // Update forces
+    }
+    else {
+        sph_particles_soa &soa = workspace.soa;
+        sph_gather(soa, particles, grid);
+        sph_kernel_constants const k = sph_kernel_constants_compute(*simd_kernels, sph_parameters.m, sph_parameters.nu);
 
-    // Numerical integration
-    float const damping = 0.005f;
-    size_t const N = particles.size();
-    float const m = sph_parameters.m;
-    for (size_t k = 0; k < N; ++k) {
+        {
+            PROFILE_SCOPE("sph density");
+            sph_update_density_soa(soa, grid, k, isa);
+        }
+        {
+            PROFILE_SCOPE("sph pressure");
+            thread_pool::global().parallel_for(soa.size(), 1024, [&](size_t begin, size_t end, size_t) {
+                sph_update_pressure_soa(soa, sph_parameters.rho0, sph_parameters.stiffness, begin, end);
+            });
+        }
+        {
+            PROFILE_SCOPE("sph forces");
+            if (sph_parameters.symmetric_forces)
+                sph_update_force_soa_symmetric(soa, grid, k, workspace.force_buffers);
+            else
+                sph_update_force_soa(soa, grid, k, isa);
+        }
+
+        sph_scatter(particles, soa, grid);
+    }
+}
+
+// Largest squared velocity and force of the particles begin ... end-1 (accumulated in v_max2 and f_max2)
+void sph_velocity_force_max(sph_particle_range particles, size_t begin, size_t end, float &v_max2, float &f_max2) {
+    for (size_t k = begin; k < end; ++k) {
+        v_max2 = std::max(v_max2, dot(particles[k].v, particles[k].v));
+        f_max2 = std::max(f_max2, dot(particles[k].f, particles[k].f));
+    }
+}
+
+// Largest time step satisfying the CFL condition (velocity) and the force condition (acceleration)
+float sph_stable_time_step(float v_max2, float f_max2, sph_parameters_structure const &sph_parameters) {
+    float const v_max = std::sqrt(v_max2);
+    float const a_max = std::sqrt(f_max2) / sph_parameters.m;
+
+    float const h = sph_parameters.h;
+    float dt = std::numeric_limits<float>::max();
+    if (v_max > 0)
+        dt = std::min(dt, sph_parameters.cfl_velocity * h / v_max);
+    if (a_max > 0)
+        dt = std::min(dt, sph_parameters.cfl_force * std::sqrt(h / a_max));
+    return dt;
+}
+
+// Same for the current state of the particles
+float sph_stable_time_step(sph_particle_range particles, sph_parameters_structure const &sph_parameters) {
+    size_t const N_thread = thread_pool::global().thread_count();
+    std::vector<float> v_max2(N_thread, 0.0f), f_max2(N_thread, 0.0f);
+    thread_pool::global().parallel_for(particles.size(), 1024, [&](size_t begin, size_t end, size_t thread) {
+        sph_velocity_force_max(particles, begin, end, v_max2[thread], f_max2[thread]);
+    });
+    return sph_stable_time_step(*std::max_element(v_max2.begin(), v_max2.end()), *std::max_element(f_max2.begin(), f_max2.end()), sph_parameters);
+}
+
+// Numerical integration of the particles begin ... end-1
+void sph_integrate(float dt, sph_particle_range particles, float m, size_t begin, size_t end) {
+    float const damping = 1.0f * dt; // 0.5% every 5 ms, whatever the number of substeps
+    for (size_t k = begin; k < end; ++k) {
         vec3 &p = particles[k].p;
         vec3 &v = particles[k].v;
         vec3 &f = particles[k].f;
@@ -243,8 +793,11 @@ void simulate(float dt, buffer<sph_particle_element> &particles, sph_parameters_
         v = (1 - damping) * v + dt * f / m;
         p = p + dt * v;
     }
+}
 
-    // Collision
+// Collision with the walls of the box (serial: the perturbation uses rand)
+void sph_collide_box(sph_particle_range particles) {
+    size_t const N = particles.size();
     float const epsilon = 1e-3f;
     for (size_t k = 0; k < N; ++k) {
         vec3 &p = particles[k].p;
@@ -274,3 +827,404 @@ void simulate(float dt, buffer<sph_particle_element> &particles, sph_parameters_
         }
     }
 }
+
+void sph_integrate(float dt, sph_particle_range particles, sph_parameters_structure const &sph_parameters) {
+    PROFILE_SCOPE("sph integration");
+    thread_pool::global().parallel_for(particles.size(), 1024, [&](size_t begin, size_t end, size_t) {
+        sph_integrate(dt, particles, sph_parameters.m, begin, end);
+    });
+    sph_collide_box(particles);
+}
+
+size_t simulate_position_based(float dt, sph_particle_range particles, sph_parameters_structure const &sph_parameters, pbf_workspace &workspace);
+
+// Simulate SPH
+size_t simulate(float dt, sph_particle_range particles, sph_parameters_structure const &sph_parameters, sph_workspace &workspace) {
+    if (sph_parameters.solver == sph_solver::position_based)
+        return simulate_position_based(dt, particles, sph_parameters, workspace.pbf);
+
+    // dt is split in substeps when the particles move too fast (or the forces are too strong) for a single step to be stable
+    size_t N_substep = 0;
+    float remaining = dt;
+    while (remaining > 0) {
+        sph_update_forces(particles, sph_parameters, workspace);
+
+        float dt_substep = remaining;
+        if (sph_parameters.adaptive_time_step && N_substep + 1 < sph_parameters.max_substeps) {
+            float const dt_stable = sph_stable_time_step(particles, sph_parameters);
+            if (dt_stable < remaining)
+                dt_substep = remaining / std::ceil(remaining / dt_stable); // Split the remaining time evenly
+        }
+
+        sph_integrate(dt_substep, particles, sph_parameters);
+        remaining = (dt_substep == remaining) ? 0.0f : remaining - dt_substep;
+        N_substep++;
+    }
+    return N_substep;
+}
+
+// Position based fluids [Macklin and Muller 2013]
+//  Each substep moves the particles under gravity, then corrects the predicted positions so that the density of each
+//  particle goes back to the rest density: C_i = rho_i/rho_rest - 1 is projected along its gradient (a few Jacobi
+//  iterations, the neighbors being found once per substep). The velocities are the displacements divided by the time
+//  step. The constraints hold whatever the time step: there is no stiffness to tune and no force to scale down.
+
+float sph_rest_density(sph_parameters_structure const &sph_parameters) {
+    sph_kernels const &kernels = sph_parameters.kernels();
+    float const s = sph_parameters.pbf_spacing;
+    int const n = int(std::ceil(kernels.h / s));
+    float rho = 0;
+    for (int x = -n; x <= n; ++x) {
+        for (int y = -n; y <= n; ++y) {
+            for (int z = -n; z <= n; ++z) {
+                float const r2 = s * s * float(x * x + y * y + z * z);
+                if (r2 < kernels.h2)
+                    rho += sph_parameters.m * kernels.density.value(r2, std::sqrt(r2));
+            }
+        }
+    }
+    return rho;
+}
+
+// Same walls as sph_collide_box, the positions are projected inside
+static void pbf_clamp_box(vec3 &p) {
+    p.x = std::min(std::max(p.x, -1.0f), 1.0f);
+    p.y = std::max(p.y, -1.0f);
+    p.z = std::max(p.z, 0.0f);
+}
+
+// Neighbors within h of each particle (itself excluded)
+static void pbf_find_neighbors(sph_particle_range particles, float h, pbf_workspace &w) {
+    size_t const N = particles.size();
+    float const h2 = h * h;
+    w.grid.build(particles, h);
+    w.neighbor_start.assign(N + 1, 0);
+
+    // Count, then fill once the offsets are known
+    for (int pass = 0; pass < 2; ++pass) {
+        thread_pool::global().parallel_for(N, 256, [&](size_t begin, size_t end, size_t) {
+            unsigned int buckets[27];
+            for (size_t i = begin; i < end; ++i) {
+                unsigned int count = 0;
+                int const N_bucket = w.grid.neighbor_buckets(w.grid.particle_cell[i], buckets);
+                for (int b = 0; b < N_bucket; ++b) {
+                    for (unsigned int idx = w.grid.bucket_start[buckets[b]]; idx < w.grid.bucket_start[buckets[b] + 1]; ++idx) {
+                        unsigned int const j = w.grid.sorted_index[idx];
+                        vec3 const pij = particles[i].p - particles[j].p;
+                        if (j == i || dot(pij, pij) >= h2)
+                            continue;
+                        if (pass == 1)
+                            w.neighbors[w.neighbor_start[i] + count] = j;
+                        count++;
+                    }
+                }
+                if (pass == 0)
+                    w.neighbor_start[i + 1] = count;
+            }
+        });
+        if (pass == 0) {
+            for (size_t i = 0; i < N; ++i)
+                w.neighbor_start[i + 1] += w.neighbor_start[i];
+            w.neighbors.resize(w.neighbor_start[N]);
+        }
+    }
+}
+
+static void pbf_substep(float dt, sph_particle_range particles, sph_parameters_structure const &sph_parameters, pbf_workspace &w) {
+    size_t const N = particles.size();
+    sph_kernels const &kernels = sph_parameters.kernels();
+    float const m = sph_parameters.m;
+    float const rho_rest = sph_rest_density(sph_parameters);
+    float const c = m / rho_rest; // Gradient of C_i relative to the kernel gradient
+    float const relaxation = sph_parameters.pbf_relaxation / kernels.h2;
+    float const W_self = kernels.density.value(0.0f, 0.0f);
+    float const r2_tensile = 0.04f * kernels.h2; // Artificial pressure relative to the kernel at 0.2 h
+    float const W_tensile = kernels.density.value(r2_tensile, std::sqrt(r2_tensile));
+    float const max_correction = sph_parameters.pbf_max_speed * dt / std::max(sph_parameters.pbf_iterations, 1u);
+    w.previous.resize(N);
+    w.delta.resize(N);
+    w.lambda.resize(N);
+
+    // Prediction (the particles hold the predicted positions until the end of the substep)
+    {
+        PROFILE_SCOPE("sph integration");
+        float const damping = 1.0f * dt; // Same damping as the explicit solver
+        thread_pool::global().parallel_for(N, 1024, [&](size_t begin, size_t end, size_t) {
+            for (size_t i = begin; i < end; ++i) {
+                w.previous[i] = particles[i].p;
+                particles[i].v = (1 - damping) * particles[i].v + dt * vec3{0, 0, -9.81f};
+                particles[i].p = particles[i].p + dt * particles[i].v;
+                pbf_clamp_box(particles[i].p);
+            }
+        });
+    }
+    {
+        PROFILE_SCOPE("sph grid");
+        pbf_find_neighbors(particles, kernels.h, w);
+    }
+
+    for (unsigned int iteration = 0; iteration < sph_parameters.pbf_iterations; ++iteration) {
+        {
+            PROFILE_SCOPE("sph density");
+            thread_pool::global().parallel_for(N, 256, [&](size_t begin, size_t end, size_t) {
+                for (size_t i = begin; i < end; ++i) {
+                    float rho = m * W_self;
+                    vec3 gradient_i = {0, 0, 0};
+                    float gradient2 = 0;
+                    for (unsigned int n = w.neighbor_start[i]; n < w.neighbor_start[i + 1]; ++n) {
+                        vec3 const pij = particles[i].p - particles[w.neighbors[n]].p;
+                        float const r2 = dot(pij, pij);
+                        if (r2 >= kernels.h2 || r2 <= 0)
+                            continue;
+                        float const r = std::sqrt(r2);
+                        rho += m * kernels.density.value(r2, r);
+                        vec3 const gradient_j = c * kernels.pressure.gradient(r2, r) * pij;
+                        gradient_i += gradient_j;
+                        gradient2 += dot(gradient_j, gradient_j);
+                    }
+                    particles[i].rho = rho;
+                    // Only compressions are corrected: a constraint pulling the particles together makes them clump at the surface
+                    float const C = std::max(rho / rho_rest - 1.0f, 0.0f);
+                    w.lambda[i] = -C / (gradient2 + dot(gradient_i, gradient_i) + relaxation);
+                }
+            });
+        }
+        {
+            PROFILE_SCOPE("sph pressure");
+            thread_pool::global().parallel_for(N, 256, [&](size_t begin, size_t end, size_t) {
+                for (size_t i = begin; i < end; ++i) {
+                    vec3 d = {0, 0, 0};
+                    for (unsigned int n = w.neighbor_start[i]; n < w.neighbor_start[i + 1]; ++n) {
+                        unsigned int const j = w.neighbors[n];
+                        vec3 const pij = particles[i].p - particles[j].p;
+                        float const r2 = dot(pij, pij);
+                        if (r2 >= kernels.h2 || r2 <= 0)
+                            continue;
+                        float const r = std::sqrt(r2);
+                        float const ratio = kernels.density.value(r2, r) / W_tensile;
+                        float const s_corr = -sph_parameters.pbf_tensile * ratio * ratio * ratio * ratio;
+                        d += (w.lambda[i] + w.lambda[j] + s_corr) * kernels.pressure.gradient(r2, r) * pij;
+                    }
+                    d *= c;
+                    float const length = norm(d);
+                    w.delta[i] = length > max_correction ? (max_correction / length) * d : d;
+                }
+            });
+            thread_pool::global().parallel_for(N, 1024, [&](size_t begin, size_t end, size_t) {
+                for (size_t i = begin; i < end; ++i) {
+                    particles[i].p += w.delta[i];
+                    pbf_clamp_box(particles[i].p);
+                }
+            });
+        }
+    }
+
+    // Velocities from the displacements, smoothed by the XSPH viscosity
+    PROFILE_SCOPE("sph forces");
+    thread_pool::global().parallel_for(N, 1024, [&](size_t begin, size_t end, size_t) {
+        for (size_t i = begin; i < end; ++i)
+            particles[i].v = (particles[i].p - w.previous[i]) / dt;
+    });
+    thread_pool::global().parallel_for(N, 256, [&](size_t begin, size_t end, size_t) {
+        for (size_t i = begin; i < end; ++i) {
+            vec3 dv = {0, 0, 0};
+            for (unsigned int n = w.neighbor_start[i]; n < w.neighbor_start[i + 1]; ++n) {
+                unsigned int const j = w.neighbors[n];
+                vec3 const pij = particles[i].p - particles[j].p;
+                float const r2 = dot(pij, pij);
+                if (r2 < kernels.h2)
+                    dv += (m / particles[j].rho) * kernels.density.value(r2, std::sqrt(r2)) * (particles[j].v - particles[i].v);
+            }
+            w.delta[i] = sph_parameters.pbf_xsph * dv;
+        }
+    });
+    thread_pool::global().parallel_for(N, 1024, [&](size_t begin, size_t end, size_t) {
+        for (size_t i = begin; i < end; ++i) {
+            particles[i].v += w.delta[i];
+            particles[i].pressure = 0;
+            particles[i].f = {0, 0, 0};
+        }
+    });
+}
+
+size_t simulate_position_based(float dt, sph_particle_range particles, sph_parameters_structure const &sph_parameters, pbf_workspace &workspace) {
+
+    // The constraints do not limit the time step, only the neighborhoods do: no particle moves by more than cfl_velocity h
+    size_t N_substep = 1;
+    if (sph_parameters.adaptive_time_step) {
+        float v_max2 = 0.0f, f_max2 = 0.0f;
+        sph_velocity_force_max(particles, 0, particles.size(), v_max2, f_max2);
+        float const dt_stable = sph_stable_time_step(v_max2, 0.0f, sph_parameters);
+        if (dt_stable < dt)
+            N_substep = std::min(size_t(std::ceil(dt / dt_stable)), size_t(std::max(sph_parameters.max_substeps, 1u)));
+    }
+    for (size_t k = 0; k < N_substep; ++k)
+        pbf_substep(dt / N_substep, particles, sph_parameters, workspace);
+    return N_substep;
+}
+
+
+// Fluid domains
+
+size_t sph_domain_set::add(buffer<sph_particle_element> const& domain_particles, vec3 const& shift, sph_parameters_structure const& parameters, bool active)
+{
+    sph_domain domain;
+    domain.offset = particles.size();
+    domain.count = domain_particles.size();
+    domain.shift = shift;
+    domain.active = active;
+    domain.parameters = parameters;
+    for (sph_particle_element const& particle : domain_particles)
+        particles.push_back(particle);
+    domains.push_back(domain);
+    return domains.size() - 1;
+}
+
+size_t reorder_particles(sph_domain_set& fluids) {
+    size_t N_reordered = 0;
+    for (size_t d = 0; d < fluids.domains.size(); ++d) {
+        sph_domain& domain = fluids.domains[d];
+        if (domain.active && reorder_particles(fluids.range(d), domain.parameters, domain.reordering))
+            N_reordered++;
+    }
+    return N_reordered;
+}
+
+// Split the particles of the stepping domains into tasks, in the order of the domains
+static void sph_domain_tasks(sph_domain_set& fluids) {
+    size_t const grain = 256; // Particles of a task
+    fluids.tasks.clear();
+    for (size_t d : fluids.stepping) {
+        size_t const N = fluids.domains[d].count;
+        for (size_t begin = 0; begin < N; begin += grain)
+            fluids.tasks.push_back({d, begin, std::min(begin + grain, N), 0.0f, 0.0f});
+    }
+}
+
+// Call f(domain, particles of the domain, task) for every task, as one parallel loop
+template <typename F>
+static void sph_domain_parallel_for(sph_domain_set& fluids, F const& f) {
+    thread_pool::global().parallel_for(fluids.tasks.size(), 1, [&](size_t begin, size_t end, size_t) {
+        for (size_t t = begin; t < end; ++t) {
+            sph_domain_set::task& task = fluids.tasks[t];
+            f(fluids.domains[task.domain], fluids.range(task.domain), task);
+        }
+    });
+}
+
+// Density, pressure and forces of the stepping domains
+static void sph_update_forces(sph_domain_set& fluids) {
+    // The reference loops and the symmetric forces keep their own loops, run one domain after the other
+    for (size_t d : fluids.stepping) {
+        sph_domain& domain = fluids.domains[d];
+        sph_parameters_structure const& parameters = domain.parameters;
+        sph_kernels_muller const* const simd_kernels = sph_simd_kernels(parameters.kernels());
+        domain.isa = sph_kernel_isa_resolve(parameters.isa);
+        domain.batched = domain.isa != sph_kernel_isa::reference && simd_kernels != nullptr && !parameters.symmetric_forces;
+        if (domain.batched)
+            domain.constants = sph_kernel_constants_compute(*simd_kernels, parameters.m, parameters.nu);
+        else
+            sph_update_forces(fluids.range(d), parameters, domain.workspace);
+    }
+
+    {
+        PROFILE_SCOPE("sph grid");
+        thread_pool::global().parallel_for(fluids.stepping.size(), 1, [&](size_t begin, size_t end, size_t) {
+            for (size_t k = begin; k < end; ++k) {
+                sph_domain& domain = fluids.domains[fluids.stepping[k]];
+                if (domain.batched) {
+                    domain.workspace.grid.build(fluids.range(fluids.stepping[k]), domain.parameters.h);
+                    domain.workspace.soa.resize(domain.count);
+                }
+            }
+        });
+        sph_domain_parallel_for(fluids, [](sph_domain& domain, sph_particle_range particles, sph_domain_set::task const& task) {
+            if (domain.batched)
+                sph_gather(domain.workspace.soa, particles, domain.workspace.grid, task.begin, task.end);
+        });
+    }
+    {
+        PROFILE_SCOPE("sph density");
+        sph_domain_parallel_for(fluids, [](sph_domain& domain, sph_particle_range, sph_domain_set::task const& task) {
+            if (domain.batched)
+                sph_update_density_soa(domain.workspace.soa, domain.workspace.grid, domain.constants, domain.isa, task.begin, task.end);
+        });
+    }
+    {
+        PROFILE_SCOPE("sph pressure");
+        sph_domain_parallel_for(fluids, [](sph_domain& domain, sph_particle_range, sph_domain_set::task const& task) {
+            if (domain.batched)
+                sph_update_pressure_soa(domain.workspace.soa, domain.parameters.rho0, domain.parameters.stiffness, task.begin, task.end);
+        });
+    }
+    {
+        PROFILE_SCOPE("sph forces");
+        sph_domain_parallel_for(fluids, [](sph_domain& domain, sph_particle_range, sph_domain_set::task const& task) {
+            if (domain.batched)
+                sph_update_force_soa(domain.workspace.soa, domain.workspace.grid, domain.constants, domain.isa, task.begin, task.end);
+        });
+        sph_domain_parallel_for(fluids, [](sph_domain& domain, sph_particle_range particles, sph_domain_set::task const& task) {
+            if (domain.batched)
+                sph_scatter(particles, domain.workspace.soa, domain.workspace.grid, task.begin, task.end);
+        });
+    }
+}
+
+void simulate(float dt, sph_domain_set& fluids) {
+    for (size_t d = 0; d < fluids.domains.size(); ++d) {
+        sph_domain& domain = fluids.domains[d];
+        domain.substeps = 0;
+        domain.remaining = domain.active ? dt : 0.0f;
+        if (domain.active && domain.parameters.solver == sph_solver::position_based) {
+            domain.substeps = simulate_position_based(dt, fluids.range(d), domain.parameters, domain.workspace.pbf);
+            domain.remaining = 0;
+        }
+    }
+
+    // Each round takes one substep of every domain that has time left (see simulate on a single fluid)
+    while (true) {
+        fluids.stepping.clear();
+        for (size_t d = 0; d < fluids.domains.size(); ++d) {
+            if (fluids.domains[d].remaining > 0 && fluids.domains[d].count > 0)
+                fluids.stepping.push_back(d);
+        }
+        if (fluids.stepping.empty())
+            break;
+        sph_domain_tasks(fluids);
+
+        sph_update_forces(fluids);
+
+        // Substep of each domain, from the largest velocity and force of its tasks
+        sph_domain_parallel_for(fluids, [](sph_domain& domain, sph_particle_range particles, sph_domain_set::task& task) {
+            task.v_max2 = task.f_max2 = 0.0f;
+            if (domain.parameters.adaptive_time_step)
+                sph_velocity_force_max(particles, task.begin, task.end, task.v_max2, task.f_max2);
+        });
+        size_t t = 0;
+        for (size_t d : fluids.stepping) {
+            sph_domain& domain = fluids.domains[d];
+            float v_max2 = 0.0f, f_max2 = 0.0f;
+            for (; t < fluids.tasks.size() && fluids.tasks[t].domain == d; ++t) {
+                v_max2 = std::max(v_max2, fluids.tasks[t].v_max2);
+                f_max2 = std::max(f_max2, fluids.tasks[t].f_max2);
+            }
+            domain.dt_substep = domain.remaining;
+            if (domain.parameters.adaptive_time_step && domain.substeps + 1 < domain.parameters.max_substeps) {
+                float const dt_stable = sph_stable_time_step(v_max2, f_max2, domain.parameters);
+                if (dt_stable < domain.remaining)
+                    domain.dt_substep = domain.remaining / std::ceil(domain.remaining / dt_stable);
+            }
+        }
+
+        PROFILE_SCOPE("sph integration");
+        sph_domain_parallel_for(fluids, [](sph_domain& domain, sph_particle_range particles, sph_domain_set::task const& task) {
+            sph_integrate(domain.dt_substep, particles, domain.parameters.m, task.begin, task.end);
+        });
+        for (size_t d : fluids.stepping) {
+            sph_domain& domain = fluids.domains[d];
+            sph_collide_box(fluids.range(d));
+            domain.remaining = (domain.dt_substep == domain.remaining) ? 0.0f : domain.remaining - domain.dt_substep;
+            domain.substeps++;
+        }
+    }
+}
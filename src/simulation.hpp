@@ -1,6 +1,10 @@
 #pragma once
 
 #include "vcl/vcl.hpp"
+#include "spatial_grid.hpp"
+#include "sph_simd.hpp"
+#include "sph_kernels.hpp"
+#include "colliders.hpp"
 using namespace vcl;
 
 // Particle structure used for popcorns
@@ -11,12 +15,59 @@ struct particle_structure
     vcl::vec3 c; // Color
     float r;     // Radius
     float m;     // mass
+    unsigned int id = 0; // Stable identifier (index of emission): the particles are reordered in memory
+    vcl::vec3 p_substep; // Position at the beginning of the current substep (continuous collisions)
+
+    float rest_time = 0;     // Time spent slower than the sleep velocity
+    bool sleeping = false;   // Sleeping particles are neither integrated nor collided
+    unsigned int island = 0; // Contact island of a sleeping particle (woken up together)
+};
+
+// Popcorn simulation parameters
+struct popcorn_parameters_structure
+{
+    // Broad phase of the sphere-sphere collisions: uniform grid, or all pairs (brute force) to cross-check the results
+    bool use_grid_broad_phase = true;
+
+    // Sphere-sphere contacts listed then resolved color by color on the threads of the pool: the result does not depend
+    //  on the number of threads. Otherwise, the pairs are resolved one after the other as the broad phase visits them.
+    bool parallel_contacts = true;
+
+    // Sleeping: a contact island whose particles all stayed slower than sleep_velocity during sleep_time seconds is no longer simulated.
+    //  A particle faster than sleep_velocity hitting a sleeping particle wakes up its whole island.
+    //  Islands are limited to max_island_size particles so that an impact on a large pile only wakes up its neighborhood.
+    //  (With sleeping enabled, the grid and brute force broad phases no longer visit the pairs in the same order.)
+    bool use_sleeping = true;
+    float sleep_velocity = 0.1f;
+    float sleep_time = 0.5f;
+    unsigned int max_island_size = 32;
+
+    // Substeps: no particle should move by more than substep_cfl times its radius during a substep,
+    //  within [min_substeps, max_substeps]. Without adaptive_substeps, every step takes 10 substeps.
+    bool adaptive_substeps = true;
+    float substep_cfl = 0.4f;
+    unsigned int min_substeps = 2;
+    unsigned int max_substeps = 40;
+
+    // Continuous collisions: a particle moving by more than its radius during a substep is swept from its previous position
+    //  and stops at its first time of impact with the colliders and the other popcorns, instead of tunnelling through them.
+    //  The time of impact with a collider is found by conservative advancement in at most ccd_iterations iterations.
+    //  The substeps then only resolve the contacts: ccd_substep_cfl radii per substep, and at least ccd_min_substeps.
+    bool use_ccd = true;
+    unsigned int ccd_iterations = 8;
+    float ccd_substep_cfl = 4.0f;
+    unsigned int ccd_min_substeps = 1;
+
+    // Reordering of the particles along a Morton curve of their positions (see reorder_particles)
+    unsigned int reorder_period = 0;
+    float reorder_disorder = 0.5f;
 };
 
 // Structure of our cup = body (cylinder) + seat (circle)
 struct Cup{
     mesh_drawable body;
     mesh_drawable seat;
+    vcl::affine_rts tipped; // Transform of the body and the seat once a popcorn fell into the cup
 };
 
 // SPH Particle
@@ -28,8 +79,32 @@ struct sph_particle_element
 
     float rho;      // density at this particle position
     float pressure; // pressure at this particle position
+    unsigned int id; // Stable identifier (index at creation): the particles are reordered in memory
+
+    sph_particle_element() : p{0,0,0},v{0,0,0},f{0,0,0},rho(0),pressure(0),id(0) {}
+};
+
+// Contiguous particles of a buffer: a whole buffer, or the particles of one domain of a sph_domain_set
+struct sph_particle_range
+{
+    sph_particle_element* data = nullptr;
+    size_t N = 0;
+
+    sph_particle_range() {}
+    sph_particle_range(sph_particle_element* data_arg, size_t N_arg) : data(data_arg), N(N_arg) {}
+    sph_particle_range(vcl::buffer<sph_particle_element>& particles) : data(particles.data.data()), N(particles.size()) {}
+
+    size_t size() const { return N; }
+    sph_particle_element& operator[](size_t k) const { return data[k]; }
+    sph_particle_element* begin() const { return data; }
+    sph_particle_element* end() const { return data+N; }
+};
 
-    sph_particle_element() : p{0,0,0},v{0,0,0},f{0,0,0},rho(0),pressure(0) {}
+// Time integration of the fluid
+enum class sph_solver
+{
+    explicit_pressure, // Weakly compressible: pressure forces proportional to the compression, small steps
+    position_based     // Position based fluids: the positions are projected on the incompressibility constraints
 };
 
 // SPH simulation parameters
@@ -51,7 +126,202 @@ struct sph_parameters_structure
     // Stiffness converting density to pressure
     float stiffness = 0.1f;
 
+    // Implementation of the density and force loops (automatic = SIMD selected at runtime for this CPU)
+    sph_kernel_isa isa = sph_kernel_isa::automatic;
+
+    // Compute each pair force once for both particles (scalar loop with per-thread buffers) instead of once per particle
+    bool symmetric_forces = false;
+
+    // Adaptive time step: a step is split into at most max_substeps substeps no longer than
+    //  cfl_velocity h / v_max (CFL condition) and cfl_force sqrt(h / a_max) (force condition)
+    bool adaptive_time_step = true;
+    float cfl_velocity = 0.4f;
+    float cfl_force = 0.25f;
+    unsigned int max_substeps = 16;
+
+    // Reordering of the particles along a Morton curve of their positions (see reorder_particles)
+    unsigned int reorder_period = 0;
+    float reorder_disorder = 0.5f;
+
+    sph_solver solver = sph_solver::explicit_pressure;
+
+    // Position based fluids [Macklin and Muller 2013]
+    //  The rest density is the density of a cubic lattice of particles with pbf_spacing between neighbors (rho0 only
+    //  applies to the explicit solver). Each substep runs pbf_iterations Jacobi iterations on the density constraints.
+    //  pbf_relaxation softens the constraints (relative to 1/h^2), pbf_tensile is the artificial pressure keeping the
+    //  particles apart at the surface, pbf_xsph the XSPH viscosity. The corrections move the particles at pbf_max_speed
+    //  at most, so that a fluid starting far from its rest density expands instead of exploding.
+    //  The adaptive time step only applies the CFL condition.
+    float pbf_spacing = 0.06f;
+    unsigned int pbf_iterations = 4;
+    float pbf_max_speed = 1.0f;
+    float pbf_relaxation = 1e-2f;
+    float pbf_tensile = 1e-3f;
+    float pbf_xsph = 0.01f;
+
+    // Kernels for the current h (sph_kernels is selected at compile time)
+    //  The normalization constants are only computed again when h changes.
+    sph_kernels const& kernels() const
+    {
+        if(kernels_h != h) {
+            kernels_cache = sph_kernels(h);
+            kernels_h = h;
+        }
+        return kernels_cache;
+    }
+    mutable sph_kernels kernels_cache{h};
+    mutable float kernels_h = h;
+};
+
+// Reordering of a particle set in memory along a Morton curve (morton_order.hpp), so that the neighbor loops
+// visit particles close in memory. The particles keep their id, which the display and the recordings use.
+//  The set is reordered every reorder_period steps, or as soon as the average distance between consecutive particles
+//  has grown by more than reorder_disorder (relative to its value after the last reordering). 0 disables either trigger.
+struct particle_reordering
+{
+    unsigned int steps = 0;     // Steps since the last reordering
+    size_t reorders = 0;        // Number of reorderings
+    float sorted_distance = 0;  // Average distance between consecutive particles after the last reordering
+    float disorder = 0;         // Relative growth of this distance measured at the last call
+
+    std::vector<uint32_t> codes; // Buffers reused between the calls
+    std::vector<unsigned int> order;
+};
+// Return true when the particles were reordered (call between steps)
+bool reorder_particles(std::vector<particle_structure>& particles, popcorn_parameters_structure const& parameters, particle_reordering& reordering);
+bool reorder_particles(sph_particle_range particles, sph_parameters_structure const& parameters, particle_reordering& reordering);
+
+// Contacts found by the sphere-sphere pass, used to build the sleeping islands
+struct popcorn_contacts
+{
+    std::vector<std::pair<unsigned int, unsigned int> > pairs; // Overlapping pairs (when sleeping is used)
+    std::vector<unsigned int> islands_to_wake;                 // Sleeping islands hit by a fast particle
+};
+
+// Grid broad phase of the sphere-sphere collisions
+//  The cell size is the largest diameter, so that two spheres in contact are always in neighboring cells.
+//  Pairs are resolved in the same (k1,k2) order as the brute force version to allow cross-checking.
+//  Sleeping particles are only visited as neighbors of awake ones.
+//  With continuous collisions, a particle moving by more than its radius during the substep may have met the spheres
+//  up to the sum of both diameters and displacements away: a pair with such a fast particle is visited from its particle
+//  with the largest displacement, which searches the cells up to twice the largest diameter and its displacement away.
+struct popcorn_broad_phase
+{
+    spatial_grid grid;
+    std::vector<float> displacement; // Displacement of the fast particles, 0 for the others
+    float r_max = 0.0f;
+
+    void build(std::vector<particle_structure> const& particles, popcorn_parameters_structure const& parameters);
+
+    // Sorted indices of the neighbors k2 of the awake particle k1 whose pair is visited from k1 (buckets: temporary buffer)
+    void candidates(std::vector<particle_structure> const& particles, size_t k1, popcorn_parameters_structure const& parameters,
+                    std::vector<unsigned int>& result, std::vector<unsigned int>& buckets) const;
+};
+
+// Contacts of the parallel sphere-sphere pass (see collision_sphere_sphere_parallel)
+struct popcorn_contact_solver
+{
+    std::vector<uint64_t> pairs;                       // (k1<<32)|k2 with k1<k2, sorted
+    std::vector<std::vector<uint64_t> > thread_pairs;  // Generation buffers of each thread
+    std::vector<uint64_t> particle_colors;             // Per particle: bit c set when one of its contacts has color c
+    std::vector<unsigned int> color_start;             // Contacts of color c: order[color_start[c]] ... order[color_start[c+1]-1]
+    std::vector<unsigned int> order;
+    std::vector<unsigned char> touched;                // Per contact: result of the resolution
+    std::vector<unsigned int> island_to_wake;
+};
+
+// Working data of a popcorn simulation, kept between its steps: the contact buffers reuse their memory, and the sleeping
+// islands keep their numbering. Each simulation owns its own, so that several simulations stay independent.
+struct popcorn_workspace
+{
+    popcorn_broad_phase broad_phase;
+    popcorn_contact_solver solver;
+    popcorn_contacts contacts;
+
+    unsigned int next_island = 1;                          // Id of the next island put to sleep (0: none)
+    std::vector<unsigned int> island_parent, island_size;  // Union-find of the contact islands
+    std::vector<char> island_rested;
+    std::vector<unsigned int> island_id;
+};
+
+// Working data of the position based solver, kept between the steps to reuse its memory
+struct pbf_workspace
+{
+    spatial_grid grid;
+    std::vector<vec3> previous;               // Positions at the beginning of the substep
+    std::vector<vec3> delta;                  // Position correction of an iteration, then XSPH velocity correction
+    std::vector<float> lambda;                // Lagrange multiplier of the density constraint
+    std::vector<unsigned int> neighbor_start; // Neighbors of particle i: neighbors[neighbor_start[i]] ... neighbors[neighbor_start[i+1]-1]
+    std::vector<unsigned int> neighbors;
+};
+
+// Working data of the SPH steps of a fluid, kept between its steps to reuse its memory (each fluid owns its own)
+struct sph_workspace
+{
+    spatial_grid grid;                  // Neighbor search, cells of the kernel size
+    sph_particles_soa soa;              // Particles gathered in grid order for the SIMD loops
+    sph_force_buffers force_buffers;    // Symmetric forces
+    pbf_workspace pbf;                  // Position based solver
+};
+
+// Both return the number of substeps taken
+// The popcorns collide with the solid colliders and mark the triggers they enter (see collider_set::dispatch_triggers)
+size_t simulate(std::vector<particle_structure>& particles, collider_set& colliders, float dt, popcorn_parameters_structure const& popcorn_parameters,
+                popcorn_workspace& workspace);
+size_t simulate(float dt, sph_particle_range particles, sph_parameters_structure const& sph_parameters, sph_workspace& workspace); // SPH
+
+// Rest density of the position based solver (density of a lattice of spacing pbf_spacing)
+float sph_rest_density(sph_parameters_structure const& sph_parameters);
+
+
+// Fluid domain of a sph_domain_set: an independent fluid with its own frame, parameters and state
+struct sph_domain
+{
+    size_t offset = 0;   // Particles offset ... offset+count-1 of sph_domain_set::particles
+    size_t count = 0;
+    vcl::vec3 shift;     // Position of the frame of the domain in the scene (the particles are simulated in this frame)
+    bool active = false; // Only the active domains are simulated
+    sph_parameters_structure parameters;
+    particle_reordering reordering;
+    size_t substeps = 0; // Substeps taken by the last step
+
+    // Working data of a step, kept between the steps to reuse its memory
+    sph_workspace workspace;
+    bool batched = false; // Forces computed by the batched loops (otherwise by the loops of a single fluid)
+    sph_kernel_isa isa = sph_kernel_isa::reference;
+    sph_kernel_constants constants;
+    float remaining = 0;  // Time left to simulate in the current step
+    float dt_substep = 0;
+};
+
+// Several fluids simulated together
+//  The particles of all the domains are stored one domain after the other in a single buffer. A step runs each phase
+//  (gather, density, pressure, forces, integration) as one parallel loop over chunks of the particles of every active
+//  domain, instead of one loop per domain: the threads stay busy whatever the size of the domains, and the cost only
+//  depends on the number of active particles. Inactive domains are never visited.
+struct sph_domain_set
+{
+    vcl::buffer<sph_particle_element> particles;
+    std::vector<sph_domain> domains;
+
+    // Append a domain holding a copy of domain_particles, returns its index
+    size_t add(vcl::buffer<sph_particle_element> const& domain_particles, vcl::vec3 const& shift, sph_parameters_structure const& parameters, bool active = false);
+    sph_particle_range range(size_t domain) { return {particles.data.data()+domains[domain].offset, domains[domain].count}; }
+
+    // Chunk of the particles of one domain, the unit of work of the parallel loops
+    struct task
+    {
+        size_t domain, begin, end;
+        float v_max2, f_max2; // Largest squared velocity and force of the chunk
+    };
+    std::vector<task> tasks;          // Working data of a step
+    std::vector<size_t> stepping;     // Domains taking a substep
 };
 
-void simulate(std::vector<particle_structure>& particles, std::vector<Cup>& cups, float dt, bool &animate, bool &animate2);
-void simulate(float dt, vcl::buffer<sph_particle_element>& particles, sph_parameters_structure const& sph_parameters); // SPH
+// Reorder the particles of each active domain (see reorder_particles), returns the number of reordered domains
+size_t reorder_particles(sph_domain_set& fluids);
+// Advance every active domain by dt, each one with its own substeps (stored in sph_domain::substeps)
+//  The domains using the position based solver are stepped one after the other.
+//  A single active domain gets the same result as simulate(dt, fluids.range(k), fluids.domains[k].parameters). With several
+//  domains, only the random perturbations of the wall collisions are drawn in another order.
+void simulate(float dt, sph_domain_set& fluids);
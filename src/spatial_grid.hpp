@@ -0,0 +1,108 @@
+#pragma once
+
+#include "vcl/vcl.hpp"
+#include <algorithm>
+#include <vector>
+#include <cmath>
+
+// Integer coordinates of a grid cell
+struct grid_cell
+{
+    int x, y, z;
+};
+
+// Uniform grid stored as a compact hash table.
+// Particles are bucketed by the hash of their cell coordinates and sorted by bucket with a counting sort:
+// the particles of bucket b are sorted_index[bucket_start[b]] ... sorted_index[bucket_start[b+1]-1].
+// Several cells may share a bucket, so queries still have to check the actual distance.
+struct spatial_grid
+{
+    float cell_size = 1.0f;
+    std::vector<unsigned int> bucket_start;   // Size = number of buckets + 1
+    std::vector<unsigned int> sorted_index;   // Particle indices sorted by bucket
+    std::vector<grid_cell> particle_cell;     // Cell of each particle at build time
+
+    // Build the grid from any container of elements having a position p (particle_structure, sph_particle_element)
+    template <typename T> void build(T const& particles, float cell_size_arg);
+
+    grid_cell cell(vcl::vec3 const& p) const;
+    unsigned int bucket(grid_cell const& c) const;
+
+    // Fill buckets with the distinct buckets of the 27 cells around c, returns their number
+    int neighbor_buckets(grid_cell const& c, unsigned int buckets[27]) const;
+    // Distinct buckets of the cells overlapping the box [p_min,p_max]
+    void box_buckets(vcl::vec3 const& p_min, vcl::vec3 const& p_max, std::vector<unsigned int>& buckets) const;
+};
+
+
+inline grid_cell spatial_grid::cell(vcl::vec3 const& p) const
+{
+    return { int(std::floor(p.x/cell_size)), int(std::floor(p.y/cell_size)), int(std::floor(p.z/cell_size)) };
+}
+
+inline unsigned int spatial_grid::bucket(grid_cell const& c) const
+{
+    unsigned int const h = (unsigned int)(c.x)*73856093u ^ (unsigned int)(c.y)*19349663u ^ (unsigned int)(c.z)*83492791u;
+    return h & (unsigned int)(bucket_start.size()-2); // Number of buckets is a power of two
+}
+
+template <typename T>
+void spatial_grid::build(T const& particles, float cell_size_arg)
+{
+    cell_size = cell_size_arg;
+    size_t const N = particles.size();
+
+    // Twice as many buckets as particles keeps the collisions between cells low
+    size_t N_bucket = 64;
+    while(N_bucket < 2*N)
+        N_bucket *= 2;
+
+    bucket_start.assign(N_bucket+1, 0);
+    sorted_index.resize(N);
+    particle_cell.resize(N);
+
+    // Counting sort by bucket
+    for(size_t k=0; k<N; ++k) {
+        particle_cell[k] = cell(particles[k].p);
+        bucket_start[bucket(particle_cell[k])+1]++;
+    }
+    for(size_t b=0; b<N_bucket; ++b)
+        bucket_start[b+1] += bucket_start[b];
+
+    std::vector<unsigned int> offset(bucket_start.begin(), bucket_start.end()-1);
+    for(size_t k=0; k<N; ++k)
+        sorted_index[offset[bucket(particle_cell[k])]++] = (unsigned int)k;
+}
+
+inline int spatial_grid::neighbor_buckets(grid_cell const& c, unsigned int buckets[27]) const
+{
+    int N_bucket = 0;
+    for(int dx=-1; dx<=1; ++dx) {
+        for(int dy=-1; dy<=1; ++dy) {
+            for(int dz=-1; dz<=1; ++dz) {
+                unsigned int const b = bucket({c.x+dx, c.y+dy, c.z+dz});
+
+                // Two neighboring cells may hash to the same bucket: only keep it once
+                bool already_added = false;
+                for(int k=0; k<N_bucket && !already_added; ++k)
+                    already_added = (buckets[k]==b);
+                if(!already_added)
+                    buckets[N_bucket++] = b;
+            }
+        }
+    }
+    return N_bucket;
+}
+
+inline void spatial_grid::box_buckets(vcl::vec3 const& p_min, vcl::vec3 const& p_max, std::vector<unsigned int>& buckets) const
+{
+    grid_cell const c_min = cell(p_min);
+    grid_cell const c_max = cell(p_max);
+    buckets.clear();
+    for(int x=c_min.x; x<=c_max.x; ++x)
+        for(int y=c_min.y; y<=c_max.y; ++y)
+            for(int z=c_min.z; z<=c_max.z; ++z)
+                buckets.push_back(bucket({x, y, z}));
+    std::sort(buckets.begin(), buckets.end());
+    buckets.erase(std::unique(buckets.begin(), buckets.end()), buckets.end());
+}
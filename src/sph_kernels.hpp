@@ -0,0 +1,145 @@
+#pragma once
+
+#include <cmath>
+
+// SPH smoothing kernels with support radius h
+//  The normalization constants only depend on h: they are computed once by the constructor.
+//  Kernels are evaluated from the squared distance r2 < h*h between the two particles. The distance r = sqrt(r2)
+//  is only read when the kernel has needs_distance = true, so that the callers can skip the square root otherwise.
+//    value(r2, r)      W(r)
+//    gradient(r2, r)   g such that grad W(p_i-p_j) = g (p_i-p_j)
+//    laplacian(r2, r)  Laplacian of W
+
+namespace sph_kernel_detail
+{
+    constexpr float pi = 3.14159265f;
+    constexpr float power(float x, int n) { return n==0 ? 1.0f : x*power(x, n-1); }
+}
+
+// Poly6 [Muller et al. 2003], smooth at the origin: used for the density
+struct sph_kernel_poly6
+{
+    static constexpr bool needs_distance = false;
+
+    float h2;
+    float c; // 315/(64 pi h^9)
+
+    explicit sph_kernel_poly6(float h) : h2(h*h), c(315.0f/(64.0f*sph_kernel_detail::pi*sph_kernel_detail::power(h,9))) {}
+
+    float value(float r2, float) const { float const d = h2-r2; return c*d*d*d; }
+    float gradient(float r2, float) const { float const d = h2-r2; return -6*c*d*d; }
+    float laplacian(float r2, float) const { float const d = h2-r2; return -6*c*d*(3*h2-7*r2); }
+};
+
+// Spiky [Muller et al. 2003], non vanishing gradient at the origin: used for the pressure
+struct sph_kernel_spiky
+{
+    static constexpr bool needs_distance = true;
+
+    float h;
+    float c; // 15/(pi h^6)
+
+    explicit sph_kernel_spiky(float h_arg) : h(h_arg), c(15.0f/(sph_kernel_detail::pi*sph_kernel_detail::power(h_arg,6))) {}
+
+    float value(float, float r) const { float const d = h-r; return c*d*d*d; }
+    float gradient(float, float r) const { float const d = h-r; return -3*c*d*d/r; }
+    float laplacian(float, float r) const { float const d = h-r; return 6*c*d*(1-d/r); }
+};
+
+// Viscosity [Muller et al. 2003], positive Laplacian: used for the viscosity
+struct sph_kernel_viscosity
+{
+    static constexpr bool needs_distance = true;
+
+    float h, inv_h2, inv_h3;
+    float c;           // 15/(2 pi h^3)
+    float c_laplacian; // 45/(pi h^6)
+
+    explicit sph_kernel_viscosity(float h_arg)
+        :h(h_arg), inv_h2(1/(h_arg*h_arg)), inv_h3(1/(h_arg*h_arg*h_arg)),
+         c(15.0f/(2*sph_kernel_detail::pi*sph_kernel_detail::power(h_arg,3))),
+         c_laplacian(45.0f/(sph_kernel_detail::pi*sph_kernel_detail::power(h_arg,6))) {}
+
+    float value(float r2, float r) const { return c*(-r2*r*inv_h3/2 + r2*inv_h2 + h/(2*r) - 1); }
+    float gradient(float r2, float r) const { return c*(-3*r*inv_h3/2 + 2*inv_h2 - h/(2*r2*r)); }
+    float laplacian(float, float r) const { return c_laplacian*(h-r); }
+};
+
+// Cubic spline [Monaghan 1992], rescaled to a support of h
+struct sph_kernel_cubic_spline
+{
+    static constexpr bool needs_distance = true;
+
+    float inv_h, inv_h2;
+    float c; // 8/(pi h^3)
+
+    explicit sph_kernel_cubic_spline(float h) : inv_h(1/h), inv_h2(1/(h*h)), c(8.0f/(sph_kernel_detail::pi*sph_kernel_detail::power(h,3))) {}
+
+    float value(float, float r) const
+    {
+        float const q = r*inv_h;
+        if(q <= 0.5f)
+            return c*(6*q*q*(q-1)+1);
+        float const d = 1-q;
+        return 2*c*d*d*d;
+    }
+    float gradient(float, float r) const
+    {
+        float const q = r*inv_h;
+        if(q <= 0.5f)
+            return 6*c*inv_h2*(3*q-2);
+        float const d = 1-q;
+        return -6*c*inv_h2*d*d/q;
+    }
+    float laplacian(float, float r) const
+    {
+        float const q = r*inv_h;
+        if(q <= 0.5f)
+            return 36*c*inv_h2*(2*q-1);
+        float const d = 1-q;
+        return 12*c*inv_h2*d*(2*q-1)/q;
+    }
+};
+
+// Wendland C2 [Wendland 1995], no pairing instability at large neighbor counts
+struct sph_kernel_wendland
+{
+    static constexpr bool needs_distance = true;
+
+    float inv_h, inv_h2;
+    float c; // 21/(2 pi h^3)
+
+    explicit sph_kernel_wendland(float h) : inv_h(1/h), inv_h2(1/(h*h)), c(21.0f/(2*sph_kernel_detail::pi*sph_kernel_detail::power(h,3))) {}
+
+    float value(float, float r) const { float const q = r*inv_h, d = 1-q; return c*d*d*d*d*(1+4*q); }
+    float gradient(float, float r) const { float const d = 1-r*inv_h; return -20*c*inv_h2*d*d*d; }
+    float laplacian(float, float r) const { float const q = r*inv_h, d = 1-q; return -60*c*inv_h2*d*d*(1-2*q); }
+};
+
+
+// Kernels used for the density, the pressure gradient and the viscosity Laplacian
+template <typename density_kernel, typename pressure_kernel, typename viscosity_kernel>
+struct sph_kernel_set
+{
+    // Whether the distance has to be computed for each neighbor in the density and in the force loops
+    static constexpr bool density_needs_distance = density_kernel::needs_distance;
+    static constexpr bool force_needs_distance = pressure_kernel::needs_distance || viscosity_kernel::needs_distance;
+
+    float h, h2;
+    density_kernel density;
+    pressure_kernel pressure;
+    viscosity_kernel viscosity;
+
+    explicit sph_kernel_set(float h_arg) : h(h_arg), h2(h_arg*h_arg), density(h_arg), pressure(h_arg), viscosity(h_arg) {}
+};
+
+typedef sph_kernel_set<sph_kernel_poly6, sph_kernel_spiky, sph_kernel_viscosity> sph_kernels_muller;
+typedef sph_kernel_set<sph_kernel_cubic_spline, sph_kernel_cubic_spline, sph_kernel_viscosity> sph_kernels_cubic_spline;
+typedef sph_kernel_set<sph_kernel_wendland, sph_kernel_wendland, sph_kernel_viscosity> sph_kernels_wendland;
+
+// Kernels of the simulation, selected at compile time (e.g. -DSPH_KERNELS=sph_kernels_wendland)
+// The SIMD loops implement sph_kernels_muller, the other sets use the reference loops.
+#ifndef SPH_KERNELS
+#define SPH_KERNELS sph_kernels_muller
+#endif
+typedef SPH_KERNELS sph_kernels;
@@ -0,0 +1,448 @@
+#include "sph_simd.hpp"
+#include "thread_pool.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define SPH_SIMD_X86
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
+// AVX2 functions are compiled with the avx2 target only, the rest of the program keeps the default instruction set
+#if defined(SPH_SIMD_X86) && (defined(__GNUC__) || defined(__clang__))
+#define SPH_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define SPH_TARGET_AVX2
+#endif
+
+
+static bool cpu_supports_avx2()
+{
+#if defined(SPH_SIMD_X86) && (defined(__GNUC__) || defined(__clang__))
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#elif defined(SPH_SIMD_X86) && defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 1);
+    bool const os_uses_xsave = (info[2] & (1<<27)) != 0;
+    bool const has_avx = (info[2] & (1<<28)) != 0;
+    if(!os_uses_xsave || !has_avx || (_xgetbv(0) & 6) != 6)
+        return false;
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1<<5)) != 0;
+#else
+    return false;
+#endif
+}
+
+sph_kernel_isa sph_kernel_isa_resolve(sph_kernel_isa isa)
+{
+    static bool const has_avx2 = cpu_supports_avx2();
+#ifdef SPH_SIMD_X86
+    bool const has_sse = true; // SSE2 is part of x86-64
+#else
+    bool const has_sse = false;
+#endif
+
+    if(isa==sph_kernel_isa::automatic)
+        return has_avx2 ? sph_kernel_isa::avx2 : (has_sse ? sph_kernel_isa::sse : sph_kernel_isa::scalar);
+    if(isa==sph_kernel_isa::avx2 && !has_avx2)
+        return has_sse ? sph_kernel_isa::sse : sph_kernel_isa::scalar;
+    if(isa==sph_kernel_isa::sse && !has_sse)
+        return sph_kernel_isa::scalar;
+    return isa;
+}
+
+char const* sph_kernel_isa_name(sph_kernel_isa isa)
+{
+    switch(isa) {
+    case sph_kernel_isa::automatic: return "automatic";
+    case sph_kernel_isa::reference: return "reference";
+    case sph_kernel_isa::scalar: return "scalar";
+    case sph_kernel_isa::sse: return "sse";
+    case sph_kernel_isa::avx2: return "avx2";
+    }
+    return "unknown";
+}
+
+sph_kernel_constants sph_kernel_constants_compute(sph_kernels_muller const& kernels, float m, float nu)
+{
+    sph_kernel_constants k;
+    k.h = kernels.h;
+    k.h2 = kernels.h2;
+    k.m = m;
+    k.nu = nu;
+    k.poly6 = kernels.density.c;
+    k.spiky = 3*kernels.pressure.c;
+    k.viscosity = kernels.viscosity.c_laplacian;
+    return k;
+}
+
+
+// Contiguous ranges [begin,end) of particles stored in the non-empty buckets around particle s (in grid order)
+//  (Plain loops over these ranges rather than lambdas: lambdas would not inherit the avx2 target of the calling function.)
+static int neighbor_ranges(spatial_grid const& grid, size_t s, unsigned int begin[27], unsigned int end[27])
+{
+    unsigned int buckets[27];
+    int const N_bucket = grid.neighbor_buckets(grid.particle_cell[grid.sorted_index[s]], buckets);
+    int N_range = 0;
+    for(int b=0; b<N_bucket; ++b) {
+        begin[N_range] = grid.bucket_start[buckets[b]];
+        end[N_range] = grid.bucket_start[buckets[b]+1];
+        if(begin[N_range]<end[N_range])
+            N_range++;
+    }
+    return N_range;
+}
+
+// Sum of the neighbor terms of the force on particle i:
+//  pressure term = sum_j (P_i+P_j) (h-r)^2 / (r rho_j) (p_i-p_j)
+//  viscosity term = sum_j (h-r) / rho_j (v_j-v_i)
+// The constant factors are applied once per particle in finalize_force.
+struct force_sum
+{
+    float px = 0, py = 0, pz = 0;
+    float vx = 0, vy = 0, vz = 0;
+};
+
+static void finalize_force(sph_particles_soa& soa, size_t i, force_sum const& s, sph_kernel_constants const& k)
+{
+    // Same expression as update_force: f = m g + (f_pressure + f_viscosity)/20
+    float const c_pressure = k.m * k.spiky / (2 * soa.rho[i]);
+    float const c_viscosity = k.nu * k.m * k.m * k.viscosity;
+    soa.fx[i] = (c_pressure*s.px + c_viscosity*s.vx) / 20;
+    soa.fy[i] = (c_pressure*s.py + c_viscosity*s.vy) / 20;
+    soa.fz[i] = k.m * -9.81f + (c_pressure*s.pz + c_viscosity*s.vz) / 20;
+}
+
+
+// Scalar implementation
+
+static void update_density_scalar(sph_particles_soa& soa, spatial_grid const& grid, sph_kernel_constants const& k, size_t i_begin, size_t i_end)
+{
+    unsigned int range_begin[27], range_end[27];
+    for(size_t i=i_begin; i<i_end; ++i) {
+        float sum = 0.0f;
+        int const N_range = neighbor_ranges(grid, i, range_begin, range_end);
+        for(int b=0; b<N_range; ++b) {
+            unsigned int const begin = range_begin[b], end = range_end[b];
+            for(unsigned int j=begin; j<end; ++j) {
+                float const dx = soa.x[i]-soa.x[j], dy = soa.y[i]-soa.y[j], dz = soa.z[i]-soa.z[j];
+                float const r2 = dx*dx + dy*dy + dz*dz;
+                if(r2 < k.h2) {
+                    float const q = k.h2 - r2;
+                    sum += q*q*q;
+                }
+            }
+        }
+        soa.rho[i] = k.m * k.poly6 * sum;
+    }
+}
+
+static void update_force_scalar(sph_particles_soa& soa, spatial_grid const& grid, sph_kernel_constants const& k, size_t i_begin, size_t i_end)
+{
+    unsigned int range_begin[27], range_end[27];
+    for(size_t i=i_begin; i<i_end; ++i) {
+        force_sum s;
+        int const N_range = neighbor_ranges(grid, i, range_begin, range_end);
+        for(int b=0; b<N_range; ++b) {
+            unsigned int const begin = range_begin[b], end = range_end[b];
+            for(unsigned int j=begin; j<end; ++j) {
+                float const dx = soa.x[i]-soa.x[j], dy = soa.y[i]-soa.y[j], dz = soa.z[i]-soa.z[j];
+                float const r2 = dx*dx + dy*dy + dz*dz;
+                if(r2 < k.h2 && r2 > 0) {
+                    float const r = std::sqrt(r2);
+                    float const hr = k.h - r;
+                    float const c_pressure = (soa.pressure[i]+soa.pressure[j]) * hr*hr / (r*soa.rho[j]);
+                    float const c_viscosity = hr / soa.rho[j];
+                    s.px += c_pressure*dx; s.py += c_pressure*dy; s.pz += c_pressure*dz;
+                    s.vx += c_viscosity*(soa.vx[j]-soa.vx[i]);
+                    s.vy += c_viscosity*(soa.vy[j]-soa.vy[i]);
+                    s.vz += c_viscosity*(soa.vz[j]-soa.vz[i]);
+                }
+            }
+        }
+        finalize_force(soa, i, s, k);
+    }
+}
+
+
+#ifdef SPH_SIMD_X86
+
+// SSE implementation: 4 neighbors at a time
+//  Ranges are processed with aligned loads starting at begin rounded down to 4, lanes outside [begin,end) are masked out.
+
+static inline float horizontal_sum(__m128 a)
+{
+    __m128 const shuffled = _mm_shuffle_ps(a, a, _MM_SHUFFLE(2,3,0,1));
+    __m128 const sums = _mm_add_ps(a, shuffled);
+    return _mm_cvtss_f32(_mm_add_ss(sums, _mm_movehl_ps(shuffled, sums)));
+}
+
+static inline __m128 lane_mask_sse(unsigned int j, unsigned int begin, unsigned int end)
+{
+    __m128i const index = _mm_add_epi32(_mm_set1_epi32(int(j)), _mm_setr_epi32(0,1,2,3));
+    __m128i const after_begin = _mm_cmpgt_epi32(index, _mm_set1_epi32(int(begin)-1));
+    __m128i const before_end = _mm_cmplt_epi32(index, _mm_set1_epi32(int(end)));
+    return _mm_castsi128_ps(_mm_and_si128(after_begin, before_end));
+}
+
+static void update_density_sse(sph_particles_soa& soa, spatial_grid const& grid, sph_kernel_constants const& k, size_t i_begin, size_t i_end)
+{
+    __m128 const h2 = _mm_set1_ps(k.h2);
+    unsigned int range_begin[27], range_end[27];
+    for(size_t i=i_begin; i<i_end; ++i) {
+        __m128 const xi = _mm_set1_ps(soa.x[i]), yi = _mm_set1_ps(soa.y[i]), zi = _mm_set1_ps(soa.z[i]);
+        __m128 sum = _mm_setzero_ps();
+        int const N_range = neighbor_ranges(grid, i, range_begin, range_end);
+        for(int b=0; b<N_range; ++b) {
+            unsigned int const begin = range_begin[b], end = range_end[b];
+            for(unsigned int j=begin&~3u; j<end; j+=4) {
+                __m128 const dx = _mm_sub_ps(xi, _mm_load_ps(&soa.x[j]));
+                __m128 const dy = _mm_sub_ps(yi, _mm_load_ps(&soa.y[j]));
+                __m128 const dz = _mm_sub_ps(zi, _mm_load_ps(&soa.z[j]));
+                __m128 const r2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx,dx), _mm_mul_ps(dy,dy)), _mm_mul_ps(dz,dz));
+                __m128 const mask = _mm_and_ps(lane_mask_sse(j, begin, end), _mm_cmplt_ps(r2, h2));
+                __m128 const q = _mm_sub_ps(h2, r2);
+                sum = _mm_add_ps(sum, _mm_and_ps(mask, _mm_mul_ps(_mm_mul_ps(q,q), q)));
+            }
+        }
+        soa.rho[i] = k.m * k.poly6 * horizontal_sum(sum);
+    }
+}
+
+static void update_force_sse(sph_particles_soa& soa, spatial_grid const& grid, sph_kernel_constants const& k, size_t i_begin, size_t i_end)
+{
+    __m128 const h = _mm_set1_ps(k.h), h2 = _mm_set1_ps(k.h2);
+    __m128 const zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f);
+    unsigned int range_begin[27], range_end[27];
+    for(size_t i=i_begin; i<i_end; ++i) {
+        __m128 const xi = _mm_set1_ps(soa.x[i]), yi = _mm_set1_ps(soa.y[i]), zi = _mm_set1_ps(soa.z[i]);
+        __m128 const vxi = _mm_set1_ps(soa.vx[i]), vyi = _mm_set1_ps(soa.vy[i]), vzi = _mm_set1_ps(soa.vz[i]);
+        __m128 const pressure_i = _mm_set1_ps(soa.pressure[i]);
+        __m128 px = zero, py = zero, pz = zero, vx = zero, vy = zero, vz = zero;
+        int const N_range = neighbor_ranges(grid, i, range_begin, range_end);
+        for(int b=0; b<N_range; ++b) {
+            unsigned int const begin = range_begin[b], end = range_end[b];
+            for(unsigned int j=begin&~3u; j<end; j+=4) {
+                __m128 const dx = _mm_sub_ps(xi, _mm_load_ps(&soa.x[j]));
+                __m128 const dy = _mm_sub_ps(yi, _mm_load_ps(&soa.y[j]));
+                __m128 const dz = _mm_sub_ps(zi, _mm_load_ps(&soa.z[j]));
+                __m128 const r2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx,dx), _mm_mul_ps(dy,dy)), _mm_mul_ps(dz,dz));
+                __m128 const mask = _mm_and_ps(lane_mask_sse(j, begin, end), _mm_and_ps(_mm_cmplt_ps(r2, h2), _mm_cmpgt_ps(r2, zero)));
+                if(_mm_movemask_ps(mask)==0)
+                    continue;
+
+                __m128 const r = _mm_sqrt_ps(r2);
+                __m128 const hr = _mm_sub_ps(h, r);
+                __m128 const inv_rho_j = _mm_div_ps(one, _mm_load_ps(&soa.rho[j]));
+                __m128 const c_pressure = _mm_and_ps(mask, _mm_div_ps(_mm_mul_ps(_mm_mul_ps(_mm_add_ps(pressure_i, _mm_load_ps(&soa.pressure[j])), _mm_mul_ps(hr,hr)), inv_rho_j), r));
+                __m128 const c_viscosity = _mm_and_ps(mask, _mm_mul_ps(hr, inv_rho_j));
+
+                px = _mm_add_ps(px, _mm_mul_ps(c_pressure, dx));
+                py = _mm_add_ps(py, _mm_mul_ps(c_pressure, dy));
+                pz = _mm_add_ps(pz, _mm_mul_ps(c_pressure, dz));
+                vx = _mm_add_ps(vx, _mm_mul_ps(c_viscosity, _mm_sub_ps(_mm_load_ps(&soa.vx[j]), vxi)));
+                vy = _mm_add_ps(vy, _mm_mul_ps(c_viscosity, _mm_sub_ps(_mm_load_ps(&soa.vy[j]), vyi)));
+                vz = _mm_add_ps(vz, _mm_mul_ps(c_viscosity, _mm_sub_ps(_mm_load_ps(&soa.vz[j]), vzi)));
+            }
+        }
+
+        force_sum s;
+        s.px = horizontal_sum(px); s.py = horizontal_sum(py); s.pz = horizontal_sum(pz);
+        s.vx = horizontal_sum(vx); s.vy = horizontal_sum(vy); s.vz = horizontal_sum(vz);
+        finalize_force(soa, i, s, k);
+    }
+}
+
+
+// AVX2 implementation: 8 neighbors at a time, same structure as the SSE one
+
+SPH_TARGET_AVX2 static inline float horizontal_sum(__m256 a)
+{
+    return horizontal_sum(_mm_add_ps(_mm256_castps256_ps128(a), _mm256_extractf128_ps(a, 1)));
+}
+
+SPH_TARGET_AVX2 static inline __m256 lane_mask_avx2(unsigned int j, unsigned int begin, unsigned int end)
+{
+    __m256i const index = _mm256_add_epi32(_mm256_set1_epi32(int(j)), _mm256_setr_epi32(0,1,2,3,4,5,6,7));
+    __m256i const after_begin = _mm256_cmpgt_epi32(index, _mm256_set1_epi32(int(begin)-1));
+    __m256i const before_end = _mm256_cmpgt_epi32(_mm256_set1_epi32(int(end)), index);
+    return _mm256_castsi256_ps(_mm256_and_si256(after_begin, before_end));
+}
+
+SPH_TARGET_AVX2 static void update_density_avx2(sph_particles_soa& soa, spatial_grid const& grid, sph_kernel_constants const& k, size_t i_begin, size_t i_end)
+{
+    __m256 const h2 = _mm256_set1_ps(k.h2);
+    unsigned int range_begin[27], range_end[27];
+    for(size_t i=i_begin; i<i_end; ++i) {
+        __m256 const xi = _mm256_set1_ps(soa.x[i]), yi = _mm256_set1_ps(soa.y[i]), zi = _mm256_set1_ps(soa.z[i]);
+        __m256 sum = _mm256_setzero_ps();
+        int const N_range = neighbor_ranges(grid, i, range_begin, range_end);
+        for(int b=0; b<N_range; ++b) {
+            unsigned int const begin = range_begin[b], end = range_end[b];
+            for(unsigned int j=begin&~7u; j<end; j+=8) {
+                __m256 const dx = _mm256_sub_ps(xi, _mm256_load_ps(&soa.x[j]));
+                __m256 const dy = _mm256_sub_ps(yi, _mm256_load_ps(&soa.y[j]));
+                __m256 const dz = _mm256_sub_ps(zi, _mm256_load_ps(&soa.z[j]));
+                __m256 const r2 = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx,dx), _mm256_mul_ps(dy,dy)), _mm256_mul_ps(dz,dz));
+                __m256 const mask = _mm256_and_ps(lane_mask_avx2(j, begin, end), _mm256_cmp_ps(r2, h2, _CMP_LT_OQ));
+                __m256 const q = _mm256_sub_ps(h2, r2);
+                sum = _mm256_add_ps(sum, _mm256_and_ps(mask, _mm256_mul_ps(_mm256_mul_ps(q,q), q)));
+            }
+        }
+        soa.rho[i] = k.m * k.poly6 * horizontal_sum(sum);
+    }
+}
+
+SPH_TARGET_AVX2 static void update_force_avx2(sph_particles_soa& soa, spatial_grid const& grid, sph_kernel_constants const& k, size_t i_begin, size_t i_end)
+{
+    __m256 const h = _mm256_set1_ps(k.h), h2 = _mm256_set1_ps(k.h2);
+    __m256 const zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1.0f);
+    unsigned int range_begin[27], range_end[27];
+    for(size_t i=i_begin; i<i_end; ++i) {
+        __m256 const xi = _mm256_set1_ps(soa.x[i]), yi = _mm256_set1_ps(soa.y[i]), zi = _mm256_set1_ps(soa.z[i]);
+        __m256 const vxi = _mm256_set1_ps(soa.vx[i]), vyi = _mm256_set1_ps(soa.vy[i]), vzi = _mm256_set1_ps(soa.vz[i]);
+        __m256 const pressure_i = _mm256_set1_ps(soa.pressure[i]);
+        __m256 px = zero, py = zero, pz = zero, vx = zero, vy = zero, vz = zero;
+        int const N_range = neighbor_ranges(grid, i, range_begin, range_end);
+        for(int b=0; b<N_range; ++b) {
+            unsigned int const begin = range_begin[b], end = range_end[b];
+            for(unsigned int j=begin&~7u; j<end; j+=8) {
+                __m256 const dx = _mm256_sub_ps(xi, _mm256_load_ps(&soa.x[j]));
+                __m256 const dy = _mm256_sub_ps(yi, _mm256_load_ps(&soa.y[j]));
+                __m256 const dz = _mm256_sub_ps(zi, _mm256_load_ps(&soa.z[j]));
+                __m256 const r2 = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx,dx), _mm256_mul_ps(dy,dy)), _mm256_mul_ps(dz,dz));
+                __m256 const mask = _mm256_and_ps(lane_mask_avx2(j, begin, end), _mm256_and_ps(_mm256_cmp_ps(r2, h2, _CMP_LT_OQ), _mm256_cmp_ps(r2, zero, _CMP_GT_OQ)));
+                if(_mm256_movemask_ps(mask)==0)
+                    continue;
+
+                __m256 const r = _mm256_sqrt_ps(r2);
+                __m256 const hr = _mm256_sub_ps(h, r);
+                __m256 const inv_rho_j = _mm256_div_ps(one, _mm256_load_ps(&soa.rho[j]));
+                __m256 const c_pressure = _mm256_and_ps(mask, _mm256_div_ps(_mm256_mul_ps(_mm256_mul_ps(_mm256_add_ps(pressure_i, _mm256_load_ps(&soa.pressure[j])), _mm256_mul_ps(hr,hr)), inv_rho_j), r));
+                __m256 const c_viscosity = _mm256_and_ps(mask, _mm256_mul_ps(hr, inv_rho_j));
+
+                px = _mm256_add_ps(px, _mm256_mul_ps(c_pressure, dx));
+                py = _mm256_add_ps(py, _mm256_mul_ps(c_pressure, dy));
+                pz = _mm256_add_ps(pz, _mm256_mul_ps(c_pressure, dz));
+                vx = _mm256_add_ps(vx, _mm256_mul_ps(c_viscosity, _mm256_sub_ps(_mm256_load_ps(&soa.vx[j]), vxi)));
+                vy = _mm256_add_ps(vy, _mm256_mul_ps(c_viscosity, _mm256_sub_ps(_mm256_load_ps(&soa.vy[j]), vyi)));
+                vz = _mm256_add_ps(vz, _mm256_mul_ps(c_viscosity, _mm256_sub_ps(_mm256_load_ps(&soa.vz[j]), vzi)));
+            }
+        }
+
+        force_sum s;
+        s.px = horizontal_sum(px); s.py = horizontal_sum(py); s.pz = horizontal_sum(pz);
+        s.vx = horizontal_sum(vx); s.vy = horizontal_sum(vy); s.vz = horizontal_sum(vz);
+        finalize_force(soa, i, s, k);
+    }
+}
+
+#endif
+
+
+// Number of particles handled by one task of the thread pool
+static size_t const grain = 256;
+
+void sph_update_density_soa(sph_particles_soa& soa, spatial_grid const& grid, sph_kernel_constants const& k, sph_kernel_isa isa, size_t begin, size_t end)
+{
+#ifdef SPH_SIMD_X86
+    if(isa==sph_kernel_isa::avx2)
+        return update_density_avx2(soa, grid, k, begin, end);
+    if(isa==sph_kernel_isa::sse)
+        return update_density_sse(soa, grid, k, begin, end);
+#endif
+    update_density_scalar(soa, grid, k, begin, end);
+}
+
+void sph_update_force_soa(sph_particles_soa& soa, spatial_grid const& grid, sph_kernel_constants const& k, sph_kernel_isa isa, size_t begin, size_t end)
+{
+#ifdef SPH_SIMD_X86
+    if(isa==sph_kernel_isa::avx2)
+        return update_force_avx2(soa, grid, k, begin, end);
+    if(isa==sph_kernel_isa::sse)
+        return update_force_sse(soa, grid, k, begin, end);
+#endif
+    update_force_scalar(soa, grid, k, begin, end);
+}
+
+void sph_update_density_soa(sph_particles_soa& soa, spatial_grid const& grid, sph_kernel_constants const& k, sph_kernel_isa isa)
+{
+    thread_pool::global().parallel_for(soa.size(), grain, [&](size_t begin, size_t end, size_t) {
+        sph_update_density_soa(soa, grid, k, isa, begin, end);
+    });
+}
+
+void sph_update_force_soa(sph_particles_soa& soa, spatial_grid const& grid, sph_kernel_constants const& k, sph_kernel_isa isa)
+{
+    thread_pool::global().parallel_for(soa.size(), grain, [&](size_t begin, size_t end, size_t) {
+        sph_update_force_soa(soa, grid, k, isa, begin, end);
+    });
+}
+
+
+// Symmetric version: every pair (i,j) with i<j is evaluated once and applied to both particles.
+//  pressure: the term (P_i+P_j) (h-r)^2 / (r rho_i rho_j) (p_i-p_j) is antisymmetric
+//  viscosity: the kernel term (h-r) (v_j-v_i) is antisymmetric, it is divided by rho_j for i and by rho_i for j
+// Each thread accumulates in its own buffers, which are summed once all the pairs are done.
+void sph_update_force_soa_symmetric(sph_particles_soa& soa, spatial_grid const& grid, sph_kernel_constants const& k, sph_force_buffers& buffers)
+{
+    thread_pool& pool = thread_pool::global();
+    size_t const N = soa.size();
+    size_t const N_thread = pool.thread_count();
+    buffers.pressure.resize(N_thread);
+    buffers.viscosity.resize(N_thread);
+    for(size_t t=0; t<N_thread; ++t) {
+        buffers.pressure[t].assign(3*N, 0.0f);
+        buffers.viscosity[t].assign(3*N, 0.0f);
+    }
+
+    pool.parallel_for(N, grain, [&](size_t i_begin, size_t i_end, size_t thread) {
+        float* const fp = buffers.pressure[thread].data();
+        float* const fv = buffers.viscosity[thread].data();
+        unsigned int range_begin[27], range_end[27];
+        for(size_t i=i_begin; i<i_end; ++i) {
+            int const N_range = neighbor_ranges(grid, i, range_begin, range_end);
+            for(int b=0; b<N_range; ++b) {
+                for(unsigned int j=std::max<unsigned int>(range_begin[b], (unsigned int)(i+1)); j<range_end[b]; ++j) {
+                    float const dx = soa.x[i]-soa.x[j], dy = soa.y[i]-soa.y[j], dz = soa.z[i]-soa.z[j];
+                    float const r2 = dx*dx + dy*dy + dz*dz;
+                    if(r2 < k.h2 && r2 > 0) {
+                        float const r = std::sqrt(r2);
+                        float const hr = k.h - r;
+                        float const c_pressure = (soa.pressure[i]+soa.pressure[j]) * hr*hr / (r*soa.rho[i]*soa.rho[j]);
+                        float const wx = hr*(soa.vx[j]-soa.vx[i]), wy = hr*(soa.vy[j]-soa.vy[i]), wz = hr*(soa.vz[j]-soa.vz[i]);
+                        float const inv_rho_i = 1.0f/soa.rho[i], inv_rho_j = 1.0f/soa.rho[j];
+
+                        fp[3*i] += c_pressure*dx; fp[3*i+1] += c_pressure*dy; fp[3*i+2] += c_pressure*dz;
+                        fp[3*j] -= c_pressure*dx; fp[3*j+1] -= c_pressure*dy; fp[3*j+2] -= c_pressure*dz;
+                        fv[3*i] += wx*inv_rho_j; fv[3*i+1] += wy*inv_rho_j; fv[3*i+2] += wz*inv_rho_j;
+                        fv[3*j] -= wx*inv_rho_i; fv[3*j+1] -= wy*inv_rho_i; fv[3*j+2] -= wz*inv_rho_i;
+                    }
+                }
+            }
+        }
+    });
+
+    float const c_pressure = k.m * k.spiky / 2;
+    float const c_viscosity = k.nu * k.m * k.m * k.viscosity;
+    pool.parallel_for(N, grain, [&](size_t i_begin, size_t i_end, size_t) {
+        for(size_t i=i_begin; i<i_end; ++i) {
+            float p[3] = {0,0,0}, v[3] = {0,0,0};
+            for(size_t t=0; t<N_thread; ++t) {
+                for(int d=0; d<3; ++d) {
+                    p[d] += buffers.pressure[t][3*i+d];
+                    v[d] += buffers.viscosity[t][3*i+d];
+                }
+            }
+            soa.fx[i] = (c_pressure*p[0] + c_viscosity*v[0]) / 20;
+            soa.fy[i] = (c_pressure*p[1] + c_viscosity*v[1]) / 20;
+            soa.fz[i] = k.m * -9.81f + (c_pressure*p[2] + c_viscosity*v[2]) / 20;
+        }
+    });
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include "spatial_grid.hpp"
+#include "sph_soa.hpp"
+#include "sph_kernels.hpp"
+
+// Implementation used for the SPH density and force loops
+enum class sph_kernel_isa
+{
+    automatic, // Best one supported by the CPU (avx2, then sse, then scalar)
+    reference, // Original loops on the array of sph_particle_element
+    scalar,    // Structure of arrays, one neighbor at a time
+    sse,       // Structure of arrays, 4 neighbors at a time
+    avx2       // Structure of arrays, 8 neighbors at a time
+};
+
+// Resolve automatic to the best implementation available on this CPU
+sph_kernel_isa sph_kernel_isa_resolve(sph_kernel_isa isa);
+char const* sph_kernel_isa_name(sph_kernel_isa isa);
+
+// Kernel constants shared by all implementations
+struct sph_kernel_constants
+{
+    float h, h2;
+    float m;
+    float nu;
+    float poly6;      // 315/(64 pi h^9)
+    float spiky;      // 45/(pi h^6), opposite of the gradient factor of the spiky kernel
+    float viscosity;  // 45/(pi h^6), factor of the Laplacian of the viscosity kernel
+};
+sph_kernel_constants sph_kernel_constants_compute(sph_kernels_muller const& kernels, float m, float nu);
+
+// The SIMD loops implement sph_kernels_muller: other kernel sets return nullptr and use the reference loops
+inline sph_kernels_muller const* sph_simd_kernels(sph_kernels_muller const& kernels) { return &kernels; }
+template <typename kernels_type> sph_kernels_muller const* sph_simd_kernels(kernels_type const&) { return nullptr; }
+
+// The loops below are run in parallel on thread_pool::global()
+// The particles of soa are stored in the grid order: the particles of bucket b are soa[grid.bucket_start[b]] ... soa[grid.bucket_start[b+1]-1]
+// isa must be resolved (not automatic, not reference)
+void sph_update_density_soa(sph_particles_soa& soa, spatial_grid const& grid, sph_kernel_constants const& k, sph_kernel_isa isa);
+void sph_update_force_soa(sph_particles_soa& soa, spatial_grid const& grid, sph_kernel_constants const& k, sph_kernel_isa isa);
+// Same loops on the particles begin ... end-1 of soa only, on the calling thread (the caller builds its own parallel loop)
+void sph_update_density_soa(sph_particles_soa& soa, spatial_grid const& grid, sph_kernel_constants const& k, sph_kernel_isa isa, size_t begin, size_t end);
+void sph_update_force_soa(sph_particles_soa& soa, spatial_grid const& grid, sph_kernel_constants const& k, sph_kernel_isa isa, size_t begin, size_t end);
+
+// Per-thread accumulation buffers of the symmetric force computation (3 floats per particle)
+struct sph_force_buffers
+{
+    std::vector<std::vector<float> > pressure;
+    std::vector<std::vector<float> > viscosity;
+};
+// Same result as sph_update_force_soa, computing each pair once for both particles (scalar only)
+void sph_update_force_soa_symmetric(sph_particles_soa& soa, spatial_grid const& grid, sph_kernel_constants const& k, sph_force_buffers& buffers);
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <vector>
+
+// Allocator returning memory aligned on Alignment bytes (32 = one AVX register)
+template <typename T, size_t Alignment>
+struct aligned_allocator
+{
+    typedef T value_type;
+    template <typename U> struct rebind { typedef aligned_allocator<U, Alignment> other; };
+
+    aligned_allocator() {}
+    template <typename U> aligned_allocator(aligned_allocator<U, Alignment> const&) {}
+
+    T* allocate(size_t n)
+    {
+        // Over-allocate and store the original pointer just before the aligned block
+        void* const raw = std::malloc(n*sizeof(T) + Alignment + sizeof(void*));
+        if(raw == nullptr)
+            throw std::bad_alloc();
+        uintptr_t const aligned = (reinterpret_cast<uintptr_t>(raw) + sizeof(void*) + Alignment-1) & ~uintptr_t(Alignment-1);
+        reinterpret_cast<void**>(aligned)[-1] = raw;
+        return reinterpret_cast<T*>(aligned);
+    }
+    void deallocate(T* p, size_t)
+    {
+        if(p != nullptr)
+            std::free(reinterpret_cast<void**>(p)[-1]);
+    }
+};
+template <typename T, typename U, size_t A> bool operator==(aligned_allocator<T,A> const&, aligned_allocator<U,A> const&) { return true; }
+template <typename T, typename U, size_t A> bool operator!=(aligned_allocator<T,A> const&, aligned_allocator<U,A> const&) { return false; }
+
+template <typename T> using aligned_vector = std::vector<T, aligned_allocator<T, 32> >;
+
+
+// SPH particles stored as a structure of arrays (one array per coordinate)
+//  The arrays are padded with sph_particles_soa::padding extra elements so that vector loads never read past the end.
+struct sph_particles_soa
+{
+    static size_t const padding = 8;
+
+    aligned_vector<float> x, y, z;     // Position
+    aligned_vector<float> vx, vy, vz;  // Speed
+    aligned_vector<float> fx, fy, fz;  // Force
+    aligned_vector<float> rho;         // Density
+    aligned_vector<float> pressure;    // Pressure
+
+    size_t size() const { return N; }
+    void resize(size_t N_arg)
+    {
+        N = N_arg;
+        for(aligned_vector<float>* a : {&x, &y, &z, &vx, &vy, &vz, &fx, &fy, &fz, &rho, &pressure})
+            a->assign(N+padding, 0.0f);
+    }
+
+private:
+    size_t N = 0;
+};
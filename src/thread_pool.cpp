@@ -0,0 +1,128 @@
+#include "thread_pool.hpp"
+
+#include <algorithm>
+
+// Set on the worker threads to detect nested loops
+static thread_local bool inside_pool_thread = false;
+
+thread_pool& thread_pool::global()
+{
+    static thread_pool pool;
+    return pool;
+}
+
+thread_pool::thread_pool(size_t N_thread)
+    : next_chunk(0)
+{
+    set_thread_count(N_thread);
+}
+
+thread_pool::~thread_pool()
+{
+    stop_workers();
+}
+
+void thread_pool::set_thread_count(size_t N_thread)
+{
+    if(N_thread == 0)
+        N_thread = std::max(1u, std::thread::hardware_concurrency());
+
+    std::lock_guard<std::mutex> call_lock(call_mutex);
+    if(N_thread == thread_count())
+        return;
+    stop_workers();
+    start_workers(N_thread-1);
+}
+
+void thread_pool::start_workers(size_t N_worker)
+{
+    size_t current_generation;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = false;
+        current_generation = generation;
+    }
+    // The new workers wait for the next loop, not the one that already ended
+    for(size_t k=0; k<N_worker; ++k)
+        workers.push_back(std::thread(&thread_pool::worker_loop, this, k+1, current_generation));
+}
+
+void thread_pool::stop_workers()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+    }
+    wake.notify_all();
+    for(std::thread& worker : workers)
+        worker.join();
+    workers.clear();
+}
+
+void thread_pool::worker_loop(size_t thread, size_t seen_generation)
+{
+    inside_pool_thread = true;
+    while(true)
+    {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait(lock, [&]{ return stop || generation != seen_generation; });
+            if(stop)
+                return;
+            seen_generation = generation;
+        }
+
+        run_chunks(thread);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if(--active == 0)
+            done.notify_one();
+    }
+}
+
+void thread_pool::run_chunks(size_t thread)
+{
+    size_t const N_chunk = (job_size + job_grain-1) / job_grain;
+    for(size_t chunk = next_chunk++; chunk < N_chunk; chunk = next_chunk++) {
+        size_t const begin = chunk*job_grain;
+        (*job)(begin, std::min(begin+job_grain, job_size), thread);
+    }
+}
+
+void thread_pool::parallel_for(size_t N, size_t grain, std::function<void(size_t, size_t, size_t)> const& f)
+{
+    if(N == 0)
+        return;
+    grain = std::max<size_t>(grain, 1);
+    if(N <= grain || inside_pool_thread) {
+        f(0, N, 0);
+        return;
+    }
+
+    // The workers are only read under call_mutex: set_thread_count may be called from another thread
+    std::lock_guard<std::mutex> call_lock(call_mutex);
+    if(workers.empty()) {
+        inside_pool_thread = true;
+        f(0, N, 0);
+        inside_pool_thread = false;
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        job = &f;
+        job_size = N;
+        job_grain = grain;
+        next_chunk = 0;
+        active = workers.size();
+        generation++;
+    }
+    wake.notify_all();
+
+    inside_pool_thread = true;
+    run_chunks(0);
+    inside_pool_thread = false;
+
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [&]{ return active == 0; });
+    job = nullptr;
+}
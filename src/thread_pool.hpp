@@ -0,0 +1,53 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Pool of worker threads used to run parallel loops
+//  The calling thread takes part in the loop as thread 0, the workers are threads 1 ... thread_count()-1.
+//  A parallel_for called from inside a parallel_for runs serially on the calling thread.
+class thread_pool
+{
+public:
+    // Pool shared by the whole program (created with one thread per core)
+    static thread_pool& global();
+
+    explicit thread_pool(size_t N_thread = 0);
+    ~thread_pool();
+
+    // Number of threads taking part in a loop (0 = one per core)
+    //  Loops size their per-thread buffers from thread_count(): only change it from the thread running them, between two
+    //  loops (the simulation applies physics_settings::threads between its steps).
+    void set_thread_count(size_t N_thread);
+    size_t thread_count() const { return workers.size()+1; }
+
+    // Call f(begin, end, thread) on chunks of at most grain elements covering [0,N), returns once every chunk is done
+    void parallel_for(size_t N, size_t grain, std::function<void(size_t, size_t, size_t)> const& f);
+
+private:
+    void start_workers(size_t N_worker);
+    void stop_workers();
+    void worker_loop(size_t thread, size_t seen_generation);
+    void run_chunks(size_t thread);
+
+    std::vector<std::thread> workers;
+    std::mutex call_mutex; // Only one loop at a time uses the workers
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    size_t generation = 0;  // Incremented for every new loop
+    size_t active = 0;      // Workers still working on the current loop
+    bool stop = false;
+
+    // Current loop
+    std::function<void(size_t, size_t, size_t)> const* job = nullptr;
+    size_t job_size = 0;
+    size_t job_grain = 1;
+    std::atomic<size_t> next_chunk;
+};
@@ -0,0 +1,297 @@
+#include "triangle_bvh.hpp"
+
+#include <algorithm>
+#include <limits>
+
+using namespace vcl;
+
+// Defined in simulation.cpp
+void collision_sphere_plane(vcl::vec3& p, vcl::vec3& v, float r, vcl::vec3 const& n, vcl::vec3 const& p0);
+
+
+void triangles_append(std::vector<triangle>& triangles, mesh const& m, affine_rts const& transform)
+{
+    if(m.connectivity.size() > 0)
+        triangles_append(triangles, &m.position[0], &m.connectivity[0], m.connectivity.size(), transform);
+}
+
+void triangles_append(std::vector<triangle>& triangles, vec3 const* position, uint3 const* connectivity, size_t N_triangle, affine_rts const& transform)
+{
+    for(size_t k=0; k<N_triangle; ++k) {
+        uint3 const& f = connectivity[k];
+        vec3 p[3];
+        for(int i=0; i<3; ++i)
+            p[i] = transform.translate + transform.rotate * (transform.scale * position[f[i]]);
+        triangles.push_back({p[0], p[1], p[2]});
+    }
+}
+
+// [Ericson, Real-Time Collision Detection, 5.1.5]
+vec3 triangle_closest_point(triangle const& t, vec3 const& p)
+{
+    vec3 const ab = t.b-t.a, ac = t.c-t.a, ap = p-t.a;
+    float const d1 = dot(ab,ap), d2 = dot(ac,ap);
+    if(d1<=0 && d2<=0) return t.a;
+
+    vec3 const bp = p-t.b;
+    float const d3 = dot(ab,bp), d4 = dot(ac,bp);
+    if(d3>=0 && d4<=d3) return t.b;
+
+    float const vc = d1*d4 - d3*d2;
+    if(vc<=0 && d1>=0 && d3<=0) return t.a + d1/(d1-d3)*ab;
+
+    vec3 const cp = p-t.c;
+    float const d5 = dot(ab,cp), d6 = dot(ac,cp);
+    if(d6>=0 && d5<=d6) return t.c;
+
+    float const vb = d5*d2 - d1*d6;
+    if(vb<=0 && d2>=0 && d6<=0) return t.a + d2/(d2-d6)*ac;
+
+    float const va = d3*d6 - d5*d4;
+    if(va<=0 && (d4-d3)>=0 && (d5-d6)>=0) return t.b + (d4-d3)/((d4-d3)+(d5-d6))*(t.c-t.b);
+
+    float const denominator = 1/(va+vb+vc);
+    return t.a + (vb*denominator)*ab + (vc*denominator)*ac;
+}
+
+
+namespace
+{
+    struct bounds
+    {
+        vec3 p_min = { std::numeric_limits<float>::max(),  std::numeric_limits<float>::max(),  std::numeric_limits<float>::max()};
+        vec3 p_max = {-std::numeric_limits<float>::max(), -std::numeric_limits<float>::max(), -std::numeric_limits<float>::max()};
+
+        void add(vec3 const& p)
+        {
+            for(int i=0; i<3; ++i) {
+                p_min[i] = std::min(p_min[i], p[i]);
+                p_max[i] = std::max(p_max[i], p[i]);
+            }
+        }
+        void add(bounds const& b)
+        {
+            if(b.p_min.x <= b.p_max.x) { // Empty bins must not extend the box
+                add(b.p_min);
+                add(b.p_max);
+            }
+        }
+        float area() const
+        {
+            if(p_min.x > p_max.x)
+                return 0.0f;
+            vec3 const d = p_max-p_min;
+            return 2*(d.x*d.y + d.y*d.z + d.z*d.x);
+        }
+    };
+
+    struct build_item
+    {
+        bounds box;
+        vec3 centroid;
+        unsigned int triangle;
+    };
+
+    unsigned int const max_leaf_size = 4;
+    int const N_bin = 12;
+
+    void build_node(std::vector<triangle_bvh_node>& nodes, std::vector<build_item>& items, unsigned int first, unsigned int count, int depth)
+    {
+        size_t const k_node = nodes.size();
+        nodes.push_back(triangle_bvh_node());
+
+        bounds box, centroid_box;
+        for(unsigned int k=first; k<first+count; ++k) {
+            box.add(items[k].box);
+            centroid_box.add(items[k].centroid);
+        }
+        nodes[k_node].box_min = box.p_min;
+        nodes[k_node].box_max = box.p_max;
+
+        // Binned surface area heuristic: for each axis, evaluate the split between every two bins
+        //  cost = area(left) N(left) + area(right) N(right), compared to area(node) N (not splitting)
+        float best_cost = box.area()*count;
+        int best_axis = -1, best_split = 0;
+        if(count > max_leaf_size && depth < triangle_bvh::max_depth) {
+            for(int axis=0; axis<3; ++axis) {
+                float const c_min = centroid_box.p_min[axis], c_max = centroid_box.p_max[axis];
+                if(c_max <= c_min)
+                    continue;
+                float const scale = N_bin/(c_max-c_min);
+
+                bounds bin_box[N_bin];
+                unsigned int bin_count[N_bin] = {0};
+                for(unsigned int k=first; k<first+count; ++k) {
+                    int const b = std::min(N_bin-1, int((items[k].centroid[axis]-c_min)*scale));
+                    bin_box[b].add(items[k].box);
+                    bin_count[b]++;
+                }
+
+                // Sweep from the right to get the cost of every right part, then from the left
+                float right_cost[N_bin];
+                bounds right_box;
+                unsigned int right_count = 0;
+                for(int b=N_bin-1; b>0; --b) {
+                    right_box.add(bin_box[b]);
+                    right_count += bin_count[b];
+                    right_cost[b] = right_box.area()*right_count;
+                }
+                bounds left_box;
+                unsigned int left_count = 0;
+                for(int b=0; b<N_bin-1; ++b) {
+                    left_box.add(bin_box[b]);
+                    left_count += bin_count[b];
+                    float const cost = left_box.area()*left_count + right_cost[b+1];
+                    if(left_count>0 && left_count<count && cost<best_cost) {
+                        best_cost = cost;
+                        best_axis = axis;
+                        best_split = b+1;
+                    }
+                }
+            }
+        }
+
+        if(best_axis < 0) {
+            nodes[k_node].first = first;
+            nodes[k_node].count = count;
+            return;
+        }
+
+        float const c_min = centroid_box.p_min[best_axis];
+        float const scale = N_bin/(centroid_box.p_max[best_axis]-c_min);
+        build_item* const middle = std::partition(items.data()+first, items.data()+first+count, [&](build_item const& item) {
+            return std::min(N_bin-1, int((item.centroid[best_axis]-c_min)*scale)) < best_split;
+        });
+        unsigned int const N_left = (unsigned int)(middle - (items.data()+first));
+
+        build_node(nodes, items, first, N_left, depth+1);
+        nodes[k_node].first = (unsigned int)nodes.size();
+        build_node(nodes, items, first+N_left, count-N_left, depth+1);
+    }
+}
+
+void triangle_bvh::build(std::vector<triangle> const& triangles_arg)
+{
+    nodes.clear();
+    triangles.clear();
+    size_t const N = triangles_arg.size();
+    if(N == 0)
+        return;
+
+    std::vector<build_item> items(N);
+    for(size_t k=0; k<N; ++k) {
+        triangle const& t = triangles_arg[k];
+        items[k].box.add(t.a);
+        items[k].box.add(t.b);
+        items[k].box.add(t.c);
+        items[k].centroid = (t.a+t.b+t.c)/3.0f;
+        items[k].triangle = (unsigned int)k;
+    }
+    build_node(nodes, items, 0, (unsigned int)N, 0);
+
+    // Store the triangles in the leaf order
+    triangles.resize(N);
+    for(size_t k=0; k<N; ++k)
+        triangles[k] = triangles_arg[items[k].triangle];
+}
+
+float triangle_bvh::distance(vec3 const& p, float max_distance, vec3& normal, triangle_bvh_stats& stats) const
+{
+    stats.queries++;
+    float best = max_distance;
+    if(nodes.empty())
+        return best;
+
+    // At most one pending sibling per level of the hierarchy
+    unsigned int stack[triangle_bvh::max_depth+1];
+    int N_stack = 0;
+    stack[N_stack++] = 0;
+    while(N_stack > 0)
+    {
+        triangle_bvh_node const& node = nodes[stack[--N_stack]];
+        stats.nodes_visited++;
+        // The search radius shrinks as closer triangles are found
+        if(p.x+best < node.box_min.x || p.x-best > node.box_max.x ||
+           p.y+best < node.box_min.y || p.y-best > node.box_max.y ||
+           p.z+best < node.box_min.z || p.z-best > node.box_max.z)
+            continue;
+
+        if(node.count == 0) {
+            unsigned int const k_node = (unsigned int)(&node - nodes.data());
+            assert_vcl_no_msg(N_stack+2 <= triangle_bvh::max_depth+1);
+            stack[N_stack++] = node.first;
+            stack[N_stack++] = k_node+1;
+            continue;
+        }
+
+        for(unsigned int k=node.first; k<node.first+node.count; ++k) {
+            stats.triangles_tested++;
+            triangle const& t = triangles[k];
+            vec3 const d = p-triangle_closest_point(t, p);
+            float const d2 = dot(d,d);
+            if(d2 >= best*best)
+                continue;
+
+            vec3 const n = cross(t.b-t.a, t.c-t.a);
+            if(d2 > 1e-12f)
+                normal = d/std::sqrt(d2);
+            else if(norm(n) > 0)
+                normal = normalize(n);
+            else
+                continue; // Degenerate triangle
+            best = std::sqrt(d2);
+        }
+    }
+    return best;
+}
+
+void triangle_bvh::collide(vec3& p, vec3& v, float r, triangle_bvh_stats& stats) const
+{
+    stats.queries++;
+    if(nodes.empty())
+        return;
+
+    // At most one pending sibling per level of the hierarchy
+    unsigned int stack[triangle_bvh::max_depth+1];
+    int N_stack = 0;
+    stack[N_stack++] = 0;
+    while(N_stack > 0)
+    {
+        triangle_bvh_node const& node = nodes[stack[--N_stack]];
+        stats.nodes_visited++;
+        if(p.x+r < node.box_min.x || p.x-r > node.box_max.x ||
+           p.y+r < node.box_min.y || p.y-r > node.box_max.y ||
+           p.z+r < node.box_min.z || p.z-r > node.box_max.z)
+            continue;
+
+        if(node.count == 0) {
+            unsigned int const k_node = (unsigned int)(&node - nodes.data());
+            assert_vcl_no_msg(N_stack+2 <= triangle_bvh::max_depth+1);
+            stack[N_stack++] = node.first;
+            stack[N_stack++] = k_node+1;
+            continue;
+        }
+
+        for(unsigned int k=node.first; k<node.first+node.count; ++k) {
+            stats.triangles_tested++;
+            triangle const& t = triangles[k];
+            vec3 const q = triangle_closest_point(t, p);
+            vec3 const d = p-q;
+            float const d2 = dot(d,d);
+            if(d2 >= r*r)
+                continue;
+
+            // Push along the direction from the closest point, or along the face normal when the center is on the triangle
+            float const distance = std::sqrt(d2);
+            vec3 n = cross(t.b-t.a, t.c-t.a);
+            if(distance > 1e-6f)
+                n = d/distance;
+            else if(norm(n) > 0)
+                n = normalize(n);
+            else
+                continue; // Degenerate triangle
+            collision_sphere_plane(p, v, r, n, q);
+            stats.contacts++;
+        }
+    }
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include "vcl/vcl.hpp"
+#include <vector>
+
+struct triangle
+{
+    vcl::vec3 a, b, c;
+};
+
+// Append the triangles of a mesh placed by transform (world position = translate + rotate*(scale*p))
+void triangles_append(std::vector<triangle>& triangles, vcl::mesh const& m, vcl::affine_rts const& transform);
+void triangles_append(std::vector<triangle>& triangles, vcl::vec3 const* position, vcl::uint3 const* connectivity, size_t N_triangle, vcl::affine_rts const& transform);
+
+// Node of the hierarchy, stored in depth-first order
+//  Leaves have count>0 and contain the triangles first ... first+count-1.
+//  Inner nodes have count=0: their first child is the next node, the second one is node first.
+struct triangle_bvh_node
+{
+    vcl::vec3 box_min;
+    unsigned int first = 0;
+    vcl::vec3 box_max;
+    unsigned int count = 0;
+};
+
+// Cost of the queries, accumulated until reset
+struct triangle_bvh_stats
+{
+    size_t queries = 0;
+    size_t nodes_visited = 0;
+    size_t triangles_tested = 0;
+    size_t contacts = 0;
+};
+
+// Static triangle soup with a bounding volume hierarchy built with the surface area heuristic (binned)
+//  The triangles are reordered so that the triangles of a leaf are contiguous.
+struct triangle_bvh
+{
+    std::vector<triangle> triangles;
+    std::vector<triangle_bvh_node> nodes;
+
+    // Deeper nodes are made leaves whatever their size, which bounds the traversal stack of the queries
+    static int const max_depth = 48;
+
+    void build(std::vector<triangle> const& triangles_arg);
+
+    // Push the sphere out of every triangle it overlaps, with the same response as the walls
+    void collide(vcl::vec3& p, vcl::vec3& v, float r, triangle_bvh_stats& stats) const;
+
+    // Distance from p to the closest triangle, or max_distance when no triangle is closer
+    //  normal: direction from the closest point to p (face normal when p is on the triangle)
+    float distance(vcl::vec3 const& p, float max_distance, vcl::vec3& normal, triangle_bvh_stats& stats) const;
+};
+
+// Closest point of the triangle to p
+vcl::vec3 triangle_closest_point(triangle const& t, vcl::vec3 const& p);